@@ -0,0 +1,257 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "ConcordBytecode.h"
+#include "ConcordExpression.h"
+#include "Transformers/ConcordTransformerBinaryOperators.h"
+#include "Transformers/ConcordTransformerUnaryOperators.h"
+#include "Transformers/ConcordTransformerReductions.h"
+#include "Transformers/ConcordTransformerGetDynamic.h"
+#include "Transformers/ConcordTransformerTable.h"
+
+void FConcordProgram::Compile(const TArray<FConcordSharedExpression>& RootExpressions)
+{
+    Instructions.Reset();
+    Operands.Reset();
+    IntValues.Reset();
+    FloatValues.Reset();
+    Fallbacks.Reset();
+    ResultRegisters.Reset(RootExpressions.Num());
+    RegisterCount = 0;
+    FLowering Lowering;
+    for (const FConcordSharedExpression& RootExpression : RootExpressions)
+        ResultRegisters.Add(Lower(RootExpression, Lowering));
+}
+
+int32 FConcordProgram::Lower(const FConcordSharedExpression& Expression, FLowering& Lowering)
+{
+    if (const int32* Register = Lowering.Registers.Find(&Expression.Get())) return *Register;
+    if (Expression->AsGetExpression() || Expression->AsTableExpression()) return LowerLookup(Expression, Lowering);
+
+    FInstruction Instruction = { EConcordOpcode::Fallback, INDEX_NONE, INDEX_NONE, INDEX_NONE };
+    if (const FConcordRandomVariableExpression* RandomVariableExpression = Expression->AsRandomVariableExpression())
+    {
+        Instruction.Opcode = EConcordOpcode::RandomVariable;
+        Instruction.A = RandomVariableExpression->FlatIndex;
+    }
+    else if (const FConcordParameterExpression<int32>* IntParameterExpression = Expression->AsIntParameterExpression())
+    {
+        Instruction.Opcode = EConcordOpcode::IntParameter;
+        Instruction.A = IntParameterExpression->FlatIndex;
+    }
+    else if (const FConcordParameterExpression<float>* FloatParameterExpression = Expression->AsFloatParameterExpression())
+    {
+        Instruction.Opcode = EConcordOpcode::FloatParameter;
+        Instruction.A = FloatParameterExpression->FlatIndex;
+    }
+    else if (const FConcordValueExpression<int32>* IntValueExpression = Expression->AsIntValueExpression())
+    {
+        Instruction.Opcode = EConcordOpcode::IntValue;
+        Instruction.A = IntValues.AddUnique(IntValueExpression->Value);
+    }
+    else if (const FConcordValueExpression<float>* FloatValueExpression = Expression->AsFloatValueExpression())
+    {
+        Instruction.Opcode = EConcordOpcode::FloatValue;
+        Instruction.A = FloatValues.AddUnique(FloatValueExpression->Value);
+    }
+    else if (const FConcordComputingExpression* ComputingExpression = Expression->AsComputingExpression())
+    {
+        Instruction.Opcode = ComputingExpression->GetOpcode();
+        if (Instruction.Opcode != EConcordOpcode::Fallback)
+        {
+            const TArray<FConcordSharedExpression>& SourceExpressions = ComputingExpression->SourceExpressions;
+            if (Instruction.Opcode >= EConcordOpcode::SumInt)
+            {
+                TArray<int32> SourceRegisters;
+                for (const FConcordSharedExpression& SourceExpression : SourceExpressions)
+                    SourceRegisters.Add(Lower(SourceExpression, Lowering));
+                Instruction.A = Operands.Num();
+                Instruction.B = SourceRegisters.Num();
+                Operands.Append(SourceRegisters);
+            }
+            else
+            {
+                Instruction.A = Lower(SourceExpressions[0], Lowering);
+                if (SourceExpressions.Num() > 1) Instruction.B = Lower(SourceExpressions[1], Lowering);
+            }
+        }
+    }
+    if (Instruction.Opcode == EConcordOpcode::Fallback) Instruction.A = Fallbacks.Add(Expression);
+    else
+    {
+        // value numbering, equal instructions on equal registers compute the same value
+        uint32 Hash = HashCombine(GetTypeHash(uint8(Instruction.Opcode)), HashCombine(GetTypeHash(Instruction.B), GetTypeHash(Instruction.A)));
+        if (Instruction.Opcode >= EConcordOpcode::SumInt)
+            for (int32 OperandIndex = Instruction.A; OperandIndex < Instruction.A + Instruction.B; ++OperandIndex) Hash = HashCombine(Hash, GetTypeHash(Operands[OperandIndex]));
+        TArray<int32, TInlineAllocator<4>> CandidateIndices;
+        Lowering.ValueNumbers.MultiFind(Hash, CandidateIndices);
+        for (int32 CandidateIndex : CandidateIndices)
+            if (IsSameValue(Instruction, Instructions[CandidateIndex]))
+            {
+                if (Instruction.Opcode >= EConcordOpcode::SumInt) Operands.SetNum(Instruction.A);
+                return AddRegister(Expression, Instructions[CandidateIndex].Target, Lowering);
+            }
+        Lowering.ValueNumbers.Add(Hash, Instructions.Num());
+        Lowering.ValueNumberLog.Emplace(Hash, Instructions.Num());
+    }
+
+    Instruction.Target = RegisterCount++;
+    Instructions.Add(Instruction);
+    return AddRegister(Expression, Instruction.Target, Lowering);
+}
+
+int32 FConcordProgram::LowerLookup(const FConcordSharedExpression& Expression, FLowering& Lowering)
+{
+    // Get sources are the index, the default value and the values, Table sources are the multi index and the entries
+    const TArray<FConcordSharedExpression>& SourceExpressions = Expression->AsComputingExpression()->SourceExpressions;
+    const FConcordTransformerTableExpression* TableExpression = Expression->AsTableExpression();
+    const int32 IndexCount = TableExpression ? TableExpression->GetTableShape().Num() : 1;
+    TArray<int32> IndexRegisters;
+    for (int32 SourceIndex = 0; SourceIndex < IndexCount; ++SourceIndex) IndexRegisters.Add(Lower(SourceExpressions[SourceIndex], Lowering));
+
+    // operands are the index registers, the table shape and the first instruction of the default branch and of each value branch,
+    // B is the value count of a Get and the dimension count of a Table
+    const int32 ValueOffset = TableExpression ? IndexCount : 2;
+    const int32 BranchCount = 1 + SourceExpressions.Num() - ValueOffset;
+    const FInstruction Instruction = { TableExpression ? EConcordOpcode::Table : EConcordOpcode::Get, RegisterCount++, Operands.Num(), TableExpression ? IndexCount : BranchCount - 1 };
+    Operands.Append(IndexRegisters);
+    if (TableExpression) Operands.Append(TableExpression->GetTableShape());
+    const int32 FirstBranchOperand = Operands.Num();
+    Operands.AddUninitialized(BranchCount);
+    Instructions.Add(Instruction);
+
+    TArray<int32> JumpIndices;
+    for (int32 BranchIndex = 0; BranchIndex < BranchCount; ++BranchIndex)
+    {
+        Operands[FirstBranchOperand + BranchIndex] = Instructions.Num();
+        const int32 RegisterLogNum = Lowering.RegisterLog.Num();
+        const int32 ValueNumberLogNum = Lowering.ValueNumberLog.Num();
+        int32 BranchRegister;
+        if (BranchIndex > 0) BranchRegister = Lower(SourceExpressions[ValueOffset + BranchIndex - 1], Lowering);
+        else if (!TableExpression) BranchRegister = Lower(SourceExpressions[1], Lowering);
+        else
+        {
+            // out of range table lookups return 0
+            BranchRegister = RegisterCount++;
+            Instructions.Add({ EConcordOpcode::IntValue, BranchRegister, IntValues.AddUnique(0), INDEX_NONE });
+        }
+        JumpIndices.Add(Instructions.Add({ EConcordOpcode::Jump, Instruction.Target, BranchRegister, INDEX_NONE }));
+
+        for (int32 LogIndex = RegisterLogNum; LogIndex < Lowering.RegisterLog.Num(); ++LogIndex)
+            Lowering.Registers.Remove(Lowering.RegisterLog[LogIndex]);
+        for (int32 LogIndex = ValueNumberLogNum; LogIndex < Lowering.ValueNumberLog.Num(); ++LogIndex)
+            Lowering.ValueNumbers.RemoveSingle(Lowering.ValueNumberLog[LogIndex].Key, Lowering.ValueNumberLog[LogIndex].Value);
+        Lowering.RegisterLog.SetNum(RegisterLogNum);
+        Lowering.ValueNumberLog.SetNum(ValueNumberLogNum);
+    }
+    for (int32 JumpIndex : JumpIndices) Instructions[JumpIndex].B = Instructions.Num();
+    return AddRegister(Expression, Instruction.Target, Lowering);
+}
+
+int32 FConcordProgram::AddRegister(const FConcordSharedExpression& Expression, int32 Register, FLowering& Lowering)
+{
+    Lowering.Registers.Add(&Expression.Get(), Register);
+    Lowering.RegisterLog.Add(&Expression.Get());
+    return Register;
+}
+
+bool FConcordProgram::IsSameValue(const FInstruction& Instruction, const FInstruction& Other) const
+{
+    if (Instruction.Opcode != Other.Opcode || Instruction.B != Other.B) return false;
+    if (Instruction.Opcode < EConcordOpcode::SumInt) return Instruction.A == Other.A;
+    for (int32 OperandIndex = 0; OperandIndex < Instruction.B; ++OperandIndex)
+        if (Operands[Instruction.A + OperandIndex] != Operands[Other.A + OperandIndex]) return false;
+    return true;
+}
+
+#define CONCORD_BYTECODE_BINARY_CASE_TYPED(Name, Type, FValue)\
+    case EConcordOpcode::Name##Type:\
+    {\
+        const FValue V0 = Registers[Instruction.A].Get<FValue>();\
+        const FValue V1 = Registers[Instruction.B].Get<FValue>();\
+        Registers[Instruction.Target] = CONCORD_##Name(V);\
+        break;\
+    }
+#define CONCORD_BYTECODE_BINARY_CASE(Name) CONCORD_BYTECODE_BINARY_CASE_TYPED(Name, Int, int32) CONCORD_BYTECODE_BINARY_CASE_TYPED(Name, Float, float)
+
+#define CONCORD_BYTECODE_UNARY_CASE_TYPED(Name, Type, FValue)\
+    case EConcordOpcode::Name##Type: Registers[Instruction.Target] = CONCORD_##Name(Registers[Instruction.A].Get<FValue>()); break;
+#define CONCORD_BYTECODE_UNARY_CASE(Name) CONCORD_BYTECODE_UNARY_CASE_TYPED(Name, Int, int32) CONCORD_BYTECODE_UNARY_CASE_TYPED(Name, Float, float)
+
+#define CONCORD_BYTECODE_REDUCTION_CASE_TYPED(Name, Type, FSourceValue, FAccumulator, DefaultValue)\
+    case EConcordOpcode::Name##Type:\
+    {\
+        using FValue = FSourceValue;\
+        FAccumulator Acc = DefaultValue;\
+        for (int32 OperandIndex = Instruction.A; OperandIndex < Instruction.A + Instruction.B; ++OperandIndex)\
+            CONCORD_##Name(Registers[Operands[OperandIndex]].Get<FValue>());\
+        Registers[Instruction.Target] = Acc;\
+        break;\
+    }
+#define CONCORD_BYTECODE_REDUCTION_CASE(Name, FAccumulator, DefaultValue)\
+    CONCORD_BYTECODE_REDUCTION_CASE_TYPED(Name, Int, int32, FAccumulator, DefaultValue)\
+    CONCORD_BYTECODE_REDUCTION_CASE_TYPED(Name, Float, float, FAccumulator, DefaultValue)
+
+#define CONCORD_BYTECODE_CLAMP_CASE(Type, FValue)\
+    case EConcordOpcode::Clamp##Type:\
+    {\
+        const FValue X = Registers[Operands[Instruction.A]].Get<FValue>();\
+        const FValue Min = Registers[Operands[Instruction.A + 1]].Get<FValue>();\
+        const FValue Max = Registers[Operands[Instruction.A + 2]].Get<FValue>();\
+        Registers[Instruction.Target] = X < Min ? Min : (X > Max ? Max : X);\
+        break;\
+    }
+
+const FConcordValue* FConcordProgram::Run(const FConcordExpressionContext<float>& Context) const
+{
+    // per thread so the parallel engines evaluate without allocating
+    thread_local TArray<FConcordValue> ThreadRegisters;
+    if (ThreadRegisters.Num() < RegisterCount) ThreadRegisters.SetNumUninitialized(RegisterCount);
+    FConcordValue* Registers = ThreadRegisters.GetData();
+
+    for (int32 InstructionIndex = 0; InstructionIndex < Instructions.Num(); ++InstructionIndex)
+    {
+        const FInstruction& Instruction = Instructions[InstructionIndex];
+        switch (Instruction.Opcode)
+        {
+        case EConcordOpcode::Fallback: Registers[Instruction.Target] = Fallbacks[Instruction.A]->ComputeValue(Context); break;
+        case EConcordOpcode::RandomVariable: Registers[Instruction.Target] = Context.Variation[Instruction.A]; break;
+        case EConcordOpcode::IntParameter: Registers[Instruction.Target] = Context.IntParameters[Instruction.A]; break;
+        case EConcordOpcode::FloatParameter: Registers[Instruction.Target] = Context.FloatParameters[Instruction.A]; break;
+        case EConcordOpcode::IntValue: Registers[Instruction.Target] = IntValues[Instruction.A]; break;
+        case EConcordOpcode::FloatValue: Registers[Instruction.Target] = FloatValues[Instruction.A]; break;
+        case EConcordOpcode::Cast: Registers[Instruction.Target] = float(Registers[Instruction.A].Int); break;
+        CONCORD_BYTECODE_BINARY_OPERATORS(CONCORD_BYTECODE_BINARY_CASE)
+        CONCORD_BYTECODE_UNARY_OPERATORS(CONCORD_BYTECODE_UNARY_CASE)
+        CONCORD_BYTECODE_REDUCTIONS(CONCORD_BYTECODE_REDUCTION_CASE)
+        CONCORD_BYTECODE_CLAMP_CASE(Int, int32)
+        CONCORD_BYTECODE_CLAMP_CASE(Float, float)
+        case EConcordOpcode::Get:
+        {
+            // the default branch comes first, an index out of range selects it
+            const int32 Index = Registers[Operands[Instruction.A]].Int;
+            const int32 Branch = Index >= 0 && Index < Instruction.B ? 1 + Index : 0;
+            InstructionIndex = Operands[Instruction.A + 1 + Branch] - 1;
+            break;
+        }
+        case EConcordOpcode::Table:
+        {
+            int32 Branch = 1; int32 Stride = 1;
+            for (int32 DimIndex = Instruction.B - 1; DimIndex >= 0; --DimIndex)
+            {
+                const int32 Index = Registers[Operands[Instruction.A + DimIndex]].Int;
+                const int32 DimSize = Operands[Instruction.A + Instruction.B + DimIndex];
+                if (Index < 0 || Index >= DimSize) { Branch = 0; break; }
+                Branch += Index * Stride; Stride *= DimSize;
+            }
+            InstructionIndex = Operands[Instruction.A + 2 * Instruction.B + Branch] - 1;
+            break;
+        }
+        case EConcordOpcode::Jump:
+            Registers[Instruction.Target] = Registers[Instruction.A];
+            InstructionIndex = Instruction.B - 1;
+            break;
+        default: checkNoEntry();
+        }
+    }
+    return Registers;
+}
@@ -12,6 +12,7 @@
 #include "ConcordFactorGraphDynamic.h"
 #include "Transformers/ConcordTransformerGetDynamic.h"
 #include "Transformers/ConcordTransformerTable.h"
+#include "Async/ParallelFor.h"
 
 DEFINE_LOG_CATEGORY(LogConcordCompiler);
 
@@ -41,6 +42,7 @@ FConcordCompiler::FResult FConcordCompiler::Compile(const UConcordModel* Model,
     if ((Result.Error = Compiler.SetDisjointSubgraphRootFlatRandomVariableIndices(Result.FactorGraph.Get()))) return MoveTemp(Result);
     if ((Result.Error = Compiler.HandleCycles(CycleMode, Result.FactorGraph.Get()))) return MoveTemp(Result);
     Result.FactorGraph->CompactAndShrink();
+    UE_LOG(LogConcordCompiler, Verbose, TEXT("Shared %i structurally identical expressions."), Compiler.Interner.GetSharedCount());
     return MoveTemp(Result);
 }
 
@@ -76,6 +78,7 @@ TOptional<FConcordError> FConcordCompiler::CompileCompositeModel(const TStrongOb
     }
 
     // Setup factors and get expressions
+    TArray<FTransformerIndex> FactorIndices;
     for (UConcordFactor* Factor : CompositeModel->Factors)
     {
         if (TOptional<FConcordError> Error = Factor->SetupGraph(VisitedVertices))
@@ -83,8 +86,9 @@ TOptional<FConcordError> FConcordCompiler::CompileCompositeModel(const TStrongOb
         check(Factor->GetType() == EConcordValueType::Float);
 
         ConcordShape::FShapeIterator It(Factor->GetShape());
-        while (It.HasNext()) AddHandle(Factor->GetExpression(It.Next()), FactorGraph);
+        while (It.HasNext()) FactorIndices.Add({ Factor, It.Next() });
     }
+    AddHandles(GetFoldedExpressions(FactorIndices), FactorGraph);
 
     // Setup emissions
     for (UConcordEmission* Emission : CompositeModel->Emissions)
@@ -103,10 +107,11 @@ TOptional<FConcordError> FConcordCompiler::CompileCompositeModel(const TStrongOb
         // Only get output expressions for root model
         if (ModelPath.Num() == 1)
         {
-            TArray<FConcordSharedExpression> ConnectedExpressions;
+            TArray<FTransformerIndex> OutputIndices;
             ConcordShape::FShapeIterator It(Output->GetShape());
-            while (It.HasNext())
-                ConnectedExpressions.Add(Output->GetConnectedTransformers()[0]->GetExpression(It.Next()));
+            while (It.HasNext()) OutputIndices.Add({ Output->GetConnectedTransformers()[0], It.Next() });
+            TArray<FConcordSharedExpression> ConnectedExpressions = GetFoldedExpressions(OutputIndices);
+            for (FConcordSharedExpression& ConnectedExpression : ConnectedExpressions) ConnectedExpression = Interner.Intern(ConnectedExpression);
             FactorGraph.Outputs.Add(NameOutputPair.Key, MakeUnique<FOutput>(Output->GetType(), MoveTemp(ConnectedExpressions)));
         }
     }
@@ -240,7 +245,7 @@ TOptional<FConcordError> FConcordCompiler::SetupInstance(const FName& InstanceNa
             FConcordSharedExpression Expression = ConnectedTransformer->GetExpression(It.Next());
             Expression->AddNeighboringFlatRandomVariableIndices(NeighboringFlatRandomVariableIndices);
             if (!NeighboringFlatRandomVariableIndices.IsEmpty()) return MakeCompositeError({ Instance, TEXT("An instance cannot depend on random variables of the instancing model.") });
-            ConnectedExpressions.Add(MoveTemp(Expression));
+            ConnectedExpressions.Add(Interner.Intern(Folder.Fold(Expression)));
         }
         if (ConnectedExpressions.Num() != BlockPtr->Size)
             return MakeCompositeError({ Instance, FString::Printf(TEXT("Flat number of expressions connected to %s does not match the expected size %i."), *ParameterName.ToString(), BlockPtr->Size) });
@@ -360,7 +365,8 @@ void FConcordCompiler::AddParameter(const FName& ParameterName, UConcordParamete
         FactorGraph.GetParameterDefaultValues<FValue>().Add(Parameter->GetDefaultValue(FlatParameterLocalIndex).Get<FValue>());
         GetAllParameterExpressions<FValue>().Add(MakeShared<const FConcordParameterExpression<FValue>>(GetParameterBlockOffset<FValue>() + FlatParameterLocalIndex));
     }
-    Parameter->ExpressionDelegate.BindRaw(this, &FConcordCompiler::GetParameterExpression<FValue>, Parameter->GetShape(), GetParameterBlockOffset<FValue>());
+    if (Parameter->bFrozen) Parameter->ExpressionDelegate.BindRaw(this, &FConcordCompiler::GetFrozenParameterExpression<FValue>, static_cast<const UConcordParameter*>(Parameter));
+    else Parameter->ExpressionDelegate.BindRaw(this, &FConcordCompiler::GetParameterExpression<FValue>, Parameter->GetShape(), GetParameterBlockOffset<FValue>());
     GetParameterBlockOffset<FValue>() += Size;
 }
 
@@ -393,9 +399,46 @@ void FConcordCompiler::AddEmissionParameter(const FName& EmissionParameterName,
 #endif
 }
 
-void FConcordCompiler::AddHandle(const FConcordSharedExpression& FactorExpression, FConcordFactorGraph<float>& FactorGraph) const
+TArray<FConcordSharedExpression> FConcordCompiler::GetFoldedExpressions(const TArray<FTransformerIndex>& TransformerIndices)
 {
-    FactorGraph.Handles.Add(MakeUnique<FAtomicHandle>(FactorExpression));
+    // Transformers build their expressions through UObject code, so that runs here on the calling thread and only the folding is parallel.
+    // Each chunk folds with its own folder, expressions folded in different chunks are separate instances, interning afterwards only
+    // merges the ones that compare by operation. Composites and instances still compile one after another as they share the compiler state.
+    constexpr int32 ChunkSize = 256;
+    TArray<TSharedPtr<const FConcordExpression>> Expressions;
+    Expressions.Reserve(TransformerIndices.Num());
+    for (const FTransformerIndex& TransformerIndex : TransformerIndices) Expressions.Add(TransformerIndex.Key->GetExpression(TransformerIndex.Value));
+    ParallelFor(FMath::DivideAndRoundUp(Expressions.Num(), ChunkSize), [&](int32 ChunkIndex)
+    {
+        FConcordExpressionFolder ChunkFolder;
+        const int32 End = FMath::Min((ChunkIndex + 1) * ChunkSize, Expressions.Num());
+        for (int32 Index = ChunkIndex * ChunkSize; Index < End; ++Index)
+            Expressions[Index] = ChunkFolder.Fold(Expressions[Index].ToSharedRef());
+    });
+    TArray<FConcordSharedExpression> FoldedExpressions;
+    FoldedExpressions.Reserve(Expressions.Num());
+    for (const TSharedPtr<const FConcordExpression>& Expression : Expressions) FoldedExpressions.Add(Expression.ToSharedRef());
+    return MoveTemp(FoldedExpressions);
+}
+
+void FConcordCompiler::AddHandle(const FConcordSharedExpression& FactorExpression, FConcordFactorGraph<float>& FactorGraph)
+{
+    AddHandles({ Folder.Fold(FactorExpression) }, FactorGraph);
+}
+
+void FConcordCompiler::AddHandles(TArray<FConcordSharedExpression>&& FoldedFactorExpressions, FConcordFactorGraph<float>& FactorGraph)
+{
+    // interning and registration run in order so the factor graph does not depend on scheduling
+    for (FConcordSharedExpression& FactorExpression : FoldedFactorExpressions) FactorExpression = Interner.Intern(FactorExpression);
+    TArray<TUniquePtr<FAtomicHandle>> Handles;
+    Handles.SetNum(FoldedFactorExpressions.Num());
+    ParallelFor(Handles.Num(), [&](int32 Index) { Handles[Index] = MakeUnique<FAtomicHandle>(FoldedFactorExpressions[Index]); }, Handles.Num() < 64);
+    for (TUniquePtr<FAtomicHandle>& Handle : Handles) RegisterHandle(MoveTemp(Handle), FactorGraph);
+}
+
+void FConcordCompiler::RegisterHandle(TUniquePtr<FAtomicHandle>&& Handle, FConcordFactorGraph<float>& FactorGraph) const
+{
+    FactorGraph.Handles.Add(MoveTemp(Handle));
     for (int32 FlatRandomVariableIndex : FactorGraph.Handles.Last()->GetNeighboringFlatRandomVariableIndices())
         FactorGraph.RandomVariableNeighboringHandles[FlatRandomVariableIndex].AddUnique(FactorGraph.Handles.Last().Get());
 }
@@ -435,81 +478,192 @@ void FConcordCompiler::AddConnected(int32 FlatRandomVariableIndex, TSet<int32>&
                 AddConnected(NeighboringIndex, AddedFlatRandomVariableIndices, FactorGraph);
 }
 
+namespace
+{
+    struct FUnionFind
+    {
+        FUnionFind(int32 Num) { Parents.SetNumUninitialized(Num); for (int32 Index = 0; Index < Num; ++Index) Parents[Index] = Index; }
+        int32 Find(int32 Index)
+        {
+            while (Parents[Index] != Index) Index = Parents[Index] = Parents[Parents[Index]];
+            return Index;
+        }
+        void Union(int32 A, int32 B) { A = Find(A); B = Find(B); if (A != B) Parents[FMath::Max(A, B)] = FMath::Min(A, B); }
+        TArray<int32> Parents;
+    };
+
+    // Nodes of a cycle in a biconnected component with more than one edge, the shortest way back around its first edge.
+    TArray<int32> FindCycle(const TArray<TPair<int32, int32>>& ComponentEdges)
+    {
+        TMultiMap<int32, int32> Neighbors;
+        for (int32 EdgeIndex = 1; EdgeIndex < ComponentEdges.Num(); ++EdgeIndex)
+        {
+            Neighbors.Add(ComponentEdges[EdgeIndex].Key, ComponentEdges[EdgeIndex].Value);
+            Neighbors.Add(ComponentEdges[EdgeIndex].Value, ComponentEdges[EdgeIndex].Key);
+        }
+        const int32 Start = ComponentEdges[0].Value;
+        const int32 Goal = ComponentEdges[0].Key;
+        TMap<int32, int32> Predecessors;
+        Predecessors.Add(Start, INDEX_NONE);
+        TArray<int32> Queue = { Start };
+        for (int32 QueueIndex = 0; QueueIndex < Queue.Num() && !Predecessors.Contains(Goal); ++QueueIndex)
+            for (auto It = Neighbors.CreateConstKeyIterator(Queue[QueueIndex]); It; ++It)
+                if (!Predecessors.Contains(It.Value()))
+                {
+                    Predecessors.Add(It.Value(), Queue[QueueIndex]);
+                    Queue.Add(It.Value());
+                }
+        TArray<int32> Cycle;
+        for (int32 Node = Goal; Node != INDEX_NONE; Node = Predecessors[Node]) Cycle.Add(Node);
+        return MoveTemp(Cycle);
+    }
+}
+
 TOptional<FConcordError> FConcordCompiler::HandleCycles(EConcordCycleMode CycleMode, FConcordFactorGraph<float>& FactorGraph) const
 {
-    TArray<int32> RandomVariablePath;
-    TArray<const FConcordHandle*> FactorPath;
-    for (int32 RootFlatRandomVariableIndex : FactorGraph.DisjointSubgraphRootFlatRandomVariableIndices)
+    // Biconnected components of the bipartite graph of random variables (nodes [0, V)) and handles (nodes [V, V + H)) in one iterative pass,
+    // every component with more than one edge contains a cycle.
+    const int32 RandomVariableCount = FactorGraph.GetRandomVariableCount();
+    const int32 HandleCount = FactorGraph.Handles.Num();
+    TMap<const FConcordHandle*, int32> HandleIndices;
+    for (int32 HandleIndex = 0; HandleIndex < HandleCount; ++HandleIndex) HandleIndices.Add(FactorGraph.Handles[HandleIndex].Get(), HandleIndex);
+    auto GetDegree = [&](int32 Node)
+    {
+        return Node < RandomVariableCount ? FactorGraph.RandomVariableNeighboringHandles[Node].Num() : FactorGraph.Handles[Node - RandomVariableCount]->GetNeighboringFlatRandomVariableIndices().Num();
+    };
+    auto GetNeighbor = [&](int32 Node, int32 NeighborIndex)
+    {
+        return Node < RandomVariableCount ? RandomVariableCount + HandleIndices[FactorGraph.RandomVariableNeighboringHandles[Node][NeighborIndex]] : FactorGraph.Handles[Node - RandomVariableCount]->GetNeighboringFlatRandomVariableIndices()[NeighborIndex];
+    };
+
+    struct FFrame { int32 Node; int32 Parent; int32 NextNeighborIndex; };
+    TArray<int32> Discovery, Low;
+    Discovery.Init(INDEX_NONE, RandomVariableCount + HandleCount);
+    Low.SetNumUninitialized(RandomVariableCount + HandleCount);
+    TArray<FFrame> Stack;
+    TArray<TPair<int32, int32>> EdgeStack;
+    FUnionFind HandleSets(HandleCount);
+    TArray<bool> HandleMergeMask;
+    HandleMergeMask.SetNumZeroed(HandleCount);
+    TArray<TPair<int32, int32>> ComponentEdges;
+    TArray<TPair<int32, int32>> FirstCycleEdges;
+    TArray<int32> ComponentStamps; // last component a node was collected into
+    ComponentStamps.Init(INDEX_NONE, RandomVariableCount + HandleCount);
+    int32 ComponentCount = 0;
+    int32 Time = 0;
+    for (int32 RootNode = 0; RootNode < RandomVariableCount + HandleCount; ++RootNode)
     {
-        bool bSubgraphHasCycles = true;
-        while (bSubgraphHasCycles)
+        if (Discovery[RootNode] != INDEX_NONE) continue;
+        Discovery[RootNode] = Low[RootNode] = Time++;
+        Stack.Add({ RootNode, INDEX_NONE, 0 });
+        while (!Stack.IsEmpty())
         {
-            bSubgraphHasCycles = false;
-            for (const auto* Handle : FactorGraph.GetNeighboringHandles(RootFlatRandomVariableIndex))
-                if (MergeCycle(RootFlatRandomVariableIndex, Handle, RandomVariablePath, FactorPath, FactorGraph))
+            FFrame& Frame = Stack.Last();
+            const int32 Node = Frame.Node;
+            if (Frame.NextNeighborIndex < GetDegree(Node))
+            {
+                const int32 Neighbor = GetNeighbor(Node, Frame.NextNeighborIndex++);
+                if (Discovery[Neighbor] == INDEX_NONE)
+                {
+                    EdgeStack.Add({ Node, Neighbor });
+                    Discovery[Neighbor] = Low[Neighbor] = Time++;
+                    Stack.Add({ Neighbor, Node, 0 });
+                }
+                else if (Neighbor != Frame.Parent && Discovery[Neighbor] < Discovery[Node])
                 {
-                    if (CycleMode == EConcordCycleMode::Error) return GetCycleError(RandomVariablePath, FactorGraph);
-                    if (CycleMode == EConcordCycleMode::Ignore) { FactorGraph.bHasCycle = true; return {}; }
-                    bSubgraphHasCycles = true;
-                    RandomVariablePath.Reset();
-                    FactorPath.Reset();
-                    break;
+                    EdgeStack.Add({ Node, Neighbor });
+                    Low[Node] = FMath::Min(Low[Node], Discovery[Neighbor]);
                 }
+                continue;
+            }
+            const int32 Parent = Frame.Parent;
+            Stack.Pop(false);
+            if (Parent == INDEX_NONE) continue;
+            Low[Parent] = FMath::Min(Low[Parent], Low[Node]);
+            if (Low[Node] < Discovery[Parent]) continue;
+
+            // Parent separates the component on the edge stack down to (Parent, Node)
+            TArray<int32> ComponentHandleIndices;
+            ComponentEdges.Reset();
+            const int32 ComponentIndex = ComponentCount++;
+            while (true)
+            {
+                const TPair<int32, int32> Edge = EdgeStack.Pop(false);
+                ComponentEdges.Add(Edge);
+                for (int32 EdgeNode : { Edge.Key, Edge.Value })
+                {
+                    if (ComponentStamps[EdgeNode] == ComponentIndex) continue;
+                    ComponentStamps[EdgeNode] = ComponentIndex;
+                    if (EdgeNode >= RandomVariableCount) ComponentHandleIndices.Add(EdgeNode - RandomVariableCount);
+                }
+                if (Edge.Key == Parent && Edge.Value == Node) break;
+            }
+            if (ComponentEdges.Num() < 2) continue;
+            if (FirstCycleEdges.IsEmpty()) FirstCycleEdges = ComponentEdges;
+            for (int32 HandleIndex : ComponentHandleIndices)
+            {
+                HandleMergeMask[HandleIndex] = true;
+                HandleSets.Union(ComponentHandleIndices[0], HandleIndex);
+            }
         }
     }
+    if (FirstCycleEdges.IsEmpty()) return {};
+    if (CycleMode == EConcordCycleMode::Error)
+    {
+        TArray<int32> RandomVariableCycle = FindCycle(FirstCycleEdges);
+        RandomVariableCycle.RemoveAll([&](int32 CycleNode){ return CycleNode >= RandomVariableCount; });
+        return GetCycleError(RandomVariableCycle, FactorGraph);
+    }
+    if (CycleMode == EConcordCycleMode::Ignore) { FactorGraph.bHasCycle = true; return {}; }
+
+    // Each component is merged into one handle, components sharing a handle have to end up in the same one. This leaves a tree but is not
+    // the cheapest possible merge, which could keep some handles of a component apart.
+    TArray<int32> HandleSetIndices;
+    HandleSetIndices.SetNumUninitialized(HandleCount);
+    for (int32 HandleIndex = 0; HandleIndex < HandleCount; ++HandleIndex)
+        HandleSetIndices[HandleIndex] = HandleMergeMask[HandleIndex] ? HandleSets.Find(HandleIndex) : INDEX_NONE;
+    MergeCycles(HandleSetIndices, FactorGraph);
     return {};
 }
 
-bool FConcordCompiler::MergeCycle(int32 FlatRandomVariableIndex, const FConcordHandle* Handle, TArray<int32>& RandomVariablePath, TArray<const FConcordHandle*>& FactorPath, FConcordFactorGraph<float>& FactorGraph) const
+void FConcordCompiler::MergeCycles(const TArray<int32>& HandleSetIndices, FConcordFactorGraph<float>& FactorGraph) const
 {
-    int32 PathIndex = RandomVariablePath.FindLast(FlatRandomVariableIndex);
-    if (PathIndex == INDEX_NONE)
+    TArray<TUniquePtr<FConcordHandle>> OldHandles = MoveTemp(FactorGraph.Handles);
+    TMap<int32, TArray<TUniquePtr<FAtomicHandle>>> HandlesToMerge;
+    for (int32 HandleIndex = 0; HandleIndex < OldHandles.Num(); ++HandleIndex)
     {
-        RandomVariablePath.Add(FlatRandomVariableIndex);
-        FactorPath.Add(Handle);
-        for (int32 NeighboringIndex : Handle->GetNeighboringFlatRandomVariableIndices())
-            if (NeighboringIndex != FlatRandomVariableIndex)
-                for (const auto* NeighboringHandle : FactorGraph.GetNeighboringHandles(NeighboringIndex))
-                    if (NeighboringHandle != Handle)
-                        if (MergeCycle(NeighboringIndex, NeighboringHandle, RandomVariablePath, FactorPath, FactorGraph))
-                            return true;
-        RandomVariablePath.Pop();
-        FactorPath.Pop();
-        return false;
+        if (HandleSetIndices[HandleIndex] == INDEX_NONE) { FactorGraph.Handles.Add(MoveTemp(OldHandles[HandleIndex])); continue; }
+        TArray<TUniquePtr<FAtomicHandle>>& SetHandles = HandlesToMerge.FindOrAdd(HandleSetIndices[HandleIndex]);
+        if (FMergedHandle* MergedHandleToMerge = static_cast<FHandle*>(OldHandles[HandleIndex].Get())->GetMergedHandle())
+            for (TUniquePtr<FAtomicHandle>& ChildHandle : MergedHandleToMerge->Children)
+                SetHandles.Add(MoveTemp(ChildHandle));
+        else // not a merged handle, assume it is an atomic handle
+            SetHandles.Add(TUniquePtr<FAtomicHandle>(static_cast<FAtomicHandle*>(OldHandles[HandleIndex].Release())));
     }
-    RandomVariablePath.RemoveAtSwap(0, PathIndex, false);
-    FactorPath.RemoveAtSwap(0, PathIndex, false);
-    TUniquePtr<FMergedHandle> MergedHandle = MakeUnique<FMergedHandle>();
-    TArray<const FConcordHandle*> HandlesToMerge = FactorPath;
-    for (int OwnedHandleIndex = 0; OwnedHandleIndex < FactorGraph.Handles.Num() && !HandlesToMerge.IsEmpty(); ++OwnedHandleIndex)
-        for (const auto* HandleToMerge : HandlesToMerge)
-        {
-            if (FactorGraph.Handles[OwnedHandleIndex].Get() != HandleToMerge) continue;
-            if (FMergedHandle* MergedHandleToMerge = static_cast<FHandle*>(FactorGraph.Handles[OwnedHandleIndex].Get())->GetMergedHandle())
-                for (TUniquePtr<FAtomicHandle>& ChildHandle : MergedHandleToMerge->Children)
-                    MergedHandle->AddHandle(MoveTemp(ChildHandle));
-            else // HandleToMerge is not a merged handle, assume it is an atomic handle
-                MergedHandle->AddHandle(TUniquePtr<FAtomicHandle>(static_cast<FAtomicHandle*>(FactorGraph.Handles[OwnedHandleIndex].Release())));
-            HandlesToMerge.RemoveSingleSwap(HandleToMerge, false);
-            FactorGraph.Handles.RemoveAtSwap(OwnedHandleIndex--, 1, false);
-            break;
-        }
-    for (int32 AffectedIndex : MergedHandle->GetNeighboringFlatRandomVariableIndices())
+    for (TPair<int32, TArray<TUniquePtr<FAtomicHandle>>>& SetHandlesPair : HandlesToMerge)
     {
-        FactorGraph.RandomVariableNeighboringHandles[AffectedIndex].RemoveAllSwap([&](const FConcordHandle* InHandle){ return FactorPath.Find(InHandle) != INDEX_NONE; }, false);
-        FactorGraph.RandomVariableNeighboringHandles[AffectedIndex].Add(MergedHandle.Get());
+        TUniquePtr<FMergedHandle> MergedHandle = MakeUnique<FMergedHandle>();
+        MergedHandle->AddHandles(MoveTemp(SetHandlesPair.Value));
+        double Log2TableSize = 0.0;
+        for (int32 FlatRandomVariableIndex : MergedHandle->GetNeighboringFlatRandomVariableIndices())
+            Log2TableSize += FMath::Log2(double(FactorGraph.GetStateCount(FlatRandomVariableIndex)));
+        UE_LOG(LogConcordCompiler, Log, TEXT("Merged cycle of %i handles with %i neighboring random variables (table size 2^%.1f)."),
+               MergedHandle->Children.Num(), MergedHandle->GetNeighboringFlatRandomVariableIndices().Num(), Log2TableSize);
+        FactorGraph.Handles.Add(MoveTemp(MergedHandle));
     }
-    UE_LOG(LogConcordCompiler, Log, TEXT("Merged cycle with %i neighboring random variables."), MergedHandle->GetNeighboringFlatRandomVariableIndices().Num());
-    FactorGraph.Handles.Add(MoveTemp(MergedHandle));
-    return true;
+
+    for (TArray<const FConcordHandle*>& NeighboringHandles : FactorGraph.RandomVariableNeighboringHandles) NeighboringHandles.Reset();
+    for (const TUniquePtr<FConcordHandle>& Handle : FactorGraph.Handles)
+        for (int32 FlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+            FactorGraph.RandomVariableNeighboringHandles[FlatRandomVariableIndex].Add(Handle.Get());
 }
 
 FConcordError FConcordCompiler::GetCycleError(const TArray<int32>& RandomVariableCycle, FConcordFactorGraph<float>& FactorGraph)
 {
     check(!RandomVariableCycle.IsEmpty());
     FString ErrorMessage = FString::Printf(TEXT("Cycle detected (cycle mode is set to error): %s"), *GetRandomVariableIndexString(RandomVariableCycle[0], FactorGraph));
-    for (int32 Index = 1; Index < FMath::Min(5, RandomVariableCycle.Num()); ++Index) ErrorMessage += FString::Printf(TEXT(", %s"), *GetRandomVariableIndexString(RandomVariableCycle[Index], FactorGraph));
-    if (RandomVariableCycle.Num() > 5) ErrorMessage += TEXT(", ...");
+    for (int32 Index = 1; Index < FMath::Min(8, RandomVariableCycle.Num()); ++Index) ErrorMessage += FString::Printf(TEXT(" -> %s"), *GetRandomVariableIndexString(RandomVariableCycle[Index], FactorGraph));
+    ErrorMessage += RandomVariableCycle.Num() > 8 ? FString(TEXT(" -> ...")) : FString::Printf(TEXT(" -> %s"), *GetRandomVariableIndexString(RandomVariableCycle[0], FactorGraph));
     return { nullptr, ErrorMessage };
 }
 
@@ -535,3 +689,10 @@ FConcordSharedExpression FConcordCompiler::GetParameterExpression(const FConcord
 {
     return GetAllParameterExpressions<FValue>()[BlockOffset + ConcordShape::FlattenIndex(ParameterLocalIndex, ParameterShape)];
 }
+
+template<typename FValue>
+FConcordSharedExpression FConcordCompiler::GetFrozenParameterExpression(const FConcordMultiIndex& ParameterLocalIndex, const UConcordParameter* Parameter) const
+{
+    const FValue Value = Parameter->GetDefaultValue(ConcordShape::FlattenIndex(ParameterLocalIndex, Parameter->GetShape())).template Get<FValue>();
+    return MakeShared<const FConcordValueExpression<FValue>>(Value);
+}
@@ -0,0 +1,66 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "ConcordExpressionFolder.h"
+
+FConcordSharedExpression FConcordExpressionFolder::Fold(const FConcordSharedExpression& Expression)
+{
+    const FConcordComputingExpression* ComputingExpression = Expression->AsComputingExpression();
+    if (!ComputingExpression) return Expression;
+    if (const FConcordSharedExpression* FoldedExpression = FoldedExpressions.Find(&Expression.Get())) return *FoldedExpression;
+
+    TArray<FConcordSharedExpression> FoldedSourceExpressions;
+    FoldedSourceExpressions.Reserve(ComputingExpression->SourceExpressions.Num());
+    for (const FConcordSharedExpression& SourceExpression : ComputingExpression->SourceExpressions)
+        FoldedSourceExpressions.Add(Fold(SourceExpression));
+
+    FConcordSharedExpression FoldedExpression = Expression;
+    if (TSharedPtr<const FConcordExpression> RebuiltExpression = ComputingExpression->Fold(MoveTemp(FoldedSourceExpressions)))
+        FoldedExpression = Simplify(RebuiltExpression.ToSharedRef());
+    OriginalExpressions.Add(Expression);
+    FoldedExpressions.Add(&Expression.Get(), FoldedExpression);
+    return FoldedExpression;
+}
+
+FConcordSharedExpression FConcordExpressionFolder::Simplify(const FConcordSharedExpression& Expression)
+{
+    const FConcordComputingExpression* ComputingExpression = Expression->AsComputingExpression();
+    if (!ComputingExpression || ComputingExpression->SourceExpressions.Num() != 2) return Expression;
+    const FConcordSharedExpression& Left = ComputingExpression->SourceExpressions[0];
+    const FConcordSharedExpression& Right = ComputingExpression->SourceExpressions[1];
+    switch (ComputingExpression->GetOpcode())
+    {
+    case EConcordOpcode::AddInt: case EConcordOpcode::AddFloat:
+        if (IsValue(*Left, 0)) return Right;
+        if (IsValue(*Right, 0)) return Left;
+        break;
+    case EConcordOpcode::SubtractInt: case EConcordOpcode::SubtractFloat:
+        if (IsValue(*Right, 0)) return Left;
+        break;
+    case EConcordOpcode::MultiplyInt:
+        if (IsValue(*Left, 0) || IsValue(*Right, 0)) return MakeShared<const FConcordValueExpression<int32>>(0);
+        [[fallthrough]];
+    case EConcordOpcode::MultiplyFloat: // x * 0 is not folded for floats, x can be infinite or nan
+        if (IsValue(*Left, 1)) return Right;
+        if (IsValue(*Right, 1)) return Left;
+        break;
+    case EConcordOpcode::DivideInt: case EConcordOpcode::DivideFloat:
+        if (IsValue(*Right, 1)) return Left;
+        break;
+    case EConcordOpcode::AndInt: case EConcordOpcode::AndFloat:
+        if (IsValue(*Left, 0) || IsValue(*Right, 0)) return MakeShared<const FConcordValueExpression<int32>>(0);
+        break;
+    case EConcordOpcode::OrInt: case EConcordOpcode::OrFloat:
+        if ((Left->AsIntValueExpression() || Left->AsFloatValueExpression()) && !IsValue(*Left, 0)) return MakeShared<const FConcordValueExpression<int32>>(1);
+        if ((Right->AsIntValueExpression() || Right->AsFloatValueExpression()) && !IsValue(*Right, 0)) return MakeShared<const FConcordValueExpression<int32>>(1);
+        break;
+    default: break;
+    }
+    return Expression;
+}
+
+bool FConcordExpressionFolder::IsValue(const FConcordExpression& Expression, int32 Value)
+{
+    if (const FConcordValueExpression<int32>* IntValueExpression = Expression.AsIntValueExpression()) return IntValueExpression->Value == Value;
+    if (const FConcordValueExpression<float>* FloatValueExpression = Expression.AsFloatValueExpression()) return FloatValueExpression->Value == float(Value);
+    return false;
+}
@@ -0,0 +1,90 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "ConcordExpressionInterner.h"
+
+FConcordSharedExpression FConcordExpressionInterner::Intern(const FConcordSharedExpression& Expression)
+{
+    if (const FConcordSharedExpression* CanonicalExpression = CanonicalExpressions.Find(&Expression.Get())) return *CanonicalExpression;
+
+    TArray<const FConcordExpression*> CanonicalSources;
+    if (const FConcordComputingExpression* ComputingExpression = Expression->AsComputingExpression())
+    {
+        TArray<FConcordSharedExpression> CanonicalSourceExpressions;
+        bool bSourcesReplaced = false;
+        for (const FConcordSharedExpression& SourceExpression : ComputingExpression->SourceExpressions)
+        {
+            const FConcordSharedExpression& CanonicalSourceExpression = CanonicalSourceExpressions.Add_GetRef(Intern(SourceExpression));
+            CanonicalSources.Add(&CanonicalSourceExpression.Get());
+            bSourcesReplaced |= &CanonicalSourceExpression.Get() != &SourceExpression.Get();
+        }
+
+        // rebuild on the canonical sources so the shared subtrees are used, then hash-cons the rebuilt expression
+        if (bSourcesReplaced)
+            if (TSharedPtr<const FConcordExpression> RebuiltExpression = ComputingExpression->Fold(MoveTemp(CanonicalSourceExpressions)))
+            {
+                const FConcordSharedExpression CanonicalExpression = Intern(RebuiltExpression.ToSharedRef());
+                ReplacedExpressions.Add(Expression);
+                CanonicalExpressions.Add(&Expression.Get(), CanonicalExpression);
+                return CanonicalExpression;
+            }
+    }
+
+    const uint32 Hash = GetStructuralHash(Expression.Get(), CanonicalSources);
+    TArray<FConcordSharedExpression, TInlineAllocator<4>> Candidates;
+    Buckets.MultiFind(Hash, Candidates);
+    for (const FConcordSharedExpression& Candidate : Candidates)
+        if (IsStructurallyEqual(Expression.Get(), CanonicalSources, Candidate.Get()))
+        {
+            ReplacedExpressions.Add(Expression);
+            CanonicalExpressions.Add(&Expression.Get(), Candidate);
+            return Candidate;
+        }
+    Buckets.Add(Hash, Expression);
+    CanonicalExpressions.Add(&Expression.Get(), Expression);
+    return Expression;
+}
+
+uint32 FConcordExpressionInterner::GetStructuralHash(const FConcordExpression& Expression, const TArray<const FConcordExpression*>& CanonicalSources) const
+{
+    if (const FConcordRandomVariableExpression* RandomVariableExpression = Expression.AsRandomVariableExpression())
+        return HashCombine(1, GetTypeHash(RandomVariableExpression->FlatIndex));
+    if (const FConcordParameterExpression<int32>* IntParameterExpression = Expression.AsIntParameterExpression())
+        return HashCombine(2, GetTypeHash(IntParameterExpression->FlatIndex));
+    if (const FConcordParameterExpression<float>* FloatParameterExpression = Expression.AsFloatParameterExpression())
+        return HashCombine(3, GetTypeHash(FloatParameterExpression->FlatIndex));
+    if (const FConcordValueExpression<int32>* IntValueExpression = Expression.AsIntValueExpression())
+        return HashCombine(4, GetTypeHash(IntValueExpression->Value));
+    if (const FConcordValueExpression<float>* FloatValueExpression = Expression.AsFloatValueExpression())
+        return HashCombine(5, GetTypeHash(FloatValueExpression->Value));
+    if (const FConcordComputingExpression* ComputingExpression = Expression.AsComputingExpression())
+    {
+        uint32 Hash = HashCombine(6, ComputingExpression->GetOperationHash());
+        for (const FConcordExpression* CanonicalSource : CanonicalSources) Hash = HashCombine(Hash, PointerHash(CanonicalSource));
+        return Hash;
+    }
+    return PointerHash(&Expression);
+}
+
+bool FConcordExpressionInterner::IsStructurallyEqual(const FConcordExpression& Expression, const TArray<const FConcordExpression*>& CanonicalSources, const FConcordExpression& Candidate) const
+{
+    if (const FConcordRandomVariableExpression* RandomVariableExpression = Expression.AsRandomVariableExpression())
+        return Candidate.AsRandomVariableExpression() && Candidate.AsRandomVariableExpression()->FlatIndex == RandomVariableExpression->FlatIndex;
+    if (const FConcordParameterExpression<int32>* IntParameterExpression = Expression.AsIntParameterExpression())
+        return Candidate.AsIntParameterExpression() && Candidate.AsIntParameterExpression()->FlatIndex == IntParameterExpression->FlatIndex;
+    if (const FConcordParameterExpression<float>* FloatParameterExpression = Expression.AsFloatParameterExpression())
+        return Candidate.AsFloatParameterExpression() && Candidate.AsFloatParameterExpression()->FlatIndex == FloatParameterExpression->FlatIndex;
+    if (const FConcordValueExpression<int32>* IntValueExpression = Expression.AsIntValueExpression())
+        return Candidate.AsIntValueExpression() && Candidate.AsIntValueExpression()->Value == IntValueExpression->Value;
+    if (const FConcordValueExpression<float>* FloatValueExpression = Expression.AsFloatValueExpression())
+        return Candidate.AsFloatValueExpression() && Candidate.AsFloatValueExpression()->Value == FloatValueExpression->Value;
+    if (const FConcordComputingExpression* ComputingExpression = Expression.AsComputingExpression())
+    {
+        const FConcordComputingExpression* CandidateComputingExpression = Candidate.AsComputingExpression();
+        if (!CandidateComputingExpression || !ComputingExpression->HasSameOperation(*CandidateComputingExpression)) return false;
+        if (CandidateComputingExpression->SourceExpressions.Num() != CanonicalSources.Num()) return false;
+        for (int32 SourceIndex = 0; SourceIndex < CanonicalSources.Num(); ++SourceIndex)
+            if (&CanonicalExpressions.FindChecked(&CandidateComputingExpression->SourceExpressions[SourceIndex].Get()).Get() != CanonicalSources[SourceIndex]) return false;
+        return true;
+    }
+    return &Expression == &Candidate;
+}
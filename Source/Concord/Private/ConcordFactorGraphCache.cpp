@@ -0,0 +1,341 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "ConcordFactorGraphCache.h"
+#include "ConcordFactorGraphDynamic.h"
+#include "Transformers/ConcordTransformerBinaryOperators.h"
+#include "Transformers/ConcordTransformerUnaryOperators.h"
+#include "Transformers/ConcordTransformerReductions.h"
+#include "Transformers/ConcordTransformerCast.h"
+#include "Transformers/ConcordTransformerClamp.h"
+#include "Transformers/ConcordTransformerTable.h"
+#include "Transformers/ConcordTransformerGetDynamic.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
+#include "Algo/AllOf.h"
+
+using namespace ConcordFactorGraphDynamic;
+
+namespace
+{
+    enum class EConcordExpressionTag : uint8
+    {
+        RandomVariable,
+        IntParameter,
+        FloatParameter,
+        IntValue,
+        FloatValue,
+        Computing,
+        Table,
+        Get
+    };
+
+    void SerializeBlocks(FArchive& Ar, FConcordFactorGraphBlocks& Blocks)
+    {
+        int32 BlockCount = Blocks.Num();
+        Ar << BlockCount;
+        if (Ar.IsLoading())
+        {
+            for (int32 BlockIndex = 0; BlockIndex < BlockCount && !Ar.IsError(); ++BlockIndex)
+            {
+                FName Name; FConcordFactorGraphBlock Block;
+                Ar << Name << Block.Offset << Block.Size << Block.bLocal;
+                Blocks.Add(Name, Block);
+            }
+        }
+        else for (TPair<FName, FConcordFactorGraphBlock>& NameBlockPair : Blocks)
+            Ar << NameBlockPair.Key << NameBlockPair.Value.Offset << NameBlockPair.Value.Size << NameBlockPair.Value.bLocal;
+    }
+
+    void SerializeCommon(FArchive& Ar, TArray<int32>& StateCounts, TArray<int32>& DisjointSubgraphRootFlatRandomVariableIndices, FConcordFactorGraphBlocks& VariationBlocks,
+                         FConcordFactorGraphBlocks& IntParameterBlocks, FConcordFactorGraphBlocks& FloatParameterBlocks, TArray<int32>& IntParameterDefaultValues, TArray<float>& FloatParameterDefaultValues)
+    {
+        Ar << StateCounts << DisjointSubgraphRootFlatRandomVariableIndices;
+        SerializeBlocks(Ar, VariationBlocks);
+        SerializeBlocks(Ar, IntParameterBlocks);
+        SerializeBlocks(Ar, FloatParameterBlocks);
+        Ar << IntParameterDefaultValues << FloatParameterDefaultValues;
+    }
+
+    TArray<const FAtomicHandle*> GetAtomicHandles(const FConcordHandle* Handle)
+    {
+        const FHandle* DynamicHandle = static_cast<const FHandle*>(Handle);
+        TArray<const FAtomicHandle*> AtomicHandles;
+        if (const FMergedHandle* MergedHandle = DynamicHandle->GetMergedHandle())
+            for (const TUniquePtr<FAtomicHandle>& Child : MergedHandle->Children) AtomicHandles.Add(Child.Get());
+        else AtomicHandles.Add(static_cast<const FAtomicHandle*>(DynamicHandle));
+        return MoveTemp(AtomicHandles);
+    }
+}
+
+bool FConcordFactorGraphCache::Save(const FConcordFactorGraph<float>& FactorGraph, uint32 Key, EConcordCycleMode CycleMode, TArray<uint8>& OutData)
+{
+    if (!FactorGraph.InstanceSamplers.IsEmpty()) return false;
+
+    TMap<const FConcordExpression*, int32> Ids;
+    TArray<FConcordSharedExpression> OrderedExpressions;
+    for (const TUniquePtr<FConcordHandle>& Handle : FactorGraph.Handles)
+        for (const FAtomicHandle* AtomicHandle : GetAtomicHandles(Handle.Get()))
+            if (!AddExpression(AtomicHandle->Factor, Ids, OrderedExpressions)) return false;
+    for (const auto& NameOutputPair : FactorGraph.Outputs)
+        for (const FConcordSharedExpression& Expression : static_cast<const FOutput*>(NameOutputPair.Value.Get())->Expressions)
+            if (!AddExpression(Expression, Ids, OrderedExpressions)) return false;
+
+    OutData.Reset();
+    FMemoryWriter Ar(OutData);
+    int32 SavedVersion = Version; uint8 SavedCycleMode = uint8(CycleMode);
+    Ar << SavedVersion << Key << SavedCycleMode;
+
+    int32 ExpressionCount = OrderedExpressions.Num();
+    Ar << ExpressionCount;
+    for (const FConcordSharedExpression& Expression : OrderedExpressions) SaveExpression(Ar, Expression.Get(), Ids);
+
+    TMap<const FConcordHandle*, int32> HandleIndices;
+    int32 HandleCount = FactorGraph.Handles.Num();
+    Ar << HandleCount;
+    for (const TUniquePtr<FConcordHandle>& Handle : FactorGraph.Handles)
+    {
+        HandleIndices.Add(Handle.Get(), HandleIndices.Num());
+        bool bMerged = static_cast<const FHandle*>(Handle.Get())->GetMergedHandle() != nullptr;
+        TArray<int32> FactorIds;
+        for (const FAtomicHandle* AtomicHandle : GetAtomicHandles(Handle.Get())) FactorIds.Add(Ids[&AtomicHandle->Factor.Get()]);
+        Ar << bMerged << FactorIds;
+    }
+    int32 RandomVariableCount = FactorGraph.RandomVariableNeighboringHandles.Num();
+    Ar << RandomVariableCount;
+    for (const TArray<const FConcordHandle*>& NeighboringHandles : FactorGraph.RandomVariableNeighboringHandles)
+    {
+        TArray<int32> NeighboringHandleIndices;
+        for (const FConcordHandle* NeighboringHandle : NeighboringHandles) NeighboringHandleIndices.Add(HandleIndices[NeighboringHandle]);
+        Ar << NeighboringHandleIndices;
+    }
+
+    int32 OutputCount = FactorGraph.Outputs.Num();
+    Ar << OutputCount;
+    for (const auto& NameOutputPair : FactorGraph.Outputs)
+    {
+        FName Name = NameOutputPair.Key;
+        uint8 Type = uint8(NameOutputPair.Value->GetType());
+        TArray<int32> ExpressionIds;
+        for (const FConcordSharedExpression& Expression : static_cast<const FOutput*>(NameOutputPair.Value.Get())->Expressions) ExpressionIds.Add(Ids[&Expression.Get()]);
+        Ar << Name << Type << ExpressionIds;
+    }
+
+    // the saving archive only reads these
+    FConcordFactorGraph<float>& MutableFactorGraph = const_cast<FConcordFactorGraph<float>&>(FactorGraph);
+    SerializeCommon(Ar, MutableFactorGraph.RandomVariableStateCounts, MutableFactorGraph.DisjointSubgraphRootFlatRandomVariableIndices, MutableFactorGraph.VariationBlocks,
+                    MutableFactorGraph.IntParameterBlocks, MutableFactorGraph.FloatParameterBlocks, MutableFactorGraph.IntParameterDefaultValues, MutableFactorGraph.FloatParameterDefaultValues);
+    TArray<FName> TrainableFloatParameterBlockNames;
+#if WITH_EDITORONLY_DATA
+    TrainableFloatParameterBlockNames = FactorGraph.TrainableFloatParameterBlockNames;
+#endif
+    bool bHasCycle = FactorGraph.bHasCycle;
+    Ar << TrainableFloatParameterBlockNames << bHasCycle;
+    return true;
+}
+
+TOptional<uint32> FConcordFactorGraphCache::GetKey(const TArray<uint8>& Data)
+{
+    if (Data.IsEmpty()) return {};
+    FMemoryReader Ar(Data);
+    int32 SavedVersion; uint32 SavedKey;
+    Ar << SavedVersion << SavedKey;
+    if (Ar.IsError() || SavedVersion != Version) return {};
+    return SavedKey;
+}
+
+TSharedPtr<FConcordFactorGraph<float>> FConcordFactorGraphCache::Load(const TArray<uint8>& Data, TOptional<uint32> Key, EConcordCycleMode CycleMode)
+{
+    if (Data.IsEmpty()) return nullptr;
+    FMemoryReader Ar(Data);
+    int32 SavedVersion; uint32 SavedKey; uint8 SavedCycleMode;
+    Ar << SavedVersion;
+    if (Ar.IsError() || SavedVersion != Version) return nullptr;
+    Ar << SavedKey << SavedCycleMode;
+    if (Ar.IsError() || (Key && Key.GetValue() != SavedKey) || SavedCycleMode != uint8(CycleMode)) return nullptr;
+
+    TSharedRef<FConcordFactorGraph<float>> FactorGraph = MakeShared<FConcordFactorGraph<float>>();
+    int32 ExpressionCount;
+    Ar << ExpressionCount;
+    TArray<FConcordSharedExpression> Expressions;
+    for (int32 ExpressionIndex = 0; ExpressionIndex < ExpressionCount && !Ar.IsError(); ++ExpressionIndex)
+    {
+        TSharedPtr<const FConcordExpression> Expression = LoadExpression(Ar, Expressions);
+        if (!Expression || Ar.IsError()) return nullptr;
+        Expressions.Add(Expression.ToSharedRef());
+    }
+    auto AreValidIds = [&](const TArray<int32>& ExpressionIds) { return Algo::AllOf(ExpressionIds, [&](int32 Id){ return Expressions.IsValidIndex(Id); }); };
+
+    int32 HandleCount;
+    Ar << HandleCount;
+    for (int32 HandleIndex = 0; HandleIndex < HandleCount && !Ar.IsError(); ++HandleIndex)
+    {
+        bool bMerged; TArray<int32> FactorIds;
+        Ar << bMerged << FactorIds;
+        if (FactorIds.IsEmpty() || !AreValidIds(FactorIds)) return nullptr;
+        if (bMerged)
+        {
+            TArray<TUniquePtr<FAtomicHandle>> ChildHandles;
+            for (int32 FactorId : FactorIds) ChildHandles.Add(MakeUnique<FAtomicHandle>(Expressions[FactorId]));
+            TUniquePtr<FMergedHandle> MergedHandle = MakeUnique<FMergedHandle>();
+            MergedHandle->AddHandles(MoveTemp(ChildHandles));
+            FactorGraph->Handles.Add(MoveTemp(MergedHandle));
+        }
+        else FactorGraph->Handles.Add(MakeUnique<FAtomicHandle>(Expressions[FactorIds[0]]));
+    }
+
+    int32 RandomVariableCount;
+    Ar << RandomVariableCount;
+    if (Ar.IsError() || RandomVariableCount < 0) return nullptr;
+    FactorGraph->RandomVariableNeighboringHandles.SetNum(RandomVariableCount);
+    for (TArray<const FConcordHandle*>& NeighboringHandles : FactorGraph->RandomVariableNeighboringHandles)
+    {
+        TArray<int32> NeighboringHandleIndices;
+        Ar << NeighboringHandleIndices;
+        for (int32 NeighboringHandleIndex : NeighboringHandleIndices)
+        {
+            if (!FactorGraph->Handles.IsValidIndex(NeighboringHandleIndex)) return nullptr;
+            NeighboringHandles.Add(FactorGraph->Handles[NeighboringHandleIndex].Get());
+        }
+    }
+
+    int32 OutputCount;
+    Ar << OutputCount;
+    for (int32 OutputIndex = 0; OutputIndex < OutputCount && !Ar.IsError(); ++OutputIndex)
+    {
+        FName Name; uint8 Type; TArray<int32> ExpressionIds;
+        Ar << Name << Type << ExpressionIds;
+        if (!AreValidIds(ExpressionIds)) return nullptr;
+        TArray<FConcordSharedExpression> OutputExpressions;
+        for (int32 ExpressionId : ExpressionIds) OutputExpressions.Add(Expressions[ExpressionId]);
+        FactorGraph->Outputs.Add(Name, MakeUnique<FOutput>(EConcordValueType(Type), MoveTemp(OutputExpressions)));
+    }
+
+    SerializeCommon(Ar, FactorGraph->RandomVariableStateCounts, FactorGraph->DisjointSubgraphRootFlatRandomVariableIndices, FactorGraph->VariationBlocks,
+                    FactorGraph->IntParameterBlocks, FactorGraph->FloatParameterBlocks, FactorGraph->IntParameterDefaultValues, FactorGraph->FloatParameterDefaultValues);
+    TArray<FName> TrainableFloatParameterBlockNames;
+    Ar << TrainableFloatParameterBlockNames << FactorGraph->bHasCycle;
+#if WITH_EDITORONLY_DATA
+    FactorGraph->TrainableFloatParameterBlockNames = MoveTemp(TrainableFloatParameterBlockNames);
+#endif
+    if (Ar.IsError() || FactorGraph->RandomVariableStateCounts.Num() != RandomVariableCount) return nullptr;
+    return FactorGraph;
+}
+
+bool FConcordFactorGraphCache::AddExpression(const FConcordSharedExpression& Expression, TMap<const FConcordExpression*, int32>& Ids, TArray<FConcordSharedExpression>& OrderedExpressions)
+{
+    if (Ids.Contains(&Expression.Get())) return true;
+    if (const FConcordComputingExpression* ComputingExpression = Expression->AsComputingExpression())
+    {
+        if (ComputingExpression->GetOpcode() == EConcordOpcode::Fallback && !ComputingExpression->AsTableExpression() && !ComputingExpression->AsGetExpression()) return false;
+        for (const FConcordSharedExpression& SourceExpression : ComputingExpression->SourceExpressions)
+            if (!AddExpression(SourceExpression, Ids, OrderedExpressions)) return false;
+    }
+    else if (!Expression->AsRandomVariableExpression() && !Expression->AsIntParameterExpression() && !Expression->AsFloatParameterExpression()
+             && !Expression->AsIntValueExpression() && !Expression->AsFloatValueExpression()) return false;
+    Ids.Add(&Expression.Get(), OrderedExpressions.Add(Expression));
+    return true;
+}
+
+void FConcordFactorGraphCache::SaveExpression(FArchive& Ar, const FConcordExpression& Expression, const TMap<const FConcordExpression*, int32>& Ids)
+{
+    EConcordExpressionTag Tag;
+    int32 FlatIndex; int32 IntValue; float FloatValue;
+    if (const FConcordRandomVariableExpression* RandomVariableExpression = Expression.AsRandomVariableExpression()) { Tag = EConcordExpressionTag::RandomVariable; FlatIndex = RandomVariableExpression->FlatIndex; Ar << Tag << FlatIndex; }
+    else if (const FConcordParameterExpression<int32>* IntParameterExpression = Expression.AsIntParameterExpression()) { Tag = EConcordExpressionTag::IntParameter; FlatIndex = IntParameterExpression->FlatIndex; Ar << Tag << FlatIndex; }
+    else if (const FConcordParameterExpression<float>* FloatParameterExpression = Expression.AsFloatParameterExpression()) { Tag = EConcordExpressionTag::FloatParameter; FlatIndex = FloatParameterExpression->FlatIndex; Ar << Tag << FlatIndex; }
+    else if (const FConcordValueExpression<int32>* IntValueExpression = Expression.AsIntValueExpression()) { Tag = EConcordExpressionTag::IntValue; IntValue = IntValueExpression->Value; Ar << Tag << IntValue; }
+    else if (const FConcordValueExpression<float>* FloatValueExpression = Expression.AsFloatValueExpression()) { Tag = EConcordExpressionTag::FloatValue; FloatValue = FloatValueExpression->Value; Ar << Tag << FloatValue; }
+    else
+    {
+        const FConcordComputingExpression* ComputingExpression = Expression.AsComputingExpression();
+        check(ComputingExpression);
+        if (const FConcordTransformerTableExpression* TableExpression = ComputingExpression->AsTableExpression())
+        {
+            Tag = EConcordExpressionTag::Table;
+            FConcordShape TableShape = TableExpression->GetTableShape();
+            Ar << Tag << TableShape;
+        }
+        else if (ComputingExpression->AsGetExpression())
+        {
+            Tag = EConcordExpressionTag::Get;
+            Ar << Tag;
+        }
+        else
+        {
+            Tag = EConcordExpressionTag::Computing;
+            EConcordOpcode Opcode = ComputingExpression->GetOpcode();
+            Ar << Tag << Opcode;
+        }
+        TArray<int32> SourceIds;
+        for (const FConcordSharedExpression& SourceExpression : ComputingExpression->SourceExpressions) SourceIds.Add(Ids[&SourceExpression.Get()]);
+        Ar << SourceIds;
+    }
+}
+
+TSharedPtr<const FConcordExpression> FConcordFactorGraphCache::LoadExpression(FArchive& Ar, const TArray<FConcordSharedExpression>& Expressions)
+{
+    EConcordExpressionTag Tag;
+    Ar << Tag;
+    int32 FlatIndex; int32 IntValue; float FloatValue;
+    switch (Tag)
+    {
+    case EConcordExpressionTag::RandomVariable: Ar << FlatIndex; return MakeShared<const FConcordRandomVariableExpression>(FlatIndex);
+    case EConcordExpressionTag::IntParameter: Ar << FlatIndex; return MakeShared<const FConcordParameterExpression<int32>>(FlatIndex);
+    case EConcordExpressionTag::FloatParameter: Ar << FlatIndex; return MakeShared<const FConcordParameterExpression<float>>(FlatIndex);
+    case EConcordExpressionTag::IntValue: Ar << IntValue; return MakeShared<const FConcordValueExpression<int32>>(IntValue);
+    case EConcordExpressionTag::FloatValue: Ar << FloatValue; return MakeShared<const FConcordValueExpression<float>>(FloatValue);
+    default: break;
+    }
+
+    FConcordShape TableShape; EConcordOpcode Opcode = EConcordOpcode::Fallback;
+    if (Tag == EConcordExpressionTag::Table) Ar << TableShape;
+    else if (Tag == EConcordExpressionTag::Computing) Ar << Opcode;
+    else if (Tag != EConcordExpressionTag::Get) return nullptr;
+    TArray<int32> SourceIds;
+    Ar << SourceIds;
+    if (Ar.IsError()) return nullptr;
+    TArray<FConcordSharedExpression> SourceExpressions;
+    for (int32 SourceId : SourceIds)
+    {
+        if (!Expressions.IsValidIndex(SourceId)) return nullptr;
+        SourceExpressions.Add(Expressions[SourceId]);
+    }
+    switch (Tag)
+    {
+    case EConcordExpressionTag::Table:
+    {
+        int32 TableSize = 1;
+        for (int32 DimSize : TableShape) TableSize *= DimSize;
+        if (SourceExpressions.Num() != TableShape.Num() + TableSize) return nullptr;
+        return MakeShared<const FConcordTransformerTableExpression>(MoveTemp(SourceExpressions), TableShape);
+    }
+    case EConcordExpressionTag::Get:
+        if (SourceExpressions.Num() < 2) return nullptr;
+        return MakeShared<const FConcordGetExpression>(MoveTemp(SourceExpressions));
+    default: return MakeComputingExpression(Opcode, MoveTemp(SourceExpressions));
+    }
+}
+
+#define CONCORD_CACHE_BINARY_CASE_TYPED(Name, Type, FValue)\
+    case EConcordOpcode::Name##Type: if (SourceExpressions.Num() != 2) return nullptr; return MakeShared<const UConcordTransformer##Name::FConcordOperator##Name##Expression<FValue>>(MoveTemp(SourceExpressions));
+#define CONCORD_CACHE_BINARY_CASE(Name) CONCORD_CACHE_BINARY_CASE_TYPED(Name, Int, int32) CONCORD_CACHE_BINARY_CASE_TYPED(Name, Float, float)
+#define CONCORD_CACHE_UNARY_CASE_TYPED(Name, Type, FValue)\
+    case EConcordOpcode::Name##Type: if (SourceExpressions.Num() != 1) return nullptr; return MakeShared<const UConcordTransformer##Name::FConcordOperator##Name##Expression<FValue>>(MoveTemp(SourceExpressions[0]));
+#define CONCORD_CACHE_UNARY_CASE(Name) CONCORD_CACHE_UNARY_CASE_TYPED(Name, Int, int32) CONCORD_CACHE_UNARY_CASE_TYPED(Name, Float, float)
+#define CONCORD_CACHE_REDUCTION_CASE_TYPED(Name, Type, FValue)\
+    case EConcordOpcode::Name##Type: return MakeShared<const UConcordTransformer##Name::FConcord##Name##ReductionExpression<FValue>>(MoveTemp(SourceExpressions));
+#define CONCORD_CACHE_REDUCTION_CASE(Name, FAccumulator, DefaultValue) CONCORD_CACHE_REDUCTION_CASE_TYPED(Name, Int, int32) CONCORD_CACHE_REDUCTION_CASE_TYPED(Name, Float, float)
+
+TSharedPtr<const FConcordExpression> FConcordFactorGraphCache::MakeComputingExpression(EConcordOpcode Opcode, TArray<FConcordSharedExpression>&& SourceExpressions)
+{
+    switch (Opcode)
+    {
+    case EConcordOpcode::Cast: if (SourceExpressions.Num() != 1) return nullptr; return MakeShared<const FConcordCastExpression>(MoveTemp(SourceExpressions[0]));
+    CONCORD_BYTECODE_BINARY_OPERATORS(CONCORD_CACHE_BINARY_CASE)
+    CONCORD_BYTECODE_UNARY_OPERATORS(CONCORD_CACHE_UNARY_CASE)
+    CONCORD_BYTECODE_REDUCTIONS(CONCORD_CACHE_REDUCTION_CASE)
+    case EConcordOpcode::ClampInt: if (SourceExpressions.Num() != 3) return nullptr; return MakeShared<const FConcordClampExpression<int32>>(MoveTemp(SourceExpressions));
+    case EConcordOpcode::ClampFloat: if (SourceExpressions.Num() != 3) return nullptr; return MakeShared<const FConcordClampExpression<float>>(MoveTemp(SourceExpressions));
+    default: return nullptr;
+    }
+}
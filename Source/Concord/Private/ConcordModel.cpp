@@ -3,12 +3,35 @@
 #include "ConcordModel.h"
 #include "ConcordCompiler.h"
 #include "ConcordBox.h"
+#include "ConcordVertex.h"
 #include "ConcordComposite.h"
 #include "ConcordInstance.h"
 #include "ConcordParameter.h"
+#include "ConcordFactorGraphCache.h"
+#include "Sampler/ConcordSampler.h"
+#include "Serialization/ArchiveObjectCrc32.h"
+#if WITH_EDITOR
+#include "UObject/ObjectSaveContext.h"
+#endif
 
 TSharedPtr<const FConcordFactorGraph<float>> UConcordModel::GetFactorGraph(EConcordCycleMode CycleMode, TOptional<FConcordError>& ErrorOut) const
 {
+#if WITH_EDITOR
+    const TOptional<uint32> Key = GetCacheKey();
+#else
+    const TOptional<uint32> Key; // cooked models cannot change after their cache was saved
+#if !UE_BUILD_SHIPPING
+    if (!bCacheKeyChecked)
+    {
+        bCacheKeyChecked = true;
+        if (const TOptional<uint32> SavedKey = FConcordFactorGraphCache::GetKey(CachedFactorGraphData))
+            ensureMsgf(SavedKey.GetValue() == ComputeCacheKey(), TEXT("The cached factor graph of %s was saved for a different model."), *GetPathName());
+    }
+#endif
+#endif
+    if (TSharedPtr<FConcordFactorGraph<float>> CachedFactorGraph = FConcordFactorGraphCache::Load(CachedFactorGraphData, Key, CycleMode))
+        return MoveTemp(CachedFactorGraph);
+
     FConcordCompiler::FResult CompilerResult = FConcordCompiler::Compile(this, CycleMode);
     ErrorOut = CompilerResult.Error;
     if (ErrorOut) return {};
@@ -28,6 +51,96 @@ FName UConcordModel::SanitizeName(const FName& Name)
     return FName(SanitizedString);
 }
 
+#if WITH_EDITOR
+void UConcordModel::PreSave(FObjectPreSaveContext SaveContext)
+{
+    Super::PreSave(SaveContext);
+    // autosaves keep the previous cache, its key no longer matches if the model changed since
+    if (SaveContext.GetSaveFlags() & SAVE_FromAutosave) return;
+    CachedFactorGraphData.Reset();
+    const EConcordCycleMode CycleMode = DefaultSamplerFactory ? DefaultSamplerFactory->GetCycleMode() : EConcordCycleMode::Merge;
+    FConcordCompiler::FResult CompilerResult = FConcordCompiler::Compile(this, CycleMode);
+    if (!CompilerResult.Error && !FConcordFactorGraphCache::Save(CompilerResult.FactorGraph.Get(), GetCacheKey(), CycleMode, CachedFactorGraphData))
+        CachedFactorGraphData.Reset();
+}
+
+namespace
+{
+    // Edits can reach a model through its vertices, the models of its composites or its crates, so any modified or
+    // changed object invalidates the cached keys of all models.
+    struct FConcordEditSerial
+    {
+        uint32 Value = 0;
+        FConcordEditSerial()
+        {
+            FCoreUObjectDelegates::OnObjectModified.AddLambda([this](UObject*) { ++Value; });
+            FCoreUObjectDelegates::OnObjectPropertyChanged.AddLambda([this](UObject*, FPropertyChangedEvent&) { ++Value; });
+        }
+    };
+
+    uint32 GetEditSerial()
+    {
+        static FConcordEditSerial EditSerial;
+        return EditSerial.Value;
+    }
+}
+
+uint32 UConcordModel::GetCacheKey() const
+{
+    const uint32 EditSerial = GetEditSerial();
+    if (!CachedCacheKey || CachedCacheKeyEditSerial != EditSerial)
+    {
+        CachedCacheKey = ComputeCacheKey();
+        CachedCacheKeyEditSerial = EditSerial;
+    }
+    return CachedCacheKey.GetValue();
+}
+#endif
+
+namespace
+{
+    class FConcordModelCrc32 : public FArchiveObjectCrc32
+    {
+    public:
+        bool ShouldSkipProperty(const FProperty* InProperty) const override
+        {
+            // only properties that affect compilation are part of the key
+            static const FName SkippedPropertyNames[] = { "CachedFactorGraphData", "Graph", "DefaultSamplerFactory", "DefaultCrates", "LatestPatternSampledFromEditor" };
+            for (const FName& SkippedPropertyName : SkippedPropertyNames)
+                if (InProperty->GetFName() == SkippedPropertyName) return true;
+            // shapes and types are set up during compilation
+            if (InProperty->GetOwnerClass() == UConcordVertex::StaticClass() && (InProperty->GetFName() == "Shape" || InProperty->GetFName() == "Type")) return true;
+            return FArchiveObjectCrc32::ShouldSkipProperty(InProperty);
+        }
+    };
+
+    uint32 ComputeModelCrc32(const UConcordModel* Model, TSet<const UConcordModel*>& VisitedModels)
+    {
+        VisitedModels.Add(Model);
+        FConcordModelCrc32 Archive;
+        Archive.SetFilterEditorOnly(true); // cooked builds recompute the key without editor only data
+        uint32 Crc = Archive.Crc32(const_cast<UConcordModel*>(Model), FConcordFactorGraphCache::Version);
+        for (const TPair<FName, UConcordComposite*>& NameCompositePair : Model->Composites)
+            if (const UConcordModel* CompositeModel = NameCompositePair.Value->Model; CompositeModel && !VisitedModels.Contains(CompositeModel))
+                Crc = HashCombine(Crc, ComputeModelCrc32(CompositeModel, VisitedModels));
+        // default values read from crates are compiled into the factor graph
+        for (const TPair<FName, UConcordParameter*>& NameParameterPair : Model->Parameters)
+            if (NameParameterPair.Value->bGetDefaultValuesFromCrate && NameParameterPair.Value->DefaultValuesCrate)
+            {
+                FArchiveObjectCrc32 CrateArchive;
+                CrateArchive.SetFilterEditorOnly(true);
+                Crc = HashCombine(Crc, CrateArchive.Crc32(NameParameterPair.Value->DefaultValuesCrate));
+            }
+        return Crc;
+    }
+}
+
+uint32 UConcordModel::ComputeCacheKey() const
+{
+    TSet<const UConcordModel*> VisitedModels;
+    return ComputeModelCrc32(this, VisitedModels);
+}
+
 TArray<UConcordVertex*> UConcordModel::GetUpstreamSources() const
 {
     TArray<UConcordVertex*> UpstreamSources;
@@ -26,6 +26,18 @@ FConcordValue FConcordClampExpression<FValue>::ComputeValue(const FConcordExpres
     return X < Min ? Min : (X > Max ? Max : X);
 }
 
+template<typename FValue>
+TSharedPtr<const FConcordExpression> FConcordClampExpression<FValue>::Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const
+{
+    // equal bounds fix the value regardless of X
+    const FConcordExpression& Min = FoldedSourceExpressions[1].Get();
+    const FConcordExpression& Max = FoldedSourceExpressions[2].Get();
+    const bool bEqualIntBounds = Min.AsIntValueExpression() && Max.AsIntValueExpression() && Min.AsIntValueExpression()->Value == Max.AsIntValueExpression()->Value;
+    const bool bEqualFloatBounds = Min.AsFloatValueExpression() && Max.AsFloatValueExpression() && Min.AsFloatValueExpression()->Value == Max.AsFloatValueExpression()->Value;
+    if (bEqualIntBounds || bEqualFloatBounds) return FoldedSourceExpressions[1];
+    return Concord::MakeFoldedExpression<FValue, FConcordClampExpression<FValue>>(MoveTemp(FoldedSourceExpressions));
+}
+
 #if WITH_EDITOR
 template<typename FValue>
 FString FConcordClampExpression<FValue>::ToString() const
@@ -100,6 +112,18 @@ FConcordValue FConcordGetExpression::ComputeValue(const FConcordExpressionContex
     return SourceExpressions[1]->ComputeValue(Context);
 }
 
+TSharedPtr<const FConcordExpression> FConcordGetExpression::Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const
+{
+    if (const FConcordValueExpression<int32>* IndexExpression = FoldedSourceExpressions[0]->AsIntValueExpression())
+    {
+        const int32 Index = IndexExpression->Value;
+        if (Index >= 0 && Index < FoldedSourceExpressions.Num() - 2)
+            return FoldedSourceExpressions[2 + Index];
+        return FoldedSourceExpressions[1];
+    }
+    return MakeShared<const FConcordGetExpression>(MoveTemp(FoldedSourceExpressions));
+}
+
 #if WITH_EDITOR
 FString FConcordGetExpression::ToString() const
 {
@@ -195,6 +219,19 @@ FConcordValue FConcordTransformerTableExpression::ComputeValue(const FConcordExp
     return SourceExpressions[TableShape.Num() + FlatIndex]->ComputeValue(Context);
 }
 
+TSharedPtr<const FConcordExpression> FConcordTransformerTableExpression::Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const
+{
+    int32 FlatIndex = 0; int32 Stride = 1;
+    for (int32 DimIndex = TableShape.Num() - 1; DimIndex >= 0; --DimIndex)
+    {
+        const FConcordValueExpression<int32>* IndexExpression = FoldedSourceExpressions[DimIndex]->AsIntValueExpression();
+        if (!IndexExpression || IndexExpression->Value < 0 || IndexExpression->Value >= TableShape[DimIndex])
+            return MakeShared<const FConcordTransformerTableExpression>(MoveTemp(FoldedSourceExpressions), TableShape);
+        FlatIndex += IndexExpression->Value * Stride; Stride *= TableShape[DimIndex];
+    }
+    return FoldedSourceExpressions[TableShape.Num() + FlatIndex];
+}
+
 #if WITH_EDITOR
 FString FConcordTransformerTableExpression::ToString() const
 {
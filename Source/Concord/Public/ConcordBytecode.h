@@ -0,0 +1,110 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordValue.h"
+#include "ConcordExpressionContext.h"
+
+class FConcordExpression;
+using FConcordSharedExpression = TSharedRef<const FConcordExpression>;
+
+#define CONCORD_BYTECODE_BINARY_OPERATORS(Op) Op(Add) Op(Subtract) Op(Multiply) Op(Divide) Op(Modulo) Op(Min) Op(Max) Op(Equal) Op(NotEqual) Op(LessThan)\
+    Op(LessThanOrEqual) Op(GreaterThan) Op(GreaterThanOrEqual) Op(And) Op(Or) Op(Coalesce) Op(Pow) Op(Atan2) Op(Hypot)
+#define CONCORD_BYTECODE_UNARY_OPERATORS(Op) Op(Not) Op(Abs) Op(Acos) Op(Asin) Op(Atan) Op(Cos) Op(Cosh) Op(Erf) Op(Exp) Op(Log) Op(Log2) Op(Log10)\
+    Op(Sin) Op(Sinh) Op(Sqrt) Op(Tan) Op(Tanh)
+#define CONCORD_BYTECODE_REDUCTIONS(Op) Op(Sum, FValue, 0) Op(Product, FValue, 1) Op(Minimum, FValue, TNumericLimits<FValue>::Max()) Op(Maximum, FValue, TNumericLimits<FValue>::Lowest())\
+    Op(CountNonzero, int32, 0) Op(Any, int32, 0) Op(All, int32, 1)
+
+#define CONCORD_BYTECODE_TYPED_OPCODES(Name) Name##Int, Name##Float,
+#define CONCORD_BYTECODE_TYPED_REDUCTION_OPCODES(Name, FAccumulator, DefaultValue) Name##Int, Name##Float,
+enum class EConcordOpcode : uint8
+{
+    Fallback, // evaluates an expression the bytecode has no instruction for through its virtual ComputeValue
+    RandomVariable,
+    IntParameter,
+    FloatParameter,
+    IntValue,
+    FloatValue,
+    Cast,
+    CONCORD_BYTECODE_BINARY_OPERATORS(CONCORD_BYTECODE_TYPED_OPCODES)
+    CONCORD_BYTECODE_UNARY_OPERATORS(CONCORD_BYTECODE_TYPED_OPCODES)
+    CONCORD_BYTECODE_REDUCTIONS(CONCORD_BYTECODE_TYPED_REDUCTION_OPCODES)
+    ClampInt,
+    ClampFloat,
+    Get, // jumps to the branch of the value selected by the index, branches are only evaluated when taken
+    Table, // jumps to the branch of the table entry selected by the multi index
+    Jump // ends a branch, copies its value into the register of the Get or Table and jumps past the last branch
+};
+#undef CONCORD_BYTECODE_TYPED_OPCODES
+#undef CONCORD_BYTECODE_TYPED_REDUCTION_OPCODES
+
+namespace Concord
+{
+    // Typed opcodes come in int and float pairs, IntOpcode is the int one.
+    template<typename FValue> EConcordOpcode TypedOpcode(EConcordOpcode IntOpcode);
+    template<> inline EConcordOpcode TypedOpcode<int32>(EConcordOpcode IntOpcode) { return IntOpcode; }
+    template<> inline EConcordOpcode TypedOpcode<float>(EConcordOpcode IntOpcode) { return EConcordOpcode(uint8(IntOpcode) + 1); }
+}
+
+// Expression DAGs lowered to a flat register program, each distinct value is computed once into its own register.
+class CONCORD_API FConcordProgram
+{
+public:
+    void Compile(const TArray<FConcordSharedExpression>& RootExpressions);
+
+    // Evaluates all instructions and returns the values of the root expressions in order.
+    template<typename FValue>
+    void Eval(const FConcordExpressionContext<float>& Context, const TArrayView<FValue>& OutValues) const
+    {
+        const FConcordValue* Registers = Run(Context);
+        for (int32 Index = 0; Index < OutValues.Num(); ++Index) OutValues[Index] = Registers[ResultRegisters[Index]].template Get<FValue>();
+    }
+
+    float EvalFloat(const FConcordExpressionContext<float>& Context) const
+    {
+        float Value;
+        Eval(Context, TArrayView<float>(&Value, 1));
+        return Value;
+    }
+
+    float EvalSum(const FConcordExpressionContext<float>& Context) const
+    {
+        const FConcordValue* Registers = Run(Context);
+        float Sum = 0.0f;
+        for (int32 ResultRegister : ResultRegisters) Sum += Registers[ResultRegister].Float;
+        return Sum;
+    }
+
+    int32 GetFallbackCount() const { return Fallbacks.Num(); }
+private:
+    struct FInstruction
+    {
+        EConcordOpcode Opcode;
+        int32 Target;
+        int32 A; // source register, or block index, value index, operand offset or fallback index
+        int32 B; // second source register or operand count
+    };
+    TArray<FInstruction> Instructions;
+    TArray<int32> Operands; // source registers of reductions and clamps, index registers, table shapes and branch starts of lookups
+    TArray<int32> IntValues;
+    TArray<float> FloatValues;
+    TArray<FConcordSharedExpression> Fallbacks;
+    TArray<int32> ResultRegisters;
+    int32 RegisterCount = 0;
+
+    struct FLowering
+    {
+        TMap<const FConcordExpression*, int32> Registers;
+        TMultiMap<uint32, int32> ValueNumbers; // instruction hash to instruction index
+
+        // in lowering order, a closed branch forgets the values it computed since they only exist when it is taken
+        TArray<const FConcordExpression*> RegisterLog;
+        TArray<TPair<uint32, int32>> ValueNumberLog;
+    };
+    int32 Lower(const FConcordSharedExpression& Expression, FLowering& Lowering);
+    int32 LowerLookup(const FConcordSharedExpression& Expression, FLowering& Lowering);
+    int32 AddRegister(const FConcordSharedExpression& Expression, int32 Register, FLowering& Lowering);
+    bool IsSameValue(const FInstruction& Instruction, const FInstruction& Other) const;
+    const FConcordValue* Run(const FConcordExpressionContext<float>& Context) const; // returns the registers of the calling thread
+};
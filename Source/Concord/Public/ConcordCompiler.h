@@ -6,6 +6,8 @@
 #include "ConcordError.h"
 #include "ConcordShape.h"
 #include "ConcordExpression.h"
+#include "ConcordExpressionInterner.h"
+#include "ConcordExpressionFolder.h"
 #include "FactorGraph/ConcordFactorGraph.h"
 #include "UObject/StrongObjectPtr.h"
 
@@ -20,6 +22,7 @@ class UConcordInstance;
 class UConcordInstanceOutput;
 class UConcordParameter;
 class UConcordEmission;
+namespace ConcordFactorGraphDynamic { struct FAtomicHandle; }
 
 class CONCORD_API FConcordCompiler
 {
@@ -45,7 +48,7 @@ private:
     TOptional<FConcordError> SetDisjointSubgraphRootFlatRandomVariableIndices(FConcordFactorGraph<float>& FactorGraph) const;
     void AddConnected(int32 FlatRandomVariableIndex, TSet<int32>& AddedFlatRandomVariableIndices, const FConcordFactorGraph<float>& FactorGraph) const;
     TOptional<FConcordError> HandleCycles(EConcordCycleMode CycleMode, FConcordFactorGraph<float>& FactorGraph) const;
-    bool MergeCycle(int32 FlatRandomVariableIndex, const FConcordHandle* Handle, TArray<int32>& RandomVariablePath, TArray<const FConcordHandle*>& FactorPath, FConcordFactorGraph<float>& FactorGraph) const;
+    void MergeCycles(const TArray<int32>& HandleSetIndices, FConcordFactorGraph<float>& FactorGraph) const;
     static FConcordError GetCycleError(const TArray<int32>& RandomVariableCycle, FConcordFactorGraph<float>& FactorGraph);
     static FString GetRandomVariableIndexString(int32 FlatRandomVariableIndex, FConcordFactorGraph<float>& FactorGraph);
 
@@ -59,9 +62,12 @@ private:
     TArray<FConcordSharedParameterExpression<float>> AllFloatParameterExpressions;
     TSet<UConcordVertex*> VisitedVertices;
     TMap<const UConcordModel*, TSharedRef<FConcordFactorGraph<float>>> CompiledModels;
+    FConcordExpressionFolder Folder;
+    FConcordExpressionInterner Interner;
 
     FConcordSharedExpression GetRandomVariableExpression(const FConcordMultiIndex& BoxLocalIndex, FConcordShape BoxShape, int32 VariationBlockOffset) const;
     template<typename FValue> FConcordSharedExpression GetParameterExpression(const FConcordMultiIndex& ParameterLocalIndex, FConcordShape ParameterShape, int32 ParameterBlockOffset) const;
+    template<typename FValue> FConcordSharedExpression GetFrozenParameterExpression(const FConcordMultiIndex& ParameterLocalIndex, const UConcordParameter* Parameter) const;
 
     template<typename FValue> int32& GetParameterBlockOffset();
     template<> int32& GetParameterBlockOffset<int32>() { return IntParameterBlockOffset; }
@@ -77,5 +83,9 @@ private:
     template<typename FValue> void AddParameter(const FName& ParameterName, UConcordParameter* Parameter, FConcordFactorGraph<float>& FactorGraph);
     template<typename FValue> void AddTargetParameter(const FName& TargetParameterName, UConcordInstanceOutput* ObservedInstanceOutput, FConcordFactorGraph<float>& FactorGraph);
     void AddEmissionParameter(const FName& EmissionParameterName, int32 Size, FConcordFactorGraph<float>& FactorGraph, TArray<FConcordSharedExpression>& OutParameterExpressions);
-    void AddHandle(const FConcordSharedExpression& FactorExpression, FConcordFactorGraph<float>& FactorGraph) const;
+    using FTransformerIndex = TPair<const UConcordTransformer*, FConcordMultiIndex>;
+    static TArray<FConcordSharedExpression> GetFoldedExpressions(const TArray<FTransformerIndex>& TransformerIndices);
+    void AddHandle(const FConcordSharedExpression& FactorExpression, FConcordFactorGraph<float>& FactorGraph);
+    void AddHandles(TArray<FConcordSharedExpression>&& FoldedFactorExpressions, FConcordFactorGraph<float>& FactorGraph);
+    void RegisterHandle(TUniquePtr<ConcordFactorGraphDynamic::FAtomicHandle>&& Handle, FConcordFactorGraph<float>& FactorGraph) const;
 };
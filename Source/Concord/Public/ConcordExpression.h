@@ -5,9 +5,12 @@
 #include "CoreMinimal.h"
 #include "ConcordValue.h"
 #include "ConcordExpressionContext.h"
+#include "ConcordBytecode.h"
 
 class FConcordRandomVariableExpression;
 class FConcordComputingExpression;
+class FConcordTransformerTableExpression;
+class FConcordGetExpression;
 template<typename FValue> class FConcordParameterExpression;
 template<typename FValue> class FConcordValueExpression;
 
@@ -23,6 +26,7 @@ public:
     virtual const FConcordValueExpression<float>* AsFloatValueExpression() const { return nullptr; }
     virtual FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const = 0;
     virtual void AddNeighboringFlatRandomVariableIndices(TArray<int32>& OutNeighboringFlatRandomVariableIndices) const {}
+    virtual void AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const {}
 };
 
 using FConcordSharedExpression = TSharedRef<const FConcordExpression>;
@@ -60,6 +64,10 @@ public:
     {}
     const FConcordParameterExpression<int32>* AsIntParameterExpression() const override { return this; }
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override { return Context.IntParameters[FlatIndex]; }
+    void AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const override
+    {
+        OutIntParameterIndices.AddUnique(FlatIndex);
+    }
 };
 
 template<> class FConcordParameterExpression<float> : public FConcordBlockExpression
@@ -70,6 +78,10 @@ public:
     {}
     const FConcordParameterExpression<float>* AsFloatParameterExpression() const override { return this; }
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override { return Context.FloatParameters[FlatIndex]; }
+    void AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const override
+    {
+        OutFloatParameterIndices.AddUnique(FlatIndex);
+    }
 };
 
 template<typename FValue> using FConcordSharedParameterExpression = TSharedRef<const FConcordParameterExpression<FValue>>;
@@ -82,6 +94,17 @@ public:
     {}
     const TArray<FConcordSharedExpression> SourceExpressions;
     const FConcordComputingExpression* AsComputingExpression() const override { return this; }
+    virtual EConcordOpcode GetOpcode() const { return EConcordOpcode::Fallback; }
+    virtual const FConcordTransformerTableExpression* AsTableExpression() const { return nullptr; }
+    virtual const FConcordGetExpression* AsGetExpression() const { return nullptr; }
+    // Expressions with the same operation and identical sources are interchangeable, without an opcode they only equal themselves by default.
+    virtual uint32 GetOperationHash() const { return GetOpcode() == EConcordOpcode::Fallback ? PointerHash(this) : uint32(GetOpcode()); }
+    virtual bool HasSameOperation(const FConcordComputingExpression& Other) const
+    {
+        return GetOpcode() == EConcordOpcode::Fallback ? this == &Other : GetOpcode() == Other.GetOpcode();
+    }
+    // Returns an equivalent expression on the folded sources, or null if this expression cannot be rebuilt.
+    virtual TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const { return nullptr; }
 #if WITH_EDITOR
     virtual FString ToString() const = 0;
 #endif
@@ -90,6 +113,11 @@ public:
         for (const FConcordSharedExpression& SourceExpression : SourceExpressions)
             SourceExpression->AddNeighboringFlatRandomVariableIndices(OutNeighboringFlatRandomVariableIndices);
     }
+    void AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const override
+    {
+        for (const FConcordSharedExpression& SourceExpression : SourceExpressions)
+            SourceExpression->AddParameterDependencies(OutIntParameterIndices, OutFloatParameterIndices);
+    }
 };
 
 template<> class FConcordValueExpression<int32> : public FConcordExpression
@@ -109,3 +137,40 @@ public:
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override { return Value; }
     const float Value;
 };
+
+namespace Concord
+{
+    // FConcordValue stores floating point results as float and everything else as int32.
+    template<typename FResult> using TStoredValue = typename TChooseClass<TIsFloatingPoint<FResult>::Value, float, int32>::Result;
+
+    inline bool AreValueExpressions(const TArray<FConcordSharedExpression>& Expressions)
+    {
+        for (const FConcordSharedExpression& Expression : Expressions)
+            if (!Expression->AsIntValueExpression() && !Expression->AsFloatValueExpression()) return false;
+        return true;
+    }
+
+    // Integer division by a constant 0 is left unfolded, it may sit in a Get or Table branch that is never taken.
+    inline bool IsIntDivisionByZero(EConcordOpcode Opcode, const TArray<FConcordSharedExpression>& SourceExpressions)
+    {
+        const FConcordValueExpression<int32>* Divisor = SourceExpressions[1]->AsIntValueExpression();
+        return (Opcode == EConcordOpcode::DivideInt || Opcode == EConcordOpcode::ModuloInt) && Divisor && Divisor->Value == 0;
+    }
+
+    template<typename FStoredValue>
+    FConcordSharedExpression EvaluateConstantExpression(const FConcordExpression& Expression)
+    {
+        const FConcordVariation Variation; const FConcordObservationMask ObservationMask; const TArray<int32> IntParameters; const TArray<float> FloatParameters;
+        const FConcordExpressionContext<float> Context(Variation, ObservationMask, IntParameters, FloatParameters);
+        return MakeShared<const FConcordValueExpression<FStoredValue>>(Expression.ComputeValue(Context).template Get<FStoredValue>());
+    }
+
+    // Rebuilds an expression on folded sources and evaluates it right away if all of them are values.
+    template<typename FStoredValue, typename FExpression, typename... FArgs>
+    FConcordSharedExpression MakeFoldedExpression(TArray<FConcordSharedExpression>&& FoldedSourceExpressions, FArgs&&... Args)
+    {
+        if (AreValueExpressions(FoldedSourceExpressions))
+            return EvaluateConstantExpression<FStoredValue>(FExpression(MoveTemp(FoldedSourceExpressions), Forward<FArgs>(Args)...));
+        return MakeShared<const FExpression>(MoveTemp(FoldedSourceExpressions), Forward<FArgs>(Args)...);
+    }
+}
@@ -0,0 +1,19 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordExpression.h"
+
+// Folds constant subexpressions and simplifies arithmetic identities, which can drop random variable dependencies of factors.
+class CONCORD_API FConcordExpressionFolder
+{
+public:
+    FConcordSharedExpression Fold(const FConcordSharedExpression& Expression);
+private:
+    TMap<const FConcordExpression*, FConcordSharedExpression> FoldedExpressions;
+    TArray<FConcordSharedExpression> OriginalExpressions; // kept alive so the addresses keying FoldedExpressions are not reused
+
+    static FConcordSharedExpression Simplify(const FConcordSharedExpression& Expression);
+    static bool IsValue(const FConcordExpression& Expression, int32 Value);
+};
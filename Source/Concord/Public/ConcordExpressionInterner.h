@@ -0,0 +1,21 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordExpression.h"
+
+// Hash-conses expressions so that structurally identical subtrees across handles and outputs share one instance.
+class CONCORD_API FConcordExpressionInterner
+{
+public:
+    FConcordSharedExpression Intern(const FConcordSharedExpression& Expression);
+    int32 GetSharedCount() const { return ReplacedExpressions.Num(); }
+private:
+    TMap<const FConcordExpression*, FConcordSharedExpression> CanonicalExpressions;
+    TArray<FConcordSharedExpression> ReplacedExpressions; // kept alive so their addresses stay unique while interning
+    TMultiMap<uint32, FConcordSharedExpression> Buckets;
+
+    uint32 GetStructuralHash(const FConcordExpression& Expression, const TArray<const FConcordExpression*>& CanonicalSources) const;
+    bool IsStructurallyEqual(const FConcordExpression& Expression, const TArray<const FConcordExpression*>& CanonicalSources, const FConcordExpression& Candidate) const;
+};
@@ -0,0 +1,26 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordExpression.h"
+#include "FactorGraph/ConcordFactorGraph.h"
+
+// Versioned binary serialization of compiled factor graphs, so models can be loaded without recompiling.
+class CONCORD_API FConcordFactorGraphCache
+{
+public:
+    static constexpr int32 Version = 1;
+
+    // Returns false if the factor graph has instances or expressions that cannot be serialized.
+    static bool Save(const FConcordFactorGraph<float>& FactorGraph, uint32 Key, EConcordCycleMode CycleMode, TArray<uint8>& OutData);
+    // Returns null if the data is from another version, key or cycle mode, an unset key is not checked.
+    static TSharedPtr<FConcordFactorGraph<float>> Load(const TArray<uint8>& Data, TOptional<uint32> Key, EConcordCycleMode CycleMode);
+    // Returns the key the data was saved with, unset if the data is empty or from another version.
+    static TOptional<uint32> GetKey(const TArray<uint8>& Data);
+private:
+    static bool AddExpression(const FConcordSharedExpression& Expression, TMap<const FConcordExpression*, int32>& Ids, TArray<FConcordSharedExpression>& OrderedExpressions);
+    static void SaveExpression(FArchive& Ar, const FConcordExpression& Expression, const TMap<const FConcordExpression*, int32>& Ids);
+    static TSharedPtr<const FConcordExpression> LoadExpression(FArchive& Ar, const TArray<FConcordSharedExpression>& Expressions);
+    static TSharedPtr<const FConcordExpression> MakeComputingExpression(EConcordOpcode Opcode, TArray<FConcordSharedExpression>&& SourceExpressions);
+};
@@ -23,12 +23,19 @@ namespace ConcordFactorGraphDynamic
             : Factor(InFactor)
         {
             InFactor->AddNeighboringFlatRandomVariableIndices(NeighboringFlatRandomVariableIndices);
+            Program.Compile({ InFactor });
         }
         float Eval(const FConcordExpressionContext<float>& Context) const override
         {
-            return Factor->ComputeValue(Context).Float;
+            return Program.EvalFloat(Context);
+        }
+        bool AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const override
+        {
+            Factor->AddParameterDependencies(OutIntParameterIndices, OutFloatParameterIndices);
+            return true;
         }
         const FConcordSharedExpression Factor;
+        FConcordProgram Program;
     };
 
     struct CONCORD_API FMergedHandle : FHandle
@@ -38,20 +45,30 @@ namespace ConcordFactorGraphDynamic
         FMergedHandle& operator=(const FMergedHandle&) = delete;
         float Eval(const FConcordExpressionContext<float>& Context) const override
         {
-            float Score = 0.0f;
+            return Program.EvalSum(Context);
+        }
+        bool AddParameterDependencies(TArray<int32>& OutIntParameterIndices, TArray<int32>& OutFloatParameterIndices) const override
+        {
             for (const TUniquePtr<FAtomicHandle>& Handle : Children)
-                Score += Handle->Eval(Context);
-            return Score;
+                Handle->AddParameterDependencies(OutIntParameterIndices, OutFloatParameterIndices);
+            return true;
         }
         FMergedHandle* GetMergedHandle() override { return this; }
         const FMergedHandle* GetMergedHandle() const override { return this; }
-        void AddHandle(TUniquePtr<FAtomicHandle> InHandle)
+        void AddHandles(TArray<TUniquePtr<FAtomicHandle>>&& InHandles)
         {
-            for (int32 FlatRandomVariableIndex : InHandle->GetNeighboringFlatRandomVariableIndices())
-                NeighboringFlatRandomVariableIndices.AddUnique(FlatRandomVariableIndex);
-            Children.Add(MoveTemp(InHandle));
+            for (TUniquePtr<FAtomicHandle>& InHandle : InHandles)
+            {
+                for (int32 FlatRandomVariableIndex : InHandle->GetNeighboringFlatRandomVariableIndices())
+                    NeighboringFlatRandomVariableIndices.AddUnique(FlatRandomVariableIndex);
+                Children.Add(MoveTemp(InHandle));
+            }
+            TArray<FConcordSharedExpression> Factors;
+            for (const TUniquePtr<FAtomicHandle>& Handle : Children) Factors.Add(Handle->Factor);
+            Program.Compile(Factors); // one program over all children shares their common subexpressions
         }
         TArray<TUniquePtr<FAtomicHandle>> Children;
+        FConcordProgram Program;
     };
 
     struct CONCORD_API FOutput : FConcordFactorGraph<float>::FOutput
@@ -59,18 +76,21 @@ namespace ConcordFactorGraphDynamic
         FOutput(EConcordValueType InType, TArray<FConcordSharedExpression>&& InExpressions)
             : FConcordFactorGraph<float>::FOutput(InType)
             , Expressions(MoveTemp(InExpressions))
-        {}
+        {
+            Program.Compile(Expressions);
+        }
         void Eval(const FConcordExpressionContext<float>& Context, const TArrayView<int32>& OutData) const override
         {
             check(Expressions.Num() >= OutData.Num());
-            for (int32 Index = 0; Index < OutData.Num(); ++Index) OutData[Index] = Expressions[Index]->ComputeValue(Context).Int;
+            Program.Eval(Context, OutData);
         }
         void Eval(const FConcordExpressionContext<float>& Context, const TArrayView<float>& OutData) const override
         {
             check(Expressions.Num() >= OutData.Num());
-            for (int32 Index = 0; Index < OutData.Num(); ++Index) OutData[Index] = Expressions[Index]->ComputeValue(Context).Float;
+            Program.Eval(Context, OutData);
         }
         int32 Num() const override { return Expressions.Num(); }
         const TArray<FConcordSharedExpression> Expressions;
+        FConcordProgram Program;
     };
 };
@@ -58,8 +58,27 @@ public:
 
     TArray<UConcordVertex*> GetUpstreamSources() const;
 
+    // Compiled factor graph saved with the asset so loading it does not need to compile, see FConcordFactorGraphCache.
+    UPROPERTY()
+    TArray<uint8> CachedFactorGraphData;
+
+    uint32 ComputeCacheKey() const;
+
+#if WITH_EDITOR
+    void PreSave(FObjectPreSaveContext SaveContext) override;
+#endif
+
 #if WITH_EDITORONLY_DATA
     UPROPERTY()
     UConcordModelGraphBase* Graph;
 #endif // WITH_EDITORONLY_DATA
+
+private:
+#if WITH_EDITOR
+    uint32 GetCacheKey() const;
+    mutable TOptional<uint32> CachedCacheKey; // valid until the next edit of any object
+    mutable uint32 CachedCacheKeyEditSerial = 0;
+#elif !UE_BUILD_SHIPPING
+    mutable bool bCacheKeyChecked = false;
+#endif
 };
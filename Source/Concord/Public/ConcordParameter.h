@@ -18,6 +18,10 @@ public:
     UPROPERTY()
     bool bLocal;
 
+    // Compiles the default values into the model as constants, changing the parameter at runtime has no effect.
+    UPROPERTY(EditAnywhere, Category = "Parameter")
+    bool bFrozen;
+
     UPROPERTY(EditAnywhere, Category = "Parameter Default Crate")
     bool bGetDefaultValuesFromCrate;
 
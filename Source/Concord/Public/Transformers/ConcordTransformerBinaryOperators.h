@@ -47,6 +47,15 @@
             const FValue V1 = SourceExpressions[1]->ComputeValue(Context). template Get<FValue>();\
             return CONCORD_##Name(V);\
         }\
+        EConcordOpcode GetOpcode() const override { return Concord::TypedOpcode<FValue>(EConcordOpcode::Name##Int); }\
+        static auto Compute(FValue V0, FValue V1) { return CONCORD_##Name(V); }\
+        TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override\
+        {\
+            using FStoredValue = Concord::TStoredValue<decltype(Compute(FValue(), FValue()))>;\
+            if (Concord::IsIntDivisionByZero(GetOpcode(), FoldedSourceExpressions))\
+                return MakeShared<const FConcordOperator##Name##Expression>(MoveTemp(FoldedSourceExpressions));\
+            return Concord::MakeFoldedExpression<FStoredValue, FConcordOperator##Name##Expression>(MoveTemp(FoldedSourceExpressions));\
+        }\
         CONCORD_BINARY_OPERATOR_TO_STRING(Name)\
     };\
 \
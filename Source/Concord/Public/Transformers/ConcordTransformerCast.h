@@ -17,6 +17,13 @@ public:
     {
         return float(SourceExpressions[0]->ComputeValue(Context).Int);
     }
+    EConcordOpcode GetOpcode() const override { return EConcordOpcode::Cast; }
+    TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override
+    {
+        if (Concord::AreValueExpressions(FoldedSourceExpressions))
+            return Concord::EvaluateConstantExpression<float>(FConcordCastExpression(MoveTemp(FoldedSourceExpressions[0])));
+        return MakeShared<const FConcordCastExpression>(MoveTemp(FoldedSourceExpressions[0]));
+    }
 #if WITH_EDITOR
     FString ToString() const override
     {
@@ -14,6 +14,8 @@ public:
         : FConcordComputingExpression(MoveTemp(InSourceExpressions))
     {}
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override;
+    TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override;
+    EConcordOpcode GetOpcode() const override { return Concord::TypedOpcode<FValue>(EConcordOpcode::ClampInt); }
 #if WITH_EDITOR
     FString ToString() const override;
 #endif
@@ -13,6 +13,8 @@ public:
         : FConcordComputingExpression(MoveTemp(InSourceExpressions))
     {}
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override;
+    TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override;
+    const FConcordGetExpression* AsGetExpression() const override { return this; }
 #if WITH_EDITOR
     FString ToString() const override;
 #endif
@@ -43,6 +43,11 @@ public:\
             CONCORD_##Name(SourceExpression->ComputeValue(Context).Get<FValue>());\
         return Acc;\
     }\
+    EConcordOpcode GetOpcode() const override { return Concord::TypedOpcode<FValue>(EConcordOpcode::Name##Int); }\
+    TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override\
+    {\
+        return Concord::MakeFoldedExpression<FDefaultValueType, FConcord##Name##ReductionExpression>(MoveTemp(FoldedSourceExpressions));\
+    }\
     CONCORD_REDUCTION_TO_STRING(Name, FDefaultValueType, DefaultValue)\
 };\
 \
@@ -14,6 +14,20 @@ public:
         , TableShape(InTableShape)
     {}
     FConcordValue ComputeValue(const FConcordExpressionContext<float>& Context) const override;
+    const FConcordTransformerTableExpression* AsTableExpression() const override { return this; }
+    const FConcordShape& GetTableShape() const { return TableShape; }
+    TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override;
+    uint32 GetOperationHash() const override
+    {
+        uint32 Hash = GetTypeHash(TableShape.Num());
+        for (int32 DimSize : TableShape) Hash = HashCombine(Hash, GetTypeHash(DimSize));
+        return Hash;
+    }
+    bool HasSameOperation(const FConcordComputingExpression& Other) const override
+    {
+        const FConcordTransformerTableExpression* OtherTable = Other.AsTableExpression();
+        return OtherTable && OtherTable->TableShape == TableShape;
+    }
 #if WITH_EDITOR
     FString ToString() const override;
 #endif
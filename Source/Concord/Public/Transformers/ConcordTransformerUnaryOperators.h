@@ -46,6 +46,15 @@
         {\
             return CONCORD_##Name(SourceExpressions[0]->ComputeValue(Context). template Get<FValue>());\
         }\
+        EConcordOpcode GetOpcode() const override { return Concord::TypedOpcode<FValue>(EConcordOpcode::Name##Int); }\
+        static auto Compute(FValue V) { return CONCORD_##Name(V); }\
+        TSharedPtr<const FConcordExpression> Fold(TArray<FConcordSharedExpression>&& FoldedSourceExpressions) const override\
+        {\
+            using FStoredValue = Concord::TStoredValue<decltype(Compute(FValue()))>;\
+            if (Concord::AreValueExpressions(FoldedSourceExpressions))\
+                return Concord::EvaluateConstantExpression<FStoredValue>(FConcordOperator##Name##Expression(MoveTemp(FoldedSourceExpressions[0])));\
+            return MakeShared<const FConcordOperator##Name##Expression>(MoveTemp(FoldedSourceExpressions[0]));\
+        }\
         CONCORD_UNARY_OPERATOR_TO_STRING(Name)\
     };\
 \
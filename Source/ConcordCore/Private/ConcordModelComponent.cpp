@@ -155,6 +155,50 @@ void UConcordModelComponent::RunSamplerSync(float& Score)
     Sampler->GetEnvironment()->ReturnSampledVariationToStagingArea(Sampler->GetVariation());
 }
 
+void UConcordModelComponent::RunSamplerBatchSync(int32 Count, TArray<UConcordPattern*>& Patterns)
+{
+    SamplePatternsSync(TEXT("a batch"), [&](TArray<FConcordVariation>& Variations) { Sampler->SampleVariationsBatch(Count, Variations); }, Patterns);
+}
+
+void UConcordModelComponent::RunSamplerBestSync(int32 K, TArray<UConcordPattern*>& Patterns, TArray<float>& Scores)
+{
+    Scores.Reset();
+    SamplePatternsSync(TEXT("the best variations"), [&](TArray<FConcordVariation>& Variations) { Sampler->SampleBestVariationsSync(K, Variations, Scores); }, Patterns);
+}
+
+void UConcordModelComponent::SamplePatternsSync(const TCHAR* What, TFunctionRef<void(TArray<FConcordVariation>&)> SampleVariations, TArray<UConcordPattern*>& Patterns)
+{
+    Patterns.Reset();
+    if (!CheckSamplerExists()) return;
+    if (Sampler->IsSamplingVariation())
+    {
+        UE_LOG(LogConcordModelComponent, Error, TEXT("Cannot sample %s while an async sampling is in progress."), What);
+        return;
+    }
+    Sampler->GetEnvironment()->SetMaskAndParametersFromStagingArea();
+    Sampler->GetVariationFromEnvironment();
+    TArray<FConcordVariation> Variations;
+    SampleVariations(Variations);
+    Patterns.Reserve(Variations.Num());
+    for (const FConcordVariation& Variation : Variations)
+    {
+        UConcordPattern* Pattern = NewObject<UConcordPattern>(this);
+        Sampler->SetColumnsFromOutputs(Variation, Pattern->PatternData);
+        Patterns.Add(Pattern);
+    }
+}
+
+void UConcordModelComponent::SetSeed(int32 Seed)
+{
+    if (!CheckSamplerExists()) return;
+    if (Sampler->IsSamplingVariation())
+    {
+        UE_LOG(LogConcordModelComponent, Error, TEXT("Cannot set the seed while an async sampling is in progress."));
+        return;
+    }
+    Sampler->SetSeed(uint32(Seed));
+}
+
 void UConcordModelComponent::GetOutput(FName OutputName, TArray<int32>& Array)
 {
     if (!CheckSamplerExists() || !CheckOutputExists(OutputName, EConcordValueType::Int)) return;
@@ -12,17 +12,36 @@ FConcordFactorGraphEnvironment<FFloatType>::FConcordFactorGraphEnvironment(const
     StagingMask.Init(false, FactorGraph->GetRandomVariableCount());
     StagingIntParameters = FactorGraph-> template GetParameterDefaultValues<int32>();
     StagingFloatParameters = MakeArrayView(FactorGraph-> template GetParameterDefaultValues<float>());
+    ChangedRandomVariables.Flags.Init(false, StagingVariation.Num());
+    ChangedIntParameters.Flags.Init(false, StagingIntParameters.Num());
+    ChangedFloatParameters.Flags.Init(false, StagingFloatParameters.Num());
     SetMaskAndParametersFromStagingArea();
 }
 
 template<typename FFloatType>
 void FConcordFactorGraphEnvironment<FFloatType>::SetMaskAndParametersFromStagingArea()
 {
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < Mask.Num(); ++FlatRandomVariableIndex)
+        if (Mask[FlatRandomVariableIndex] != StagingMask[FlatRandomVariableIndex] || (StagingMask[FlatRandomVariableIndex] && ObservedVariation[FlatRandomVariableIndex] != StagingVariation[FlatRandomVariableIndex]))
+            ChangedRandomVariables.Add(FlatRandomVariableIndex);
+    for (int32 Index = 0; Index < IntParameters.Num(); ++Index)
+        if (IntParameters[Index] != StagingIntParameters[Index]) ChangedIntParameters.Add(Index);
+    for (int32 Index = 0; Index < FloatParameters.Num(); ++Index)
+        if (FloatParameters[Index] != StagingFloatParameters[Index]) ChangedFloatParameters.Add(Index);
+    ObservedVariation = StagingVariation;
     Mask = StagingMask;
     IntParameters = StagingIntParameters;
     FloatParameters = StagingFloatParameters;
 }
 
+template<typename FFloatType>
+void FConcordFactorGraphEnvironment<FFloatType>::ResetChanges()
+{
+    ChangedRandomVariables.Reset();
+    ChangedIntParameters.Reset();
+    ChangedFloatParameters.Reset();
+}
+
 template<typename FFloatType>
 void FConcordFactorGraphEnvironment<FFloatType>::ReturnSampledVariationToStagingArea(const TArray<int32>& Variation)
 {
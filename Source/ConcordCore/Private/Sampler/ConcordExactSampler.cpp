@@ -1,35 +1,48 @@
 // Copyright 2022 Jan Klimaschewski. All Rights Reserved.
 
 #include "Sampler/ConcordExactSampler.h"
+#include "Sampler/ConcordJunctionTreeSampler.h"
+#include "Async/ParallelFor.h"
 
 using namespace Concord;
 
 FConcordExactSampler::FConcordExactSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
                                            TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
-                                           bool bInMaximizeScore)
+                                           bool bInMaximizeScore, uint64 InMinTaskCost)
     : FConcordSampler(MoveTemp(InFactorGraph), MoveTemp(InEnvironment), bInMaximizeScore)
 #if WITH_EDITOR
     , bInitSumProductDone(!bMaximizeScore)
 #endif
+    , bInitMaxSumDone(bMaximizeScore)
     , MaxSum(GetFactorGraph(), GetExpressionContextMutable())
     , SumProduct(GetFactorGraph(), GetExpressionContextMutable())
 {
+    SumProduct.SetMinTaskCost(InMinTaskCost);
     if (bMaximizeScore) MaxSum.Init();
     else SumProduct.Init();
 }
 
 float FConcordExactSampler::SampleVariation()
 {
-    if (bMaximizeScore) return MaxSum.Run();
-    SumProduct.RunInward();
+    if (bMaximizeScore)
+    {
+        InvalidateMaxSumScoreTables();
+        GetEnvironment()->ResetChanges();
+        return MaxSum.Run();
+    }
+    if (!RunSumProductInward()) return SamplingUtils.GetScore();
     return DoAncestralSampling();
 }
 
 #if WITH_EDITOR
 float FConcordExactSampler::SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals)
 {
-    if (!bInitSumProductDone) SumProduct.Init();
-    SumProduct.RunInward();
+    if (!bInitSumProductDone)
+    {
+        SumProduct.Init();
+        bInitSumProductDone = true;
+    }
+    if (!RunSumProductInward()) return SamplingUtils.GetScore();
     const float Score = bMaximizeScore ? MaxSum.Run() : DoAncestralSampling();
     FConcordVariation VariationBackup = Variation;
     SumProduct.RunOutward();
@@ -40,7 +53,7 @@ float FConcordExactSampler::SampleVariationAndInferMarginals(FConcordProbabiliti
 
 void FConcordExactSampler::GetMarginals(FConcordProbabilities& OutMarginals)
 {
-    TArray<double> DoubleDistribution;
+    TArray<FMessage> Distribution;
     for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
     {
         FConcordDistribution& Marginal = OutMarginals[FlatRandomVariableIndex];
@@ -52,108 +65,227 @@ void FConcordExactSampler::GetMarginals(FConcordProbabilities& OutMarginals)
         }
         else
         {
-            DoubleDistribution.Init(1.0, StateCount);
-            for (const FConcordFactorHandleBase<float>* Handle : GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex))
-                for (int32 Value = 0; Value < StateCount; ++Value)
-                    DoubleDistribution[Value] *= SumProduct.GetMessages().VariableMessageFactors[FlatRandomVariableIndex][Handle][Value];
-            NormalizeDistribution(DoubleDistribution);
-            Marginal.Empty(DoubleDistribution.Num());
-            for (const double& Prob : DoubleDistribution)
+            Distribution.SetNumUninitialized(StateCount);
+            for (int32 Value = 0; Value < StateCount; ++Value)
+                Distribution[Value] = SumProduct.GetMessages().GetVariableMessageProduct(FlatRandomVariableIndex, Value);
+            FMessagePolicy::ToDistribution(Distribution);
+            Marginal.Empty(Distribution.Num());
+            for (const FMessage& Prob : Distribution)
                 Marginal.Add(float(Prob));
         }
     }
 }
 #endif
 
-float FConcordExactSampler::DoAncestralSampling()
+void FConcordExactSampler::SampleBestVariations(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores)
+{
+    if (!bInitMaxSumDone)
+    {
+        MaxSum.Init();
+        bInitMaxSumDone = true;
+    }
+    InvalidateMaxSumScoreTables(); // the changes are left to the next sampling, which invalidates its tables with them
+    const FConcordVariation InitialVariation = Variation;
+    MaxSum.RunKBest(K, OutVariations, OutScores);
+    Variation = OutVariations.Num() > 0 ? OutVariations[0] : InitialVariation;
+}
+
+void FConcordExactSampler::InvalidateMaxSumScoreTables()
+{
+    MaxSum.InvalidateScoreTables(GetEnvironment()->GetChangedIntParameterIndices(), GetEnvironment()->GetChangedFloatParameterIndices());
+}
+
+bool FConcordExactSampler::RunSumProductInward()
 {
-    TArray<double> DoubleDistribution;
+    SumProduct.InvalidatePotentialTables(GetEnvironment()->GetChangedIntParameterIndices(), GetEnvironment()->GetChangedFloatParameterIndices());
+    if (bInitMaxSumDone) InvalidateMaxSumScoreTables();
+    const bool bParametersChanged = !GetEnvironment()->GetChangedIntParameterIndices().IsEmpty() || !GetEnvironment()->GetChangedFloatParameterIndices().IsEmpty();
+    const bool bFeasible = SumProduct.PruneDomains(GetEnvironment()->GetChangedFlatRandomVariableIndices(), bParametersChanged);
+    if (bFeasible) SumProduct.RunInward(GetEnvironment()->GetChangedFlatRandomVariableIndices());
+    else UE_LOG(LogConcordCore, Warning, TEXT("The observed values and parameters leave no variation with a non-zero probability, keeping the previous variation."));
+    GetEnvironment()->ResetChanges();
+    return bFeasible;
+}
+
+void FConcordExactSampler::SampleVariations(int32 Count, TArray<FConcordVariation>& OutVariations)
+{
+    if (bMaximizeScore)
+    {
+        FConcordSampler::SampleVariations(Count, OutVariations);
+        return;
+    }
+    OutVariations.Init(Variation, Count);
+    if (!RunSumProductInward()) return;
+
+    // the root distributions do not depend on the sampled values, so each is turned into an alias table once
+    TArray<FConcordAliasTable<FMessage>> RootAliasTables;
+    TArray<FMessage> Distribution;
     for (int32 RootFlatRandomVariableIndex : GetFactorGraph()->GetDisjointSubgraphRootFlatRandomVariableIndices())
     {
-        if (!GetEnvironment()->GetMask()[RootFlatRandomVariableIndex])
+        FConcordAliasTable<FMessage>& RootAliasTable = RootAliasTables.AddDefaulted_GetRef();
+        if (GetEnvironment()->GetMask()[RootFlatRandomVariableIndex]) continue;
+        Distribution.SetNumUninitialized(GetFactorGraph()->GetStateCount(RootFlatRandomVariableIndex));
+        for (int32 Value = 0; Value < Distribution.Num(); ++Value)
+            Distribution[Value] = SumProduct.GetMessages().GetVariableMessageProduct(RootFlatRandomVariableIndex, Value);
+        FMessagePolicy::ToDistribution(Distribution);
+        RootAliasTable.Init(Distribution);
+    }
+
+    TArray<FConcordRandomStream> RandomStreams;
+    RandomStreams.Reserve(Count);
+    for (int32 Index = 0; Index < Count; ++Index) RandomStreams.Add(RandomStream.Split());
+    ParallelFor(Count, [&](int32 Index) { DoAncestralSampling(OutVariations[Index], RandomStreams[Index], false, &RootAliasTables); });
+}
+
+class FConcordExactSampler::FAncestralSamplingTask
+{
+    const FConcordExactSampler* const Sampler;
+    FConcordVariation* const OutVariation;
+    const int32 FromIndex;
+    const int32 ParentHandleIndex;
+    const FConcordRandomStream RandomStream;
+public:
+    FAncestralSamplingTask(const FConcordExactSampler* InSampler, FConcordVariation* InOutVariation, int32 InFromIndex, int32 InParentHandleIndex, FConcordRandomStream InRandomStream)
+        : Sampler(InSampler), OutVariation(InOutVariation), FromIndex(InFromIndex), ParentHandleIndex(InParentHandleIndex), RandomStream(InRandomStream)
+    {}
+    FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FConcordExactSamplerAncestralSamplingTask, STATGROUP_TaskGraphTasks); }
+    static ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyThread; }
+    static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
+    void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+    {
+        FAncestralSamplingScratch Scratch { {}, RandomStream, MyCompletionGraphEvent.GetReference() };
+        Sampler->DoAncestralSamplingBelow(*OutVariation, FromIndex, ParentHandleIndex, Scratch);
+    }
+};
+
+float FConcordExactSampler::DoAncestralSampling()
+{
+    DoAncestralSampling(Variation, RandomStream.Split(), true);
+    return SamplingUtils.GetScore();
+}
+
+void FConcordExactSampler::DoAncestralSampling(FConcordVariation& OutVariation, FConcordRandomStream InRandomStream, bool bParallelize, const TArray<FConcordAliasTable<FMessage>>* RootAliasTables) const
+{
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+        if (!GetEnvironment()->GetMask()[FlatRandomVariableIndex])
+            OutVariation[FlatRandomVariableIndex] = GetFactorGraph()->GetStateCount(FlatRandomVariableIndex); // marks the value as not yet sampled
+    FAncestralSamplingScratch Scratch { {}, InRandomStream, nullptr };
+    FGraphEventArray OutstandingEvents;
+    const TArray<int32>& RootFlatRandomVariableIndices = GetFactorGraph()->GetDisjointSubgraphRootFlatRandomVariableIndices();
+    for (int32 RootIndex = 0; RootIndex < RootFlatRandomVariableIndices.Num(); ++RootIndex)
+    {
+        const int32 RootFlatRandomVariableIndex = RootFlatRandomVariableIndices[RootIndex];
+        if (RootAliasTables && !(*RootAliasTables)[RootIndex].IsEmpty())
+        {
+            OutVariation[RootFlatRandomVariableIndex] = (*RootAliasTables)[RootIndex].Sample(Scratch.RandomStream);
+        }
+        else if (!GetEnvironment()->GetMask()[RootFlatRandomVariableIndex])
         {
             const int32 StateCount = GetFactorGraph()->GetStateCount(RootFlatRandomVariableIndex);
-            DoubleDistribution.Init(1.0, StateCount);
-            for (const FConcordFactorHandleBase<float>* NeighboringHandle : GetFactorGraph()->GetNeighboringHandles(RootFlatRandomVariableIndex))
-                for (int32 Value = 0; Value < StateCount; ++Value)
-                    DoubleDistribution[Value] *= SumProduct.GetMessages().VariableMessageFactors[RootFlatRandomVariableIndex][NeighboringHandle][Value];
-            NormalizeDistribution(DoubleDistribution);
-            Variation[RootFlatRandomVariableIndex] = SampleDistribution(DoubleDistribution);
+            Scratch.Distribution.SetNumUninitialized(StateCount);
+            for (int32 Value = 0; Value < StateCount; ++Value)
+                Scratch.Distribution[Value] = SumProduct.GetMessages().GetVariableMessageProduct(RootFlatRandomVariableIndex, Value);
+            FMessagePolicy::ToCumulativeDistribution(Scratch.Distribution);
+            OutVariation[RootFlatRandomVariableIndex] = SampleCumulativeDistribution(Scratch.Distribution, Scratch.RandomStream);
         }
-        for (const FConcordFactorHandleBase<float>* NeighboringHandle : GetFactorGraph()->GetNeighboringHandles(RootFlatRandomVariableIndex))
-            for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
-                if (NeighboringFlatRandomVariableIndex != RootFlatRandomVariableIndex)
-                    DoAncestralSampling(NeighboringHandle, NeighboringFlatRandomVariableIndex, DoubleDistribution);
+        if (bParallelize && SumProduct.IsTaskWorthy(RootFlatRandomVariableIndex))
+            OutstandingEvents.Add(TGraphTask<FAncestralSamplingTask>::CreateTask().ConstructAndDispatchWhenReady(this, &OutVariation, RootFlatRandomVariableIndex, INDEX_NONE, Scratch.RandomStream.Split()));
+        else DoAncestralSamplingBelow(OutVariation, RootFlatRandomVariableIndex, INDEX_NONE, Scratch);
     }
-    return SamplingUtils.GetScore();
+    if (!OutstandingEvents.IsEmpty()) FTaskGraphInterface::Get().WaitUntilTasksComplete(OutstandingEvents);
 }
 
-void FConcordExactSampler::DoAncestralSampling(const FConcordFactorHandleBase<float>* FromHandle, int32 ToIndex, TArray<double>& DistributionScratch)
+void FConcordExactSampler::DoAncestralSampling(FConcordVariation& OutVariation, int32 FromHandleIndex, int32 ToIndex, FAncestralSamplingScratch& Scratch) const
 {
     if (!GetEnvironment()->GetMask()[ToIndex])
     {
         const int32 StateCount = GetFactorGraph()->GetStateCount(ToIndex);
-        DistributionScratch.Init(0.0, StateCount);
-        for (Variation[ToIndex] = 0; Variation[ToIndex] < StateCount; ++Variation[ToIndex])
-            AncestralSamplingImpl(FromHandle, ToIndex, 0, 0, SumProduct.GetMessages().FactorMessages[FromHandle].Num(), DistributionScratch[Variation[ToIndex]]);
-        NormalizeDistribution(DistributionScratch);
-        Variation[ToIndex] = SampleDistribution(DistributionScratch);
+        Scratch.Distribution.Init(FMessagePolicy::Zero(), StateCount);
+        for (OutVariation[ToIndex] = 0; OutVariation[ToIndex] < StateCount; ++OutVariation[ToIndex])
+            if (SumProduct.IsInDomain(ToIndex, OutVariation[ToIndex])) // the factor messages of pruned values are not computed
+                AncestralSamplingImpl(OutVariation, FromHandleIndex, 0, 0, Scratch.Distribution[OutVariation[ToIndex]]);
+        FMessagePolicy::ToCumulativeDistribution(Scratch.Distribution);
+        OutVariation[ToIndex] = SampleCumulativeDistribution(Scratch.Distribution, Scratch.RandomStream);
     }
 
-    for (const FConcordFactorHandleBase<float>* NeighboringHandle : GetFactorGraph()->GetNeighboringHandles(ToIndex))
-        if (NeighboringHandle != FromHandle)
-            for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
-                if (NeighboringFlatRandomVariableIndex != ToIndex)
-                    DoAncestralSampling(NeighboringHandle, NeighboringFlatRandomVariableIndex, DistributionScratch);
+    // Siblings sharing the handle are sampled one after the other, only the subtree below a sampled value is independent.
+    if (Scratch.CompletionEvent && SumProduct.IsTaskWorthy(ToIndex))
+        Scratch.CompletionEvent->DontCompleteUntil(TGraphTask<FAncestralSamplingTask>::CreateTask().ConstructAndDispatchWhenReady(this, &OutVariation, ToIndex, FromHandleIndex, Scratch.RandomStream.Split()));
+    else DoAncestralSamplingBelow(OutVariation, ToIndex, FromHandleIndex, Scratch);
+}
+
+void FConcordExactSampler::DoAncestralSamplingBelow(FConcordVariation& OutVariation, int32 FromIndex, int32 ParentHandleIndex, FAncestralSamplingScratch& Scratch) const
+{
+    for (int32 NeighboringHandleIndex : SumProduct.GetLayout().GetNeighboringHandleIndices(FromIndex))
+        if (NeighboringHandleIndex != ParentHandleIndex)
+            for (int32 NeighboringFlatRandomVariableIndex : GetFactorGraph()->GetHandles()[NeighboringHandleIndex]->GetNeighboringFlatRandomVariableIndices())
+                if (NeighboringFlatRandomVariableIndex != FromIndex)
+                    DoAncestralSampling(OutVariation, NeighboringHandleIndex, NeighboringFlatRandomVariableIndex, Scratch);
 }
 
-void FConcordExactSampler::AncestralSamplingImpl(const FConcordFactorHandleBase<float>* FromHandle, int32 ToIndex, int32 NeighboringIndicesIndex, int32 FactorMessageIndex, int32 FactorMessageStride, double& Acc)
+void FConcordExactSampler::AncestralSamplingImpl(FConcordVariation& OutVariation, int32 FromHandleIndex, int32 NeighboringIndicesIndex, int32 FactorMessageIndex, FMessage& Acc) const
 {
-    if (NeighboringIndicesIndex == FromHandle->GetNeighboringFlatRandomVariableIndices().Num())
+    const TArray<int32>& NeighboringFlatRandomVariableIndices = GetFactorGraph()->GetHandles()[FromHandleIndex]->GetNeighboringFlatRandomVariableIndices();
+    if (NeighboringIndicesIndex == NeighboringFlatRandomVariableIndices.Num())
     {
-        Acc += SumProduct.GetMessages().FactorMessages[FromHandle][FactorMessageIndex];
+        FMessagePolicy::Add(Acc, SumProduct.GetMessages().GetFactorMessages(FromHandleIndex)[FactorMessageIndex]);
         return;
     }
 
-    const int32 FlatRandomVariableIndex = FromHandle->GetNeighboringFlatRandomVariableIndices()[NeighboringIndicesIndex];
+    const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighboringIndicesIndex];
     const int32 StateCount = GetFactorGraph()->GetStateCount(FlatRandomVariableIndex);
-    FactorMessageStride /= StateCount;
-    if (GetEnvironment()->GetMask()[FlatRandomVariableIndex] || Variation[FlatRandomVariableIndex] < StateCount) // inward pass leaves variation values at StateCount
+    const int32 FactorMessageStride = SumProduct.GetLayout().GetNeighborStride(FromHandleIndex, NeighboringIndicesIndex);
+    if (GetEnvironment()->GetMask()[FlatRandomVariableIndex] || OutVariation[FlatRandomVariableIndex] < StateCount) // values not sampled yet are at StateCount
     {
-        FactorMessageIndex += Variation[FlatRandomVariableIndex] * FactorMessageStride;
-        AncestralSamplingImpl(FromHandle, ToIndex, NeighboringIndicesIndex + 1, FactorMessageIndex, FactorMessageStride, Acc);
+        FactorMessageIndex += OutVariation[FlatRandomVariableIndex] * FactorMessageStride;
+        AncestralSamplingImpl(OutVariation, FromHandleIndex, NeighboringIndicesIndex + 1, FactorMessageIndex, Acc);
     }
-    else for (Variation[FlatRandomVariableIndex] = 0; Variation[FlatRandomVariableIndex] < StateCount; ++Variation[FlatRandomVariableIndex])
+    else for (OutVariation[FlatRandomVariableIndex] = 0; OutVariation[FlatRandomVariableIndex] < StateCount; ++OutVariation[FlatRandomVariableIndex])
     {
-        AncestralSamplingImpl(FromHandle, ToIndex, NeighboringIndicesIndex + 1, FactorMessageIndex, FactorMessageStride, Acc);
+        if (SumProduct.IsInDomain(FlatRandomVariableIndex, OutVariation[FlatRandomVariableIndex]))
+            AncestralSamplingImpl(OutVariation, FromHandleIndex, NeighboringIndicesIndex + 1, FactorMessageIndex, Acc);
         FactorMessageIndex += FactorMessageStride;
     }
 }
 
 UConcordExactSamplerFactory::UConcordExactSamplerFactory()
     : bMergeCycles(true)
+    , bUseJunctionTree(false)
     , ComplexityThreshold(1<<15)
+    , MinTaskCost(1<<12)
 {}
 
 TSharedPtr<FConcordSampler> UConcordExactSamplerFactory::CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const
 {
-    if (FactorGraph->GetHasCycle())
+    if (FactorGraph->GetHasCycle() && !bUseJunctionTree)
     {
         OutErrorMessage = TEXT("Trying to create exact sampler for factor graph that contains a cycle.");
         return {};
     }
-    const uint64 Complexity = FactorGraph->GetComplexity();
+    const uint64 Complexity = GetComplexity(FactorGraph.Get());
     if (Complexity > ComplexityThreshold)
     {
         OutErrorMessage = FString::Printf(TEXT("Complexity Threshold exceeded: %llu"), Complexity);
         return {};
     }
     auto Environment = MakeShared<FConcordFactorGraphEnvironment<float>>(FactorGraph);
-    auto Sampler = MakeShared<FConcordExactSampler>(MoveTemp(FactorGraph), MoveTemp(Environment), bMaximizeScore);
+    if (FactorGraph->GetHasCycle())
+    {
+        TSharedRef<FConcordSampler> Sampler = MakeShared<FConcordJunctionTreeSampler>(MoveTemp(FactorGraph), MoveTemp(Environment), bMaximizeScore);
+        return MoveTemp(Sampler);
+    }
+    auto Sampler = MakeShared<FConcordExactSampler>(MoveTemp(FactorGraph), MoveTemp(Environment), bMaximizeScore, MinTaskCost);
     return MoveTemp(Sampler);
 }
 
 EConcordCycleMode UConcordExactSamplerFactory::GetCycleMode() const
 {
+    if (bUseJunctionTree) return EConcordCycleMode::Ignore;
     return bMergeCycles ? EConcordCycleMode::Merge : EConcordCycleMode::Error;
 }
+
+uint64 UConcordExactSamplerFactory::GetComplexity(const FConcordFactorGraph<float>& FactorGraph) const
+{
+    if (FactorGraph.GetHasCycle()) return FConcordFactorGraphJunctionTree<float>::GetComplexity(FactorGraph);
+    return FactorGraph.GetComplexity();
+}
@@ -1,6 +1,7 @@
 // Copyright 2022 Jan Klimaschewski. All Rights Reserved.
 
 #include "Sampler/ConcordGibbsSampler.h"
+#include "Async/ParallelFor.h"
 
 using namespace Concord;
 
@@ -9,38 +10,113 @@ FConcordGibbsSampler::FConcordGibbsSampler(TSharedRef<const FConcordFactorGraph<
                                            bool bInMaximizeScore, int32 InBurnIn, int32 InMarginalsIterationCount)
     : FConcordMarkovChainSampler(MoveTemp(InFactorGraph), MoveTemp(InEnvironment), bInMaximizeScore, InBurnIn, InMarginalsIterationCount)
 {
-    Scores.Reserve(32);
-    Distribution.Reserve(32);
+    InitColors();
+    ScoreCache.Init(*GetFactorGraph());
 }
 
-TOptional<float> FConcordGibbsSampler::SamplingInitialization()
+void FConcordGibbsSampler::InitColors()
 {
-    SamplingUtils.InitVariation();
-    return {};
+    // greedy coloring of the random variables sharing a handle, most connected first
+    const int32 RandomVariableCount = GetFactorGraph()->GetRandomVariableCount();
+    TArray<TArray<int32>> NeighboringFlatRandomVariableIndices;
+    NeighboringFlatRandomVariableIndices.SetNum(RandomVariableCount);
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < RandomVariableCount; ++FlatRandomVariableIndex)
+        for (const auto& Handle : GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex))
+            for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+                if (NeighboringFlatRandomVariableIndex != FlatRandomVariableIndex)
+                    NeighboringFlatRandomVariableIndices[FlatRandomVariableIndex].AddUnique(NeighboringFlatRandomVariableIndex);
+
+    TArray<int32> Order;
+    SamplingUtils.GetIndexArray(Order);
+    Order.StableSort([&](int32 A, int32 B) { return NeighboringFlatRandomVariableIndices[A].Num() > NeighboringFlatRandomVariableIndices[B].Num(); });
+    TArray<int32> Colors;
+    Colors.Init(INDEX_NONE, RandomVariableCount);
+    TBitArray<> UsedColors;
+    int32 ColorCount = 0;
+    for (int32 FlatRandomVariableIndex : Order)
+    {
+        UsedColors.Init(false, ColorCount + 1);
+        for (int32 NeighboringFlatRandomVariableIndex : NeighboringFlatRandomVariableIndices[FlatRandomVariableIndex])
+            if (Colors[NeighboringFlatRandomVariableIndex] != INDEX_NONE)
+                UsedColors[Colors[NeighboringFlatRandomVariableIndex]] = true;
+        Colors[FlatRandomVariableIndex] = UsedColors.Find(false);
+        ColorCount = FMath::Max(ColorCount, Colors[FlatRandomVariableIndex] + 1);
+    }
+
+    ColorOffsets.Init(0, ColorCount + 1);
+    for (int32 Color : Colors) ++ColorOffsets[Color + 1];
+    int32 MaxColorSize = 0;
+    for (int32 Color = 0; Color < ColorCount; ++Color)
+    {
+        MaxColorSize = FMath::Max(MaxColorSize, ColorOffsets[Color + 1]);
+        ColorOffsets[Color + 1] += ColorOffsets[Color];
+    }
+    ColoredFlatRandomVariableIndices.SetNumUninitialized(RandomVariableCount);
+    TArray<int32> ColorCursors(ColorOffsets.GetData(), ColorCount);
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < RandomVariableCount; ++FlatRandomVariableIndex)
+        ColoredFlatRandomVariableIndices[ColorCursors[Colors[FlatRandomVariableIndex]]++] = FlatRandomVariableIndex;
+
+    ChunkScratches.SetNum(FMath::DivideAndRoundUp(MaxColorSize, ChunkSize));
+    for (FChunkScratch& ChunkScratch : ChunkScratches)
+    {
+        ChunkScratch.Scores.Reserve(32);
+        ChunkScratch.Distribution.Reserve(32);
+    }
 }
 
-void FConcordGibbsSampler::SamplingIteration()
+template<bool bTrackScore>
+float FConcordGibbsSampler::SampleColors()
 {
-    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    float ScoreDelta = 0;
+    for (int32 ColorIndex = 0; ColorIndex + 1 < ColorOffsets.Num(); ++ColorIndex)
     {
-        if (GetEnvironment()->GetMask()[FlatRandomVariableIndex]) continue;
-        SamplingUtils.ComputeConditionalDistribution(FlatRandomVariableIndex, Scores, Distribution);
-        Variation[FlatRandomVariableIndex] = SampleDistribution(Distribution);
+        const int32 ChunkCount = FMath::DivideAndRoundUp(ColorOffsets[ColorIndex + 1] - ColorOffsets[ColorIndex], ChunkSize);
+        for (int32 ChunkIndex = 0; ChunkIndex < ChunkCount; ++ChunkIndex)
+            ChunkScratches[ChunkIndex].RandomStream = RandomStream.Split();
+        ParallelFor(ChunkCount, [&](int32 ChunkIndex) { SampleChunk<bTrackScore>(ColorIndex, ChunkIndex); }, ChunkCount == 1);
+        if (bTrackScore)
+            for (int32 ChunkIndex = 0; ChunkIndex < ChunkCount; ++ChunkIndex)
+                ScoreDelta += ChunkScratches[ChunkIndex].ScoreDelta;
     }
+    return ScoreDelta;
 }
 
-void FConcordGibbsSampler::SamplingIteration(float& InOutScore)
+template<bool bTrackScore>
+void FConcordGibbsSampler::SampleChunk(int32 ColorIndex, int32 ChunkIndex)
 {
-    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    FChunkScratch& Scratch = ChunkScratches[ChunkIndex];
+    Scratch.ScoreDelta = 0;
+    const int32 Begin = ColorOffsets[ColorIndex] + ChunkIndex * ChunkSize;
+    const int32 End = FMath::Min(Begin + ChunkSize, ColorOffsets[ColorIndex + 1]);
+    for (int32 Index = Begin; Index < End; ++Index)
     {
+        const int32 FlatRandomVariableIndex = ColoredFlatRandomVariableIndices[Index];
         if (GetEnvironment()->GetMask()[FlatRandomVariableIndex]) continue;
-        SamplingUtils.ComputeConditionalDistribution(FlatRandomVariableIndex, Scores, Distribution);
-        const float PreviousScoreContribution = Scores[Variation[FlatRandomVariableIndex]];
-        Variation[FlatRandomVariableIndex] = SampleDistribution(Distribution);
-        InOutScore += Scores[Variation[FlatRandomVariableIndex]] - PreviousScoreContribution;
+        SamplingUtils.ComputeConditionalCumulativeDistribution(FlatRandomVariableIndex, ScoreCache, Scratch.Scores, Scratch.Distribution);
+        const int32 PreviousValue = Variation[FlatRandomVariableIndex];
+        Variation[FlatRandomVariableIndex] = SampleCumulativeDistribution(Scratch.Distribution, Scratch.RandomStream);
+        if (Variation[FlatRandomVariableIndex] != PreviousValue) ScoreCache.MarkChanged(FlatRandomVariableIndex);
+        if (bTrackScore) Scratch.ScoreDelta += Scratch.Scores[Variation[FlatRandomVariableIndex]] - Scratch.Scores[PreviousValue];
     }
 }
 
+TOptional<float> FConcordGibbsSampler::SamplingInitialization()
+{
+    SamplingUtils.InitVariation(RandomStream);
+    ScoreCache.Reset();
+    return {};
+}
+
+void FConcordGibbsSampler::SamplingIteration()
+{
+    SampleColors<false>();
+}
+
+void FConcordGibbsSampler::SamplingIteration(float& InOutScore)
+{
+    InOutScore += SampleColors<true>();
+}
+
 TSharedPtr<FConcordSampler> UConcordGibbsSamplerFactory::CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const
 {
     auto Environment = MakeShared<FConcordFactorGraphEnvironment<float>>(FactorGraph);
@@ -0,0 +1,53 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "Sampler/ConcordJunctionTreeSampler.h"
+
+FConcordJunctionTreeSampler::FConcordJunctionTreeSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                                         TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                                         bool bInMaximizeScore)
+    : FConcordSampler(MoveTemp(InFactorGraph), MoveTemp(InEnvironment), bInMaximizeScore)
+    , JunctionTree(GetFactorGraph(), GetExpressionContextMutable())
+{
+    JunctionTree.Init();
+}
+
+void FConcordJunctionTreeSampler::InvalidateJunctionTree()
+{
+    JunctionTree.Invalidate(GetEnvironment()->GetChangedIntParameterIndices(), GetEnvironment()->GetChangedFloatParameterIndices(), GetEnvironment()->GetChangedFlatRandomVariableIndices());
+    GetEnvironment()->ResetChanges();
+}
+
+float FConcordJunctionTreeSampler::SampleVariation()
+{
+    InvalidateJunctionTree();
+    const float Score = JunctionTree.Run(bMaximizeScore, RandomStream);
+    return bMaximizeScore ? Score : SamplingUtils.GetScore();
+}
+
+#if WITH_EDITOR
+float FConcordJunctionTreeSampler::SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals)
+{
+    const float Score = SampleVariation();
+    const FConcordVariation SampledVariation = Variation;
+
+    TArray<TArray<int32>> Frequencies; Frequencies.SetNum(OutMarginals.Num());
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+        Frequencies[FlatRandomVariableIndex].SetNumZeroed(GetFactorGraph()->GetStateCount(FlatRandomVariableIndex));
+    JunctionTree.Eliminate(false); // only recomputes anything if the score was maximized
+    for (int32 SampleIndex = 0; SampleIndex < MarginalsSampleCount; ++SampleIndex)
+    {
+        JunctionTree.SampleBackwards(false, RandomStream);
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+            ++Frequencies[FlatRandomVariableIndex][Variation[FlatRandomVariableIndex]];
+    }
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    {
+        OutMarginals[FlatRandomVariableIndex].SetNumUninitialized(Frequencies[FlatRandomVariableIndex].Num());
+        for (int32 Value = 0; Value < Frequencies[FlatRandomVariableIndex].Num(); ++Value)
+            OutMarginals[FlatRandomVariableIndex][Value] = Frequencies[FlatRandomVariableIndex][Value] / float(MarginalsSampleCount);
+    }
+
+    Variation = SampledVariation;
+    return Score;
+}
+#endif
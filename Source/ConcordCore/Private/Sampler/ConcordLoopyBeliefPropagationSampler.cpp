@@ -0,0 +1,199 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "Sampler/ConcordLoopyBeliefPropagationSampler.h"
+
+using namespace Concord;
+
+FConcordLoopyBeliefPropagationSampler::FConcordLoopyBeliefPropagationSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                                                             TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                                                             bool bInMaximizeScore, EConcordMessageSchedule InSchedule, int32 InMaxIterationCount,
+                                                                             float InConvergenceThreshold, float InDamping)
+    : FConcordSampler(MoveTemp(InFactorGraph), MoveTemp(InEnvironment), bInMaximizeScore)
+    , Schedule(InSchedule)
+    , MaxIterationCount(InMaxIterationCount)
+    , ConvergenceThreshold(InConvergenceThreshold)
+    , Damping(FMath::Clamp(InDamping, 0.0f, 0.99f))
+    , ClampMask(GetEnvironment()->GetMask())
+    , SumProduct(GetFactorGraph(), { Variation, ClampMask, GetEnvironment()->GetIntParameters(), GetEnvironment()->GetFloatParameters() })
+{
+    SumProduct.InitLoopy();
+    for (int32 HandleIndex = 0; HandleIndex < GetFactorGraph()->GetHandles().Num(); ++HandleIndex)
+    {
+        EdgeOffsets.Add(Edges.Num());
+        for (int32 NeighborIndex = 0; NeighborIndex < GetFactorGraph()->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices().Num(); ++NeighborIndex)
+            Edges.Emplace(HandleIndex, NeighborIndex);
+    }
+    Residuals.Init(0.0, Edges.Num());
+    EdgesQueued.Init(false, Edges.Num());
+}
+
+float FConcordLoopyBeliefPropagationSampler::SampleVariation()
+{
+    RunLoopyFromEnvironment();
+    return SampleVariationFromMessages();
+}
+
+void FConcordLoopyBeliefPropagationSampler::RunLoopyFromEnvironment()
+{
+    ClampMask = GetEnvironment()->GetMask();
+    SumProduct.InvalidatePotentialTables(GetEnvironment()->GetChangedIntParameterIndices(), GetEnvironment()->GetChangedFloatParameterIndices());
+    GetEnvironment()->ResetChanges();
+    RunLoopy();
+}
+
+float FConcordLoopyBeliefPropagationSampler::SampleVariationFromMessages()
+{
+    // beliefs of random variables sampled later are conditioned on the values clamped before them
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    {
+        if (ClampMask[FlatRandomVariableIndex]) continue;
+        GetBelief(FlatRandomVariableIndex);
+        if (bMaximizeScore)
+        {
+            int32 MaxValue = 0;
+            for (int32 Value = 1; Value < Distribution.Num(); ++Value)
+                if (Distribution[Value] > Distribution[MaxValue])
+                    MaxValue = Value;
+            Variation[FlatRandomVariableIndex] = MaxValue;
+            continue;
+        }
+        FMessagePolicy::ToCumulativeDistribution(Distribution);
+        Variation[FlatRandomVariableIndex] = SampleCumulativeDistribution(Distribution, RandomStream);
+        ClampMask[FlatRandomVariableIndex] = true;
+        PropagateClamp(FlatRandomVariableIndex);
+    }
+    return SamplingUtils.GetScore();
+}
+
+#if WITH_EDITOR
+float FConcordLoopyBeliefPropagationSampler::SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals)
+{
+    RunLoopyFromEnvironment();
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    {
+        FConcordDistribution& Marginal = OutMarginals[FlatRandomVariableIndex];
+        if (ClampMask[FlatRandomVariableIndex])
+        {
+            Marginal.Init(0.0f, GetFactorGraph()->GetStateCount(FlatRandomVariableIndex));
+            Marginal[Variation[FlatRandomVariableIndex]] = 1.0f;
+            continue;
+        }
+        GetBelief(FlatRandomVariableIndex);
+        FMessagePolicy::ToDistribution(Distribution);
+        Marginal.Empty(Distribution.Num());
+        for (const FMessage& Prob : Distribution)
+            Marginal.Add(float(Prob));
+    }
+    return SampleVariationFromMessages();
+}
+#endif
+
+void FConcordLoopyBeliefPropagationSampler::RunLoopy()
+{
+    SumProduct.ResetLoopy();
+    if (Schedule == EConcordMessageSchedule::Residual)
+    {
+        RunResidualLoopy();
+        return;
+    }
+    for (int32 IterationIndex = 0; IterationIndex < MaxIterationCount; ++IterationIndex)
+    {
+        double MaxResidual = 0.0;
+        for (const TPair<int32, int32>& Edge : Edges)
+            MaxResidual = FMath::Max(MaxResidual, SumProduct.SendLoopyMessage(Edge.Key, Edge.Value, Damping));
+        if (MaxResidual < ConvergenceThreshold) break;
+    }
+}
+
+void FConcordLoopyBeliefPropagationSampler::RunResidualLoopy()
+{
+    // the heap holds stale entries of edges whose pending residual was raised or that were sent since, they are skipped when popped
+    using FEntry = TPair<double, int32>;
+    TArray<FEntry> Heap;
+    auto IsLarger = [](const FEntry& A, const FEntry& B) { return A.Key > B.Key; };
+    for (double& Residual : Residuals) Residual = 0.0;
+    auto Send = [&](int32 EdgeIndex)
+    {
+        const TPair<int32, int32>& Edge = Edges[EdgeIndex];
+        Residuals[EdgeIndex] = 0.0;
+        const double Residual = SumProduct.SendLoopyMessage(Edge.Key, Edge.Value, Damping);
+        if (Residual < ConvergenceThreshold) return;
+        const int32 TargetFlatRandomVariableIndex = GetFactorGraph()->GetHandles()[Edge.Key]->GetNeighboringFlatRandomVariableIndices()[Edge.Value];
+        ForEachEdgeFrom(TargetFlatRandomVariableIndex, Edge.Key, [&](int32 DependentEdgeIndex)
+        {
+            if (Residual <= Residuals[DependentEdgeIndex]) return;
+            Residuals[DependentEdgeIndex] = Residual;
+            Heap.HeapPush(FEntry(Residual, DependentEdgeIndex), IsLarger);
+        });
+    };
+
+    for (int32 EdgeIndex = 0; EdgeIndex < Edges.Num(); ++EdgeIndex) Send(EdgeIndex);
+    const int64 MaxSendCount = int64(MaxIterationCount - 1) * Edges.Num();
+    for (int64 SendCount = 0; SendCount < MaxSendCount && Heap.Num() > 0;)
+    {
+        FEntry Entry;
+        Heap.HeapPop(Entry, IsLarger, false);
+        if (Entry.Key != Residuals[Entry.Value]) continue;
+        Send(Entry.Value);
+        ++SendCount;
+    }
+}
+
+template<typename FFunc>
+void FConcordLoopyBeliefPropagationSampler::ForEachEdgeFrom(int32 FlatRandomVariableIndex, int32 ExcludedHandleIndex, FFunc&& Func) const
+{
+    for (int32 HandleIndex : SumProduct.GetLayout().GetNeighboringHandleIndices(FlatRandomVariableIndex))
+    {
+        if (HandleIndex == ExcludedHandleIndex) continue;
+        const TArray<int32>& NeighboringFlatRandomVariableIndices = GetFactorGraph()->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices();
+        for (int32 NeighborIndex = 0; NeighborIndex < NeighboringFlatRandomVariableIndices.Num(); ++NeighborIndex)
+            if (NeighboringFlatRandomVariableIndices[NeighborIndex] != FlatRandomVariableIndex)
+                Func(EdgeOffsets[HandleIndex] + NeighborIndex);
+    }
+}
+
+void FConcordLoopyBeliefPropagationSampler::PropagateClamp(int32 FlatRandomVariableIndex)
+{
+    TArray<int32> Queue;
+    auto EnqueueEdgesFrom = [&](int32 FromIndex, int32 ExcludedHandleIndex)
+    {
+        ForEachEdgeFrom(FromIndex, ExcludedHandleIndex, [&](int32 EdgeIndex)
+        {
+            const TPair<int32, int32>& Edge = Edges[EdgeIndex];
+            if (ClampMask[GetFactorGraph()->GetHandles()[Edge.Key]->GetNeighboringFlatRandomVariableIndices()[Edge.Value]] || EdgesQueued[EdgeIndex]) return;
+            EdgesQueued[EdgeIndex] = true;
+            Queue.Add(EdgeIndex);
+        });
+    };
+
+    // messages that still change by more than the convergence threshold pass the clamped value on, at most one sweep of messages is sent
+    EnqueueEdgesFrom(FlatRandomVariableIndex, INDEX_NONE);
+    int32 QueueIndex = 0;
+    for (; QueueIndex < Queue.Num() && QueueIndex < Edges.Num(); ++QueueIndex)
+    {
+        const TPair<int32, int32>& Edge = Edges[Queue[QueueIndex]];
+        EdgesQueued[Queue[QueueIndex]] = false;
+        if (SumProduct.SendLoopyMessage(Edge.Key, Edge.Value, 0.0) >= ConvergenceThreshold)
+            EnqueueEdgesFrom(GetFactorGraph()->GetHandles()[Edge.Key]->GetNeighboringFlatRandomVariableIndices()[Edge.Value], Edge.Key);
+    }
+    for (; QueueIndex < Queue.Num(); ++QueueIndex) EdgesQueued[Queue[QueueIndex]] = false;
+}
+
+void FConcordLoopyBeliefPropagationSampler::GetBelief(int32 FlatRandomVariableIndex)
+{
+    Distribution.SetNumUninitialized(GetFactorGraph()->GetStateCount(FlatRandomVariableIndex));
+    for (int32 Value = 0; Value < Distribution.Num(); ++Value)
+        Distribution[Value] = SumProduct.GetMessages().GetVariableMessageProduct(FlatRandomVariableIndex, Value);
+}
+
+TSharedPtr<FConcordSampler> UConcordLoopyBeliefPropagationSamplerFactory::CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const
+{
+    auto Environment = MakeShared<FConcordFactorGraphEnvironment<float>>(FactorGraph);
+    TSharedRef<FConcordSampler> Sampler = MakeShared<FConcordLoopyBeliefPropagationSampler>(MoveTemp(FactorGraph), MoveTemp(Environment), bMaximizeScore, Schedule, MaxIterationCount, ConvergenceThreshold, Damping);
+    return MoveTemp(Sampler);
+}
+
+EConcordCycleMode UConcordLoopyBeliefPropagationSamplerFactory::GetCycleMode() const
+{
+    return EConcordCycleMode::Ignore;
+}
@@ -0,0 +1,106 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#include "Sampler/ConcordParallelTemperingSampler.h"
+#include "Async/ParallelFor.h"
+
+using namespace Concord;
+
+FConcordParallelTemperingSampler::FChain::FChain(FConcordParallelTemperingSampler& Sampler, float InInverseTemperature)
+    : Variation(Sampler.Variation)
+    , SamplingUtils(Sampler.GetFactorGraph(), { Variation, Sampler.GetEnvironment()->GetMask(), Sampler.GetEnvironment()->GetIntParameters(), Sampler.GetEnvironment()->GetFloatParameters() })
+    , InverseTemperature(InInverseTemperature)
+    , Score(0)
+{
+    Scores.Reserve(32);
+    Distribution.Reserve(32);
+}
+
+void FConcordParallelTemperingSampler::FChain::Sweep(const FConcordSampler& Sampler)
+{
+    for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < Sampler.GetFactorGraph()->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+    {
+        if (Sampler.GetEnvironment()->GetMask()[FlatRandomVariableIndex]) continue;
+        SamplingUtils.ComputeConditionalScores(FlatRandomVariableIndex, Scores);
+        for (float& ValueScore : Scores) ValueScore *= InverseTemperature;
+        GetCumulativeDistributionFromLogValues(TArrayView<const float>(Scores), Distribution);
+        Variation[FlatRandomVariableIndex] = SampleCumulativeDistribution(Distribution, RandomStream);
+    }
+    Score = SamplingUtils.GetScore();
+}
+
+FConcordParallelTemperingSampler::FConcordParallelTemperingSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                                                   TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                                                   bool bInMaximizeScore, int32 InBurnIn, int32 InMarginalsIterationCount,
+                                                                   int32 ChainCount, float MaxTemperature)
+    : FConcordMarkovChainSampler(MoveTemp(InFactorGraph), MoveTemp(InEnvironment), bInMaximizeScore, InBurnIn, InMarginalsIterationCount)
+    , bSwapEven(true)
+{
+    ChainCount = FMath::Max(ChainCount, 1);
+    for (int32 ChainIndex = 0; ChainIndex < ChainCount; ++ChainIndex)
+    {
+        const float Temperature = ChainCount > 1 ? FMath::Pow(FMath::Max(MaxTemperature, 1.0f), ChainIndex / float(ChainCount - 1)) : 1.0f;
+        Chains.Add(MakeUnique<FChain>(*this, 1.0f / Temperature));
+    }
+}
+
+TOptional<float> FConcordParallelTemperingSampler::SamplingInitialization()
+{
+    for (const TUniquePtr<FChain>& Chain : Chains)
+    {
+        Chain->Variation = Variation;
+        Chain->RandomStream = RandomStream.Split();
+        Chain->SamplingUtils.InitVariation(Chain->RandomStream);
+    }
+    Variation = Chains[0]->Variation;
+    return {};
+}
+
+int32 FConcordParallelTemperingSampler::RunChains()
+{
+    ParallelFor(Chains.Num(), [&](int32 ChainIndex) { Chains[ChainIndex]->Sweep(*this); }, Chains.Num() == 1);
+
+    // replica exchange between neighboring temperatures, alternating the pairs to let states travel the whole ladder
+    for (int32 ChainIndex = bSwapEven ? 0 : 1; ChainIndex + 1 < Chains.Num(); ChainIndex += 2)
+    {
+        FChain& Colder = *Chains[ChainIndex];
+        FChain& Hotter = *Chains[ChainIndex + 1];
+        const float LogAcceptance = (Hotter.Score - Colder.Score) * (Colder.InverseTemperature - Hotter.InverseTemperature);
+        if (LogAcceptance >= 0 || FMath::Loge(RandomStream.FRand()) < LogAcceptance)
+        {
+            Swap(Colder.Variation, Hotter.Variation);
+            Swap(Colder.Score, Hotter.Score);
+        }
+    }
+    bSwapEven = !bSwapEven;
+
+    int32 BestChainIndex = 0;
+    for (int32 ChainIndex = 1; ChainIndex < Chains.Num(); ++ChainIndex)
+        if (Chains[ChainIndex]->Score > Chains[BestChainIndex]->Score)
+            BestChainIndex = ChainIndex;
+    return BestChainIndex;
+}
+
+void FConcordParallelTemperingSampler::SamplingIteration()
+{
+    RunChains();
+    Variation = Chains[0]->Variation;
+}
+
+void FConcordParallelTemperingSampler::SamplingIteration(float& InOutScore)
+{
+    const FChain& BestChain = *Chains[RunChains()];
+    Variation = BestChain.Variation;
+    InOutScore = BestChain.Score;
+}
+
+TSharedPtr<FConcordSampler> UConcordParallelTemperingSamplerFactory::CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const
+{
+    auto Environment = MakeShared<FConcordFactorGraphEnvironment<float>>(FactorGraph);
+    TSharedRef<FConcordSampler> Sampler = MakeShared<FConcordParallelTemperingSampler>(MoveTemp(FactorGraph), MoveTemp(Environment), bMaximizeScore, BurnIn, MarginalsIterationCount, ChainCount, MaxTemperature);
+    return MoveTemp(Sampler);
+}
+
+EConcordCycleMode UConcordParallelTemperingSamplerFactory::GetCycleMode() const
+{
+    return EConcordCycleMode::Ignore;
+}
@@ -9,6 +9,7 @@ FConcordSampler::FConcordSampler(TSharedRef<const FConcordFactorGraph<float>> In
     , FactorGraph(MoveTemp(InFactorGraph))
     , Environment(MoveTemp(InEnvironment))
     , SamplingUtils(&FactorGraph.Get(), GetExpressionContextMutable())
+    , RandomStream(FPlatformTime::Cycles64() ^ UPTRINT(this))
 {
     GetVariationFromEnvironment();
 }
@@ -21,6 +22,45 @@ float FConcordSampler::SampleVariationSync()
     return SampleVariation();
 }
 
+void FConcordSampler::SampleVariationsBatch(int32 Count, TArray<FConcordVariation>& OutVariations)
+{
+    checkf(!IsSamplingVariation(), TEXT("Tried to sample a batch of variations while an asynchronous sampling was in progress"));
+    OutVariations.Reset(Count);
+    if (IsSamplingVariation() || Count < 1) return;
+    RunInstanceSamplers();
+    SampleVariations(Count, OutVariations);
+}
+
+void FConcordSampler::SampleVariations(int32 Count, TArray<FConcordVariation>& OutVariations)
+{
+    const FConcordVariation InitialVariation = Variation;
+    for (int32 Index = 0; Index < Count; ++Index)
+    {
+        Variation = InitialVariation;
+        SampleVariation();
+        OutVariations.Add(Variation);
+    }
+}
+
+void FConcordSampler::SampleBestVariationsSync(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores)
+{
+    checkf(!IsSamplingVariation(), TEXT("Tried to sample the best variations while an asynchronous sampling was in progress"));
+    OutVariations.Reset(K);
+    OutScores.Reset(K);
+    if (IsSamplingVariation() || K < 1) return;
+    if (!CanSampleBestVariations())
+    {
+        UE_LOG(LogConcordCore, Warning, TEXT("The sampler cannot find the best variations, use an exact sampler to find them."));
+        return;
+    }
+    RunInstanceSamplers();
+    SampleBestVariations(K, OutVariations, OutScores);
+}
+
+void FConcordSampler::SampleBestVariations(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores)
+{
+}
+
 void FConcordSampler::SampleVariationAsync()
 {
     checkf(!IsSamplingVariation(), TEXT("Tried to sample a variation asynchronously while another asynchronous sampling was in progress"));
@@ -101,6 +141,12 @@ template void FConcordSampler::FillInstanceInputs<float>(const TPair<FName, TSha
 
 void FConcordSampler::SetColumnsFromOutputs(FConcordPatternData& OutPatternData) const
 {
+    SetColumnsFromOutputs(Variation, OutPatternData);
+}
+
+void FConcordSampler::SetColumnsFromOutputs(const FConcordVariation& InVariation, FConcordPatternData& OutPatternData) const
+{
+    const FConcordExpressionContext<float> Context(InVariation, GetEnvironment()->GetMask(), GetEnvironment()->GetIntParameters(), GetEnvironment()->GetFloatParameters());
     TMap<FString, FConcordTrack> PreviousTracks = MoveTemp(OutPatternData.Tracks);
     OutPatternData.Tracks.Reset();
     for (const auto& NameOutputPair : GetFactorGraph()->GetOutputs())
@@ -118,10 +164,10 @@ void FConcordSampler::SetColumnsFromOutputs(FConcordPatternData& OutPatternData)
         FConcordColumn* PreviousColumn = (PreviousTrack && ColumnPath.ColumnIndex < PreviousTrack->Columns.Num()) ? &PreviousTrack->Columns[ColumnPath.ColumnIndex] : nullptr;
         switch (ColumnPath.ColumnValuesType)
         {
-        case EConcordColumnValuesType::Note: SetColumnFromOutput(NameOutputPair.Value.Get(), Column.NoteValues, PreviousColumn ? &PreviousColumn->NoteValues : nullptr); break;
-        case EConcordColumnValuesType::Instrument: SetColumnFromOutput(NameOutputPair.Value.Get(), Column.InstrumentValues, PreviousColumn ? &PreviousColumn->InstrumentValues : nullptr); break;
-        case EConcordColumnValuesType::Volume: SetColumnFromOutput(NameOutputPair.Value.Get(), Column.VolumeValues, PreviousColumn ? &PreviousColumn->VolumeValues : nullptr); break;
-        case EConcordColumnValuesType::Delay: SetColumnFromOutput(NameOutputPair.Value.Get(), Column.DelayValues, PreviousColumn ? &PreviousColumn->DelayValues : nullptr); break;
+        case EConcordColumnValuesType::Note: SetColumnFromOutput(Context, NameOutputPair.Value.Get(), Column.NoteValues, PreviousColumn ? &PreviousColumn->NoteValues : nullptr); break;
+        case EConcordColumnValuesType::Instrument: SetColumnFromOutput(Context, NameOutputPair.Value.Get(), Column.InstrumentValues, PreviousColumn ? &PreviousColumn->InstrumentValues : nullptr); break;
+        case EConcordColumnValuesType::Volume: SetColumnFromOutput(Context, NameOutputPair.Value.Get(), Column.VolumeValues, PreviousColumn ? &PreviousColumn->VolumeValues : nullptr); break;
+        case EConcordColumnValuesType::Delay: SetColumnFromOutput(Context, NameOutputPair.Value.Get(), Column.DelayValues, PreviousColumn ? &PreviousColumn->DelayValues : nullptr); break;
         }
     }
 }
@@ -149,11 +195,11 @@ void FConcordSampler::FillCrateWithOutputs(FConcordCrateData& OutCrateData) cons
     }
 }
 
-void FConcordSampler::SetColumnFromOutput(const FConcordFactorGraph<float>::FOutput* Output, TArray<int32>& TargetArray, TArray<int32>* PreviousArray) const
+void FConcordSampler::SetColumnFromOutput(const FConcordExpressionContext<float>& Context, const FConcordFactorGraph<float>::FOutput* Output, TArray<int32>& TargetArray, TArray<int32>* PreviousArray) const
 {
     if (PreviousArray) TargetArray = MoveTemp(*PreviousArray);
     TargetArray.SetNumUninitialized(Output->Num(), false);
-    Output->Eval(GetExpressionContext(), TargetArray);
+    Output->Eval(Context, TargetArray);
 }
 
 void FConcordSampler::GetVariationFromEnvironment()
@@ -161,6 +207,13 @@ void FConcordSampler::GetVariationFromEnvironment()
     Variation = Environment->GetStagingVariation();
 }
 
+void FConcordSampler::SetSeed(uint64 Seed)
+{
+    RandomStream = FConcordRandomStream(Seed);
+    for (const auto& InstanceNameSamplerPair : FactorGraph->GetInstanceSamplers())
+        InstanceNameSamplerPair.Value->SetSeed(RandomStream.Next());
+}
+
 FConcordProbabilities FConcordSampler::GetConditionalProbabilities()
 {
     FConcordProbabilities Probabilities; Probabilities.AddDefaulted(Variation.Num());
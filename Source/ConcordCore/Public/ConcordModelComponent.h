@@ -88,6 +88,15 @@ public:
     UFUNCTION(BlueprintCallable, Category = "Concord")
     void RunSamplerSync(float& Score);
 
+    UFUNCTION(BlueprintCallable, Category = "Concord")
+    void RunSamplerBatchSync(int32 Count, TArray<UConcordPattern*>& Patterns);
+
+    UFUNCTION(BlueprintCallable, Category = "Concord")
+    void RunSamplerBestSync(int32 K, TArray<UConcordPattern*>& Patterns, TArray<float>& Scores);
+
+    UFUNCTION(BlueprintCallable, Category = "Concord")
+    void SetSeed(int32 Seed);
+
     UFUNCTION(BlueprintCallable, Category = "Concord")
     void GetOutput(FName OutputName, TArray<int32>& Array);
 
@@ -140,4 +149,5 @@ private:
 #endif
     void Setup();
     const UConcordSamplerFactory* GetActiveSamplerFactory() const;
+    void SamplePatternsSync(const TCHAR* What, TFunctionRef<void(TArray<FConcordVariation>&)> SampleVariations, TArray<UConcordPattern*>& Patterns);
 };
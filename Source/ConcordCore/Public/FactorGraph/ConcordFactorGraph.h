@@ -112,5 +112,6 @@ private:
     template<> inline TArray<float>& GetParameterDefaultValues<float>() { return FloatParameterDefaultValues; }
 
     friend class FConcordCompiler;
+    friend class FConcordFactorGraphCache;
     friend class UConcordNativeModel;
 };
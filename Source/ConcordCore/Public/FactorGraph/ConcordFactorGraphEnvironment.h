@@ -45,9 +45,24 @@ public:
     const TArray<int32>& GetIntParameters() const { return IntParameters; }
     const TArray<FFloatType>& GetFloatParameters() const { return FloatParameters; }
     template<typename FValue> TArrayView<FValue> GetParametersView(const FConcordFactorGraphBlock& Block);
-    template<> inline TArrayView<int32> GetParametersView(const FConcordFactorGraphBlock& Block) { return MakeArrayView(IntParameters.GetData() + Block.Offset, Block.Size); }
-    template<> inline TArrayView<FFloatType> GetParametersView(const FConcordFactorGraphBlock& Block) { return MakeArrayView(FloatParameters.GetData() + Block.Offset, Block.Size); }
+    template<> inline TArrayView<int32> GetParametersView(const FConcordFactorGraphBlock& Block) { ChangedIntParameters.AddBlock(Block); return MakeArrayView(IntParameters.GetData() + Block.Offset, Block.Size); }
+    template<> inline TArrayView<FFloatType> GetParametersView(const FConcordFactorGraphBlock& Block) { ChangedFloatParameters.AddBlock(Block); return MakeArrayView(FloatParameters.GetData() + Block.Offset, Block.Size); }
+
+    // changes to the mask, observed values and parameters since the last call to ResetChanges
+    const TArray<int32>& GetChangedFlatRandomVariableIndices() const { return ChangedRandomVariables.Indices; }
+    const TArray<int32>& GetChangedIntParameterIndices() const { return ChangedIntParameters.Indices; }
+    const TArray<int32>& GetChangedFloatParameterIndices() const { return ChangedFloatParameters.Indices; }
+    void ResetChanges();
 private:
+    struct FChangeSet
+    {
+        void Add(int32 Index) { if (!Flags[Index]) { Flags[Index] = true; Indices.Add(Index); } }
+        void AddBlock(const FConcordFactorGraphBlock& Block) { for (int32 Index = Block.Offset; Index < Block.Offset + Block.Size; ++Index) Add(Index); }
+        void Reset() { for (int32 Index : Indices) Flags[Index] = false; Indices.Reset(); }
+        TBitArray<> Flags;
+        TArray<int32> Indices;
+    };
+
     template<typename FValue> bool TrySetParameterBlock(const FName& BlockName, const TArray<FValue>& Values);
     template<typename FValue> bool TryUnsetParameterBlock(const FName& BlockName);
 
@@ -68,4 +83,9 @@ private:
     FConcordObservationMask Mask;
     TArray<int32> IntParameters;
     TArray<FFloatType> FloatParameters;
+
+    FConcordVariation ObservedVariation;
+    FChangeSet ChangedRandomVariables;
+    FChangeSet ChangedIntParameters;
+    FChangeSet ChangedFloatParameters;
 };
@@ -0,0 +1,402 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordFactorGraph.h"
+#include "ConcordFactorGraphLayout.h"
+#include "ConcordFactorGraphSamplingUtils.h"
+#include <limits>
+
+// Exact inference on factor graphs with cycles by bucket elimination along a min-fill order. Each eliminated random
+// variable gets a clique table over itself and its neighbors at elimination time, so the cost is bounded by the
+// treewidth of the graph instead of the length of its cycles. Tables are kept in log space, the variation is then
+// sampled or decoded backwards through the cliques. Handle score tables, clique tables and messages are cached across
+// runs and only recomputed for the cliques affected by invalidated parameters or observations, and their ancestors.
+template<typename FFloatType>
+class FConcordFactorGraphJunctionTree
+{
+public:
+    FConcordFactorGraphJunctionTree(const FConcordFactorGraph<FFloatType>* InFactorGraph, const FConcordExpressionContextMutable<FFloatType>& InContext)
+        : FactorGraph(InFactorGraph)
+        , Context(InContext)
+    {}
+
+    void Init()
+    {
+        StateCounts.Reset(FactorGraph->GetRandomVariableCount());
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+            StateCounts.Add(FactorGraph->GetStateCount(FlatRandomVariableIndex));
+        const TArray<int32> EliminationOrder = GetEliminationOrder(*FactorGraph);
+        TArray<int32> EliminationPositions;
+        EliminationPositions.SetNumUninitialized(EliminationOrder.Num());
+        for (int32 Position = 0; Position < EliminationOrder.Num(); ++Position)
+            EliminationPositions[EliminationOrder[Position]] = Position;
+        const auto ByEliminationPosition = [&](int32 A, int32 B) { return EliminationPositions[A] < EliminationPositions[B]; };
+
+        // handles go to the clique of their first eliminated neighbor, messages to the clique of their first eliminated separator variable
+        Cliques.Reset(EliminationOrder.Num());
+        Cliques.SetNum(EliminationOrder.Num());
+        HandleCliquePositions.Init(INDEX_NONE, FactorGraph->GetHandles().Num());
+        for (int32 HandleIndex = 0; HandleIndex < FactorGraph->GetHandles().Num(); ++HandleIndex)
+        {
+            const TArray<int32>& NeighboringFlatRandomVariableIndices = FactorGraph->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices();
+            if (NeighboringFlatRandomVariableIndices.IsEmpty()) continue;
+            int32 FirstPosition = MAX_int32;
+            for (int32 FlatRandomVariableIndex : NeighboringFlatRandomVariableIndices)
+                FirstPosition = FMath::Min(FirstPosition, EliminationPositions[FlatRandomVariableIndex]);
+            Cliques[FirstPosition].HandleIndices.Add(HandleIndex);
+            HandleCliquePositions[HandleIndex] = FirstPosition;
+        }
+        for (int32 Position = 0; Position < EliminationOrder.Num(); ++Position)
+        {
+            FClique& Clique = Cliques[Position];
+            TArray<int32> Separator;
+            for (int32 HandleIndex : Clique.HandleIndices)
+                for (int32 FlatRandomVariableIndex : FactorGraph->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices())
+                    Separator.AddUnique(FlatRandomVariableIndex);
+            for (int32 ChildPosition : Clique.ChildPositions)
+                for (int32 FlatRandomVariableIndex : Cliques[ChildPosition].Separator)
+                    Separator.AddUnique(FlatRandomVariableIndex);
+            Separator.Remove(EliminationOrder[Position]);
+            Separator.Sort(ByEliminationPosition);
+            Clique.Scope.Add(EliminationOrder[Position]);
+            Clique.Scope.Append(Separator);
+            Clique.Separator = MoveTemp(Separator);
+            Clique.ParentPosition = Clique.Separator.IsEmpty() ? INDEX_NONE : EliminationPositions[Clique.Separator[0]];
+            if (Clique.ParentPosition != INDEX_NONE) Cliques[Clique.ParentPosition].ChildPositions.Add(Position);
+        }
+        ScopeCliquePositions.Reset();
+        ScopeCliquePositions.SetNum(StateCounts.Num());
+        for (int32 Position = 0; Position < Cliques.Num(); ++Position)
+            for (int32 FlatRandomVariableIndex : Cliques[Position].Scope)
+                ScopeCliquePositions[FlatRandomVariableIndex].Add(Position);
+
+        for (FClique& Clique : Cliques)
+        {
+            Clique.ScopeStrides = GetStrides(Clique.Scope);
+            Clique.Table.SetNumUninitialized(Clique.ScopeStrides[0] * StateCounts[Clique.Scope[0]]);
+            Clique.Message.SetNumUninitialized(Clique.ScopeStrides[0]);
+        }
+        for (FClique& Clique : Cliques)
+        {
+            for (int32 HandleIndex : Clique.HandleIndices)
+            {
+                const TArray<int32>& NeighboringFlatRandomVariableIndices = FactorGraph->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices();
+                Clique.HandleStrides.Append(MapStrides(NeighboringFlatRandomVariableIndices, GetStrides(NeighboringFlatRandomVariableIndices), Clique.Scope));
+            }
+            for (int32 ChildPosition : Clique.ChildPositions)
+            {
+                const FClique& Child = Cliques[ChildPosition];
+                Clique.ChildStrides.Append(MapStrides(Child.Separator, GetStrides(Child.Separator), Clique.Scope));
+            }
+        }
+
+        HandleScoreTables.Reset();
+        HandleScoreTables.SetNum(FactorGraph->GetHandles().Num());
+        for (int32 HandleIndex = 0; HandleIndex < FactorGraph->GetHandles().Num(); ++HandleIndex)
+        {
+            int32 ScoreTableNum = 1;
+            for (int32 FlatRandomVariableIndex : FactorGraph->GetHandles()[HandleIndex]->GetNeighboringFlatRandomVariableIndices()) ScoreTableNum *= StateCounts[FlatRandomVariableIndex];
+            HandleScoreTables[HandleIndex].SetNumUninitialized(ScoreTableNum);
+        }
+        ParameterDependencies.Init(*FactorGraph, Context.IntParameters.Num(), Context.FloatParameters.Num());
+        InvalidateAll();
+    }
+
+    void InvalidateAll()
+    {
+        HandleScoreTablesValid.Init(false, FactorGraph->GetHandles().Num());
+        CliquesValid.Init(false, Cliques.Num());
+    }
+
+    // Call with the changes of the environment before the next run, ChangedFlatRandomVariableIndices are the random variables
+    // whose observation mask or observed value changed.
+    void Invalidate(const TArray<int32>& ChangedIntParameterIndices, const TArray<int32>& ChangedFloatParameterIndices, const TArray<int32>& ChangedFlatRandomVariableIndices)
+    {
+        ParameterDependencies.Invalidate(ChangedIntParameterIndices, ChangedFloatParameterIndices, HandleScoreTablesValid);
+        for (int32 HandleIndex = 0; HandleIndex < HandleScoreTablesValid.Num(); ++HandleIndex)
+            if (!HandleScoreTablesValid[HandleIndex] && HandleCliquePositions[HandleIndex] != INDEX_NONE)
+                CliquesValid[HandleCliquePositions[HandleIndex]] = false;
+        for (int32 FlatRandomVariableIndex : ChangedFlatRandomVariableIndices)
+            for (int32 Position : ScopeCliquePositions[FlatRandomVariableIndex])
+                CliquesValid[Position] = false;
+    }
+
+    // Sums of the clique table sizes along the elimination order, the work of one elimination pass.
+    static uint64 GetComplexity(const FConcordFactorGraph<FFloatType>& FactorGraph)
+    {
+        uint64 Complexity = 0;
+        EliminateMinFill(FactorGraph, [&](int32 FlatRandomVariableIndex, const TSet<int32>& Neighbors)
+        {
+            uint64 CliqueComplexity = FactorGraph.GetStateCount(FlatRandomVariableIndex);
+            for (int32 Neighbor : Neighbors)
+            {
+                const int32 StateCount = FactorGraph.GetStateCount(Neighbor);
+                CliqueComplexity = CliqueComplexity > MAX_uint64 / StateCount ? MAX_uint64 : CliqueComplexity * StateCount;
+            }
+            Complexity = Complexity > MAX_uint64 - CliqueComplexity ? MAX_uint64 : Complexity + CliqueComplexity;
+        });
+        return Complexity;
+    }
+
+    static TArray<int32> GetEliminationOrder(const FConcordFactorGraph<FFloatType>& FactorGraph)
+    {
+        TArray<int32> EliminationOrder;
+        EliminationOrder.Reserve(FactorGraph.GetRandomVariableCount());
+        EliminateMinFill(FactorGraph, [&](int32 FlatRandomVariableIndex, const TSet<int32>& Neighbors) { EliminationOrder.Add(FlatRandomVariableIndex); });
+        return EliminationOrder;
+    }
+
+    // Eliminates all random variables, then samples the unobserved ones backwards or sets them to their maximizing values.
+    // Returns the log partition function when sampling and the max score when maximizing.
+    FFloatType Run(bool bMaximizeScore, FConcordRandomStream& RandomStream)
+    {
+        const FFloatType Result = Eliminate(bMaximizeScore);
+        SampleBackwards(bMaximizeScore, RandomStream);
+        return Result;
+    }
+
+    // Recomputes the invalid cliques in elimination order, a recomputed clique invalidates the clique its message goes to.
+    FFloatType Eliminate(bool bMaximizeScore)
+    {
+        if (bMaximizeScore != bCliquesMaximizeScore)
+        {
+            CliquesValid.Init(false, Cliques.Num()); // the messages are summed or maxed out
+            bCliquesMaximizeScore = bMaximizeScore;
+        }
+        FFloatType Result = 0;
+        for (int32 Position = 0; Position < Cliques.Num(); ++Position)
+        {
+            FClique& Clique = Cliques[Position];
+            if (!CliquesValid[Position])
+            {
+                ComputeTable(Clique);
+                ComputeMessage(Clique, bMaximizeScore);
+                CliquesValid[Position] = true;
+                if (Clique.ParentPosition != INDEX_NONE) CliquesValid[Clique.ParentPosition] = false; // parents come later in the order
+            }
+            if (Clique.Separator.IsEmpty()) Result += Clique.Message[0];
+        }
+        return Result;
+    }
+
+    // Samples or decodes the variation from the clique tables of the last Eliminate(), which can be repeated for more samples.
+    void SampleBackwards(bool bMaximizeScore, FConcordRandomStream& RandomStream)
+    {
+        check(bMaximizeScore == bCliquesMaximizeScore);
+        TArray<FFloatType> Distribution;
+        for (int32 Position = Cliques.Num() - 1; Position >= 0; --Position)
+        {
+            const FClique& Clique = Cliques[Position];
+            const int32 FlatRandomVariableIndex = Clique.Scope[0];
+            if (Context.ObservationMask[FlatRandomVariableIndex]) continue;
+            int32 Offset = 0;
+            for (int32 ScopeIndex = 1; ScopeIndex < Clique.Scope.Num(); ++ScopeIndex)
+                Offset += Context.Variation[Clique.Scope[ScopeIndex]] * Clique.ScopeStrides[ScopeIndex];
+            const int32 Stride = Clique.ScopeStrides[0];
+            if (bMaximizeScore)
+            {
+                int32 MaxValue = 0;
+                for (int32 Value = 1; Value < StateCounts[FlatRandomVariableIndex]; ++Value)
+                    if (Clique.Table[Offset + Value * Stride] > Clique.Table[Offset + MaxValue * Stride])
+                        MaxValue = Value;
+                Context.Variation[FlatRandomVariableIndex] = MaxValue;
+            }
+            else
+            {
+                Distribution.SetNumUninitialized(StateCounts[FlatRandomVariableIndex]);
+                for (int32 Value = 0; Value < Distribution.Num(); ++Value)
+                    Distribution[Value] = Clique.Table[Offset + Value * Stride];
+                Concord::GetCumulativeDistributionFromLogValues(Distribution);
+                Context.Variation[FlatRandomVariableIndex] = Concord::SampleCumulativeDistribution(Distribution, RandomStream);
+            }
+        }
+    }
+private:
+    const FConcordFactorGraph<FFloatType>* FactorGraph;
+    FConcordExpressionContextMutable<FFloatType> Context;
+    TArray<int32> StateCounts;
+
+    struct FClique
+    {
+        TArray<int32> Scope; // the eliminated random variable, then the separator
+        TArray<int32> Separator; // by elimination position
+        TArray<int32> ScopeStrides; // row-major over Scope
+        TArray<int32> HandleIndices;
+        TArray<int32> HandleStrides; // per handle, per scope index, the stride in the score table of the handle
+        TArray<int32> ChildPositions; // cliques whose message is multiplied in here
+        TArray<int32> ChildStrides; // per child, per scope index, the stride in the message of the child
+        int32 ParentPosition; // the clique the message goes to, INDEX_NONE for roots
+        TArray<FFloatType> Table;
+        TArray<FFloatType> Message; // row-major over Separator, the table with the eliminated random variable summed or maxed out
+    };
+    TArray<FClique> Cliques; // by elimination position
+    TArray<bool> CliquesValid;
+    bool bCliquesMaximizeScore = false;
+    TArray<int32> HandleCliquePositions; // per handle, INDEX_NONE for handles without neighbors
+    TArray<TArray<int32>> ScopeCliquePositions; // per random variable, the cliques whose scope contains it
+    TArray<TArray<FFloatType>> HandleScoreTables;
+    TArray<bool> HandleScoreTablesValid;
+    FConcordHandleParameterDependencies ParameterDependencies;
+
+    TArray<int32> GetStrides(const TArray<int32>& FlatRandomVariableIndices) const
+    {
+        TArray<int32> Strides;
+        Strides.SetNumUninitialized(FlatRandomVariableIndices.Num());
+        int32 Stride = 1;
+        for (int32 Index = FlatRandomVariableIndices.Num() - 1; Index >= 0; --Index)
+        {
+            Strides[Index] = Stride;
+            Stride *= StateCounts[FlatRandomVariableIndices[Index]];
+        }
+        return Strides;
+    }
+
+    static TArray<int32> MapStrides(const TArray<int32>& FlatRandomVariableIndices, const TArray<int32>& Strides, const TArray<int32>& Scope)
+    {
+        TArray<int32> ScopeStrides;
+        ScopeStrides.Init(0, Scope.Num());
+        for (int32 Index = 0; Index < FlatRandomVariableIndices.Num(); ++Index)
+            ScopeStrides[Scope.IndexOfByKey(FlatRandomVariableIndices[Index])] = Strides[Index];
+        return ScopeStrides;
+    }
+
+    void ComputeTable(FClique& Clique)
+    {
+        const int32 ScopeNum = Clique.Scope.Num();
+        for (FFloatType& Score : Clique.Table) Score = 0;
+        for (int32 Index = 0; Index < Clique.HandleIndices.Num(); ++Index)
+        {
+            const int32 HandleIndex = Clique.HandleIndices[Index];
+            if (!HandleScoreTablesValid[HandleIndex])
+            {
+                FactorGraph->GetHandles()[HandleIndex]->ComputeScoreTable(Context, StateCounts, HandleScoreTables[HandleIndex]);
+                HandleScoreTablesValid[HandleIndex] = true;
+            }
+            AddToTable(Clique, HandleScoreTables[HandleIndex], Clique.HandleStrides.GetData() + Index * ScopeNum);
+        }
+        for (int32 ChildIndex = 0; ChildIndex < Clique.ChildPositions.Num(); ++ChildIndex)
+            AddToTable(Clique, Cliques[Clique.ChildPositions[ChildIndex]].Message, Clique.ChildStrides.GetData() + ChildIndex * ScopeNum);
+
+        // values contradicting observations are impossible
+        for (int32 ScopeIndex = 0; ScopeIndex < ScopeNum; ++ScopeIndex)
+        {
+            const int32 FlatRandomVariableIndex = Clique.Scope[ScopeIndex];
+            if (!Context.ObservationMask[FlatRandomVariableIndex]) continue;
+            const int32 Stride = Clique.ScopeStrides[ScopeIndex];
+            const int32 StateCount = StateCounts[FlatRandomVariableIndex];
+            for (int32 Index = 0; Index < Clique.Table.Num(); ++Index)
+                if (Index / Stride % StateCount != Context.Variation[FlatRandomVariableIndex])
+                    Clique.Table[Index] = -std::numeric_limits<FFloatType>::infinity();
+        }
+    }
+
+    // Adds Source, addressed by the given strides per scope index, to every entry of the clique table.
+    void AddToTable(FClique& Clique, const TArray<FFloatType>& Source, const int32* SourceStrides) const
+    {
+        const int32 ScopeNum = Clique.Scope.Num();
+        TArray<int32, TInlineAllocator<16>> Values;
+        Values.Init(0, ScopeNum);
+        int32 SourceIndex = 0;
+        for (int32 Index = 0; Index < Clique.Table.Num(); ++Index)
+        {
+            Clique.Table[Index] += Source[SourceIndex];
+            for (int32 ScopeIndex = ScopeNum - 1; ScopeIndex >= 0; --ScopeIndex)
+            {
+                SourceIndex += SourceStrides[ScopeIndex];
+                if (++Values[ScopeIndex] < StateCounts[Clique.Scope[ScopeIndex]]) break;
+                SourceIndex -= Values[ScopeIndex] * SourceStrides[ScopeIndex];
+                Values[ScopeIndex] = 0;
+            }
+        }
+    }
+
+    void ComputeMessage(FClique& Clique, bool bMaximizeScore) const
+    {
+        const int32 StateCount = StateCounts[Clique.Scope[0]];
+        const int32 Stride = Clique.ScopeStrides[0];
+        for (int32 SeparatorIndex = 0; SeparatorIndex < Stride; ++SeparatorIndex)
+        {
+            FFloatType Max = -std::numeric_limits<FFloatType>::infinity();
+            for (int32 Value = 0; Value < StateCount; ++Value) Max = FMath::Max(Max, Clique.Table[Value * Stride + SeparatorIndex]);
+            if (bMaximizeScore || Max == -std::numeric_limits<FFloatType>::infinity())
+            {
+                Clique.Message[SeparatorIndex] = Max;
+                continue;
+            }
+            FFloatType Sum = 0;
+            for (int32 Value = 0; Value < StateCount; ++Value) Sum += FMath::Exp(Clique.Table[Value * Stride + SeparatorIndex] - Max);
+            Clique.Message[SeparatorIndex] = Max + FMath::Loge(Sum);
+        }
+    }
+
+    // Greedily eliminates the random variable adding the fewest fill-in edges, ties broken by the smallest clique table.
+    template<typename FOnEliminate>
+    static void EliminateMinFill(const FConcordFactorGraph<FFloatType>& FactorGraph, FOnEliminate&& OnEliminate)
+    {
+        const int32 RandomVariableCount = FactorGraph.GetRandomVariableCount();
+        TArray<TSet<int32>> Neighbors;
+        Neighbors.SetNum(RandomVariableCount);
+        for (const auto& Handle : FactorGraph.GetHandles())
+            for (int32 FlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+                for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+                    if (NeighboringFlatRandomVariableIndex != FlatRandomVariableIndex)
+                        Neighbors[FlatRandomVariableIndex].Add(NeighboringFlatRandomVariableIndex);
+
+        const auto GetFill = [&](int32 FlatRandomVariableIndex)
+        {
+            int32 Fill = 0;
+            for (int32 A : Neighbors[FlatRandomVariableIndex])
+                for (int32 B : Neighbors[FlatRandomVariableIndex])
+                    if (A < B && !Neighbors[A].Contains(B)) ++Fill;
+            return Fill;
+        };
+        const auto GetWeight = [&](int32 FlatRandomVariableIndex)
+        {
+            double Weight = FactorGraph.GetStateCount(FlatRandomVariableIndex);
+            for (int32 Neighbor : Neighbors[FlatRandomVariableIndex]) Weight *= FactorGraph.GetStateCount(Neighbor);
+            return Weight;
+        };
+        TArray<int32> Fills;
+        Fills.SetNumUninitialized(RandomVariableCount);
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < RandomVariableCount; ++FlatRandomVariableIndex)
+            Fills[FlatRandomVariableIndex] = GetFill(FlatRandomVariableIndex);
+        TBitArray<> Eliminated(false, RandomVariableCount);
+
+        for (int32 Step = 0; Step < RandomVariableCount; ++Step)
+        {
+            int32 Best = INDEX_NONE;
+            double BestWeight = 0;
+            for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < RandomVariableCount; ++FlatRandomVariableIndex)
+            {
+                if (Eliminated[FlatRandomVariableIndex]) continue;
+                if (Best != INDEX_NONE && Fills[FlatRandomVariableIndex] > Fills[Best]) continue;
+                const double Weight = GetWeight(FlatRandomVariableIndex);
+                if (Best == INDEX_NONE || Fills[FlatRandomVariableIndex] < Fills[Best] || Weight < BestWeight)
+                {
+                    Best = FlatRandomVariableIndex;
+                    BestWeight = Weight;
+                }
+            }
+
+            OnEliminate(Best, Neighbors[Best]);
+            Eliminated[Best] = true;
+            const TSet<int32> BestNeighbors = MoveTemp(Neighbors[Best]);
+            Neighbors[Best].Reset();
+            TSet<int32> Affected;
+            for (int32 A : BestNeighbors)
+            {
+                Neighbors[A].Remove(Best);
+                for (int32 B : BestNeighbors)
+                    if (A != B) Neighbors[A].Add(B);
+            }
+            for (int32 A : BestNeighbors)
+            {
+                Affected.Add(A);
+                for (int32 B : Neighbors[A]) Affected.Add(B);
+            }
+            for (int32 FlatRandomVariableIndex : Affected) Fills[FlatRandomVariableIndex] = GetFill(FlatRandomVariableIndex);
+        }
+    }
+};
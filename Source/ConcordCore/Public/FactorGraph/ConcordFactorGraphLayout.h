@@ -0,0 +1,120 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordFactorGraph.h"
+
+// Index-addressed layout of the message arrays of the sum-product and max-sum engines, built once by Init().
+// Slots number the handles neighboring a random variable in the order of FConcordFactorGraph::GetNeighboringHandles().
+struct FConcordFactorGraphLayout
+{
+    TArray<int32> StateCounts;
+    TArray<int32> NeighboringHandleOffsets; // per random variable + 1, into NeighboringHandleIndices
+    TArray<int32> NeighboringHandleIndices;
+    TArray<int32> VariableMessageOffsets; // per random variable + 1, factors are stored value-major
+    TArray<int32> FactorMessageOffsets; // per handle + 1, also used for the potential tables
+    TArray<int32> NeighborOffsets; // per handle + 1, into NeighborSlots and NeighborStrides
+    TArray<int32> NeighborSlots; // slot of the handle at the neighboring random variable
+    TArray<int32> NeighborStrides; // stride of the neighboring random variable in the factor messages of the handle
+
+    int32 GetNeighboringHandleCount(int32 FlatRandomVariableIndex) const { return NeighboringHandleOffsets[FlatRandomVariableIndex + 1] - NeighboringHandleOffsets[FlatRandomVariableIndex]; }
+    TArrayView<const int32> GetNeighboringHandleIndices(int32 FlatRandomVariableIndex) const { return MakeArrayView(NeighboringHandleIndices.GetData() + NeighboringHandleOffsets[FlatRandomVariableIndex], GetNeighboringHandleCount(FlatRandomVariableIndex)); }
+    int32 GetVariableMessageIndex(int32 FlatRandomVariableIndex, int32 Value) const { return VariableMessageOffsets[FlatRandomVariableIndex] + Value * GetNeighboringHandleCount(FlatRandomVariableIndex); }
+    int32 GetFactorMessageNum(int32 HandleIndex) const { return FactorMessageOffsets[HandleIndex + 1] - FactorMessageOffsets[HandleIndex]; }
+    int32 GetNeighborSlot(int32 HandleIndex, int32 NeighborIndex) const { return NeighborSlots[NeighborOffsets[HandleIndex] + NeighborIndex]; }
+    int32 GetNeighborStride(int32 HandleIndex, int32 NeighborIndex) const { return NeighborStrides[NeighborOffsets[HandleIndex] + NeighborIndex]; }
+
+    template<typename FFloatType>
+    void Init(const FConcordFactorGraph<FFloatType>& FactorGraph)
+    {
+        const auto& Handles = FactorGraph.GetHandles();
+        TMap<const FConcordFactorHandleBase<FFloatType>*, int32> HandleIndices;
+        HandleIndices.Reserve(Handles.Num());
+        for (int32 HandleIndex = 0; HandleIndex < Handles.Num(); ++HandleIndex)
+            HandleIndices.Add(Handles[HandleIndex].Get(), HandleIndex);
+
+        const int32 RandomVariableCount = FactorGraph.GetRandomVariableCount();
+        StateCounts.Reset(RandomVariableCount);
+        NeighboringHandleOffsets.Reset(RandomVariableCount + 1);
+        NeighboringHandleIndices.Reset();
+        VariableMessageOffsets.Reset(RandomVariableCount + 1);
+        NeighboringHandleOffsets.Add(0);
+        VariableMessageOffsets.Add(0);
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < RandomVariableCount; ++FlatRandomVariableIndex)
+        {
+            const auto& NeighboringHandles = FactorGraph.GetNeighboringHandles(FlatRandomVariableIndex);
+            const int32 StateCount = FactorGraph.GetStateCount(FlatRandomVariableIndex);
+            StateCounts.Add(StateCount);
+            for (const auto* NeighboringHandle : NeighboringHandles)
+                NeighboringHandleIndices.Add(HandleIndices[NeighboringHandle]);
+            NeighboringHandleOffsets.Add(NeighboringHandleIndices.Num());
+            VariableMessageOffsets.Add(VariableMessageOffsets.Last() + StateCount * NeighboringHandles.Num());
+        }
+
+        FactorMessageOffsets.Reset(Handles.Num() + 1);
+        NeighborOffsets.Reset(Handles.Num() + 1);
+        NeighborSlots.Reset();
+        NeighborStrides.Reset();
+        FactorMessageOffsets.Add(0);
+        NeighborOffsets.Add(0);
+        for (const auto& Handle : Handles)
+        {
+            int32 NumValues = 1;
+            for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+                NumValues *= FactorGraph.GetStateCount(NeighboringFlatRandomVariableIndex);
+            int32 Stride = NumValues;
+            for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+            {
+                Stride /= FactorGraph.GetStateCount(NeighboringFlatRandomVariableIndex);
+                NeighborStrides.Add(Stride);
+                NeighborSlots.Add(FactorGraph.GetNeighboringHandles(NeighboringFlatRandomVariableIndex).IndexOfByKey(Handle.Get()));
+            }
+            FactorMessageOffsets.Add(FactorMessageOffsets.Last() + NumValues);
+            NeighborOffsets.Add(NeighborSlots.Num());
+        }
+    }
+};
+
+// Per parameter, the handles whose scores read it, so cached score tables are only recomputed for the handles affected by a change.
+struct FConcordHandleParameterDependencies
+{
+    TArray<TArray<int32>> IntParameterDependentHandleIndices;
+    TArray<TArray<int32>> FloatParameterDependentHandleIndices;
+    TArray<int32> UnknownDependencyHandleIndices;
+
+    template<typename FFloatType>
+    void Init(const FConcordFactorGraph<FFloatType>& FactorGraph, int32 IntParameterCount, int32 FloatParameterCount)
+    {
+        IntParameterDependentHandleIndices.Reset();
+        IntParameterDependentHandleIndices.SetNum(IntParameterCount);
+        FloatParameterDependentHandleIndices.Reset();
+        FloatParameterDependentHandleIndices.SetNum(FloatParameterCount);
+        UnknownDependencyHandleIndices.Reset();
+        TArray<int32> IntParameterIndices, FloatParameterIndices;
+        for (int32 HandleIndex = 0; HandleIndex < FactorGraph.GetHandles().Num(); ++HandleIndex)
+        {
+            IntParameterIndices.Reset();
+            FloatParameterIndices.Reset();
+            if (!FactorGraph.GetHandles()[HandleIndex]->AddParameterDependencies(IntParameterIndices, FloatParameterIndices))
+            {
+                UnknownDependencyHandleIndices.Add(HandleIndex);
+                continue;
+            }
+            for (int32 IntParameterIndex : IntParameterIndices) IntParameterDependentHandleIndices[IntParameterIndex].Add(HandleIndex);
+            for (int32 FloatParameterIndex : FloatParameterIndices) FloatParameterDependentHandleIndices[FloatParameterIndex].Add(HandleIndex);
+        }
+    }
+
+    void Invalidate(const TArray<int32>& ChangedIntParameterIndices, const TArray<int32>& ChangedFloatParameterIndices, TArray<bool>& InOutValidFlags) const
+    {
+        if (ChangedIntParameterIndices.IsEmpty() && ChangedFloatParameterIndices.IsEmpty()) return;
+        for (int32 HandleIndex : UnknownDependencyHandleIndices) InOutValidFlags[HandleIndex] = false;
+        for (int32 IntParameterIndex : ChangedIntParameterIndices)
+            for (int32 HandleIndex : IntParameterDependentHandleIndices[IntParameterIndex])
+                InOutValidFlags[HandleIndex] = false;
+        for (int32 FloatParameterIndex : ChangedFloatParameterIndices)
+            for (int32 HandleIndex : FloatParameterDependentHandleIndices[FloatParameterIndex])
+                InOutValidFlags[HandleIndex] = false;
+    }
+};
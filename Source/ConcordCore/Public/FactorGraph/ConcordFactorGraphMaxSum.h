@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "ConcordFactorGraph.h"
+#include "ConcordFactorGraphLayout.h"
 #include "Async/TaskGraphInterfaces.h"
 
 template<typename FFloatType>
@@ -17,9 +18,33 @@ public:
 
     void Init()
     {
-        Messages.SetNum(FactorGraph->GetRandomVariableCount());
+        Layout.Init(*FactorGraph);
+        ScoreOffsets.Reset(FactorGraph->GetRandomVariableCount() + 1);
+        ScoreOffsets.Add(0);
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+            ScoreOffsets.Add(ScoreOffsets.Last() + Layout.StateCounts[FlatRandomVariableIndex]);
+        Scores.SetNumUninitialized(ScoreOffsets.Last());
+        BackpointerOffsets.Init(0, FactorGraph->GetHandles().Num());
+        TargetFlatRandomVariableIndices.Init(INDEX_NONE, FactorGraph->GetHandles().Num());
+        VariableLists.K = HandleLists.K = 0;
+        int32 BackpointerCount = 0;
         for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
-            InitMessage(RootFlatRandomVariableIndex, nullptr);
+            InitBackpointerOffsets(RootFlatRandomVariableIndex, INDEX_NONE, BackpointerCount);
+        Backpointers.SetNumUninitialized(BackpointerCount);
+        ScoreTables.SetNumUninitialized(Layout.FactorMessageOffsets.Last());
+        ScoreTablesValid.Init(false, FactorGraph->GetHandles().Num());
+        ParameterDependencies.Init(*FactorGraph, Context.IntParameters.Num(), Context.FloatParameters.Num());
+    }
+
+    // Score tables are cached across runs, call these whenever parameters of the context changed.
+    void InvalidateScoreTables()
+    {
+        for (bool& bValid : ScoreTablesValid) bValid = false;
+    }
+
+    void InvalidateScoreTables(const TArray<int32>& ChangedIntParameterIndices, const TArray<int32>& ChangedFloatParameterIndices)
+    {
+        ParameterDependencies.Invalidate(ChangedIntParameterIndices, ChangedFloatParameterIndices, ScoreTablesValid);
     }
 
     FFloatType Run()
@@ -28,110 +53,493 @@ public:
 
         FGraphEventArray OutstandingEvents;
         for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
-            OutstandingEvents.Add(RunInward(RootFlatRandomVariableIndex, nullptr));
+            OutstandingEvents.Add(RunInward(RootFlatRandomVariableIndex, INDEX_NONE));
         FTaskGraphInterface::Get().WaitUntilTasksComplete(OutstandingEvents);
 
         FFloatType Score = 0;
         for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
         {
-            auto& Message = Messages[RootFlatRandomVariableIndex];
+            const FFloatType* RootScores = GetScores(RootFlatRandomVariableIndex);
             if (Context.ObservationMask[RootFlatRandomVariableIndex])
             {
-                Score += Message[Context.Variation[RootFlatRandomVariableIndex]].Score;
-                RunOutward(RootFlatRandomVariableIndex, nullptr, Message[Context.Variation[RootFlatRandomVariableIndex]].NeighboringFactorOutwardValues);
+                Score += RootScores[Context.Variation[RootFlatRandomVariableIndex]];
             }
             else
             {
-                TOptional<FFloatType> MaxRootScore;
                 int32 RootValueWithMaxScore = 0;
-                for (int32 RootValue = 0; RootValue < Message.Num(); ++RootValue)
-                    if (!MaxRootScore || Message[RootValue].Score > MaxRootScore.GetValue())
-                    {
-                        MaxRootScore = Message[RootValue].Score;
+                for (int32 RootValue = 1; RootValue < Layout.StateCounts[RootFlatRandomVariableIndex]; ++RootValue)
+                    if (RootScores[RootValue] > RootScores[RootValueWithMaxScore])
                         RootValueWithMaxScore = RootValue;
-                    }
                 Context.Variation[RootFlatRandomVariableIndex] = RootValueWithMaxScore;
-                Score += MaxRootScore.GetValue();
-                RunOutward(RootFlatRandomVariableIndex, nullptr, Message[RootValueWithMaxScore].NeighboringFactorOutwardValues);
+                Score += RootScores[RootValueWithMaxScore];
             }
+            RunOutward(RootFlatRandomVariableIndex, INDEX_NONE);
         }
         return Score;
     }
+
+    // Finds the up to K best variations in one inward pass that keeps K-best lists per message element,
+    // the variations are only decoded from the lists afterwards. Runs on the calling thread.
+    void RunKBest(int32 K, TArray<FConcordVariation>& OutVariations, TArray<FFloatType>& OutScores)
+    {
+        OutVariations.Reset();
+        OutScores.Reset();
+        if (K < 1) return;
+        InitKBest(K);
+        for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
+            RunKBestInward(RootFlatRandomVariableIndex, INDEX_NONE);
+
+        // fold the roots of the disjoint subgraphs, each pick is a root value and the rank of its list entry
+        const TArray<int32>& RootFlatRandomVariableIndices = FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices();
+        FKBestCandidates Candidates, RootCandidates, NextCandidates;
+        TArray<int32> Picks;
+        Picks.SetNumZeroed(2 * RootFlatRandomVariableIndices.Num());
+        Candidates.Reset(Picks.Num());
+        Candidates.Insert(K, 0, Picks.GetData());
+        for (int32 RootIndex = 0; RootIndex < RootFlatRandomVariableIndices.Num(); ++RootIndex)
+        {
+            const int32 RootFlatRandomVariableIndex = RootFlatRandomVariableIndices[RootIndex];
+            RootCandidates.Reset(2);
+            for (int32 RootValue = 0; RootValue < Layout.StateCounts[RootFlatRandomVariableIndex]; ++RootValue)
+                for (int32 Rank = 0; Rank < VariableLists.GetCount(RootFlatRandomVariableIndex, RootValue); ++Rank)
+                {
+                    const int32 RootPicks[] = { RootValue, Rank };
+                    if (!RootCandidates.Insert(K, VariableLists.GetScore(RootFlatRandomVariableIndex, RootValue, Rank), RootPicks)) break;
+                }
+            NextCandidates.Reset(Candidates.Width);
+            for (int32 Index = 0; Index < Candidates.Num(); ++Index)
+                for (int32 RootRank = 0; RootRank < RootCandidates.Num(); ++RootRank)
+                {
+                    FMemory::Memcpy(Picks.GetData(), Candidates.GetData(Index), Picks.Num() * sizeof(int32));
+                    Picks[2 * RootIndex] = RootCandidates.GetData(RootRank)[0];
+                    Picks[2 * RootIndex + 1] = RootCandidates.GetData(RootRank)[1];
+                    if (!NextCandidates.Insert(K, Candidates.Scores[Index] + RootCandidates.Scores[RootRank], Picks.GetData())) break;
+                }
+            Swap(Candidates, NextCandidates);
+        }
+
+        for (int32 Index = 0; Index < Candidates.Num(); ++Index)
+        {
+            for (int32 RootIndex = 0; RootIndex < RootFlatRandomVariableIndices.Num(); ++RootIndex)
+                DecodeKBest(RootFlatRandomVariableIndices[RootIndex], INDEX_NONE, Candidates.GetData(Index)[2 * RootIndex], Candidates.GetData(Index)[2 * RootIndex + 1]);
+            OutVariations.Add(Context.Variation);
+            OutScores.Add(Candidates.Scores[Index]);
+        }
+    }
 private:
     const FConcordFactorGraph<FFloatType>* FactorGraph;
     FConcordExpressionContextMutable<FFloatType> Context;
-    TArray<typename FConcordFactorHandleBase<FFloatType>::FMaxSumVariableMessage> Messages;
+    FConcordFactorGraphLayout Layout;
+    TArray<int32> ScoreOffsets; // per random variable + 1
+    TArray<FFloatType> Scores; // per random variable value, the summed max-sum messages of the child handles
+    TArray<int32> BackpointerOffsets; // per handle, indexed by the value of the random variable it sends its message to
+    TArray<int32> Backpointers; // index into the score table of the handle of the best neighbor values
+    TArray<int32> TargetFlatRandomVariableIndices; // per handle, the random variable it sends its message to
+    TArray<FFloatType> ScoreTables; // per handle at the factor message offsets of the layout, over all values of the neighbors
+    TArray<bool> ScoreTablesValid; // not a bit array, tables are updated concurrently by the inward tasks
+    FConcordHandleParameterDependencies ParameterDependencies;
     friend class FMaxSumTask;
 
-    void InitMessage(int32 FlatRandomVariableIndex, const FConcordFactorHandleBase<FFloatType>* ParentHandle)
+    using FScoreTable = TArray<FFloatType, TInlineAllocator<256>>;
+    using FNeighborValues = TArray<int32, TInlineAllocator<8>>;
+
+    // Candidates with a score and Width ints each, telling which entries of other lists they combine.
+    struct FKBestCandidates
+    {
+        int32 Width = 0;
+        TArray<FFloatType> Scores;
+        TArray<int32> Data;
+
+        int32 Num() const { return Scores.Num(); }
+        void Reset(int32 InWidth) { Width = InWidth; Scores.Reset(); Data.Reset(); }
+        const int32* GetData(int32 Index) const { return Data.GetData() + Index * Width; }
+        // Keeps at most K candidates sorted by descending score, equal scores stay in insertion order.
+        // Returns false if the candidate did not make it, later candidates of a descending sequence will not either.
+        bool Insert(int32 K, FFloatType Score, const int32* InData)
+        {
+            int32 Index = Scores.Num();
+            while (Index > 0 && Scores[Index - 1] < Score) --Index;
+            if (Index >= K) return false;
+            if (Scores.Num() == K)
+            {
+                Scores.Pop(false);
+                Data.SetNum(Data.Num() - Width, false);
+            }
+            Scores.Insert(Score, Index);
+            Data.InsertUninitialized(Index * Width, Width);
+            FMemory::Memcpy(Data.GetData() + Index * Width, InData, Width * sizeof(int32));
+            return true;
+        }
+    };
+
+    // Visits the best sums of one entry from each of several lists sorted by descending score, best first. Only the frontier of
+    // rank tuples is kept in a heap, a tuple is reached from the one with the rank of its last raised list lowered, so exactly once.
+    struct FKBestMerger
+    {
+        TArray<const FFloatType*> ListScores;
+        TArray<int32> ListCounts;
+        TArray<FFloatType> NodeScores;
+        TArray<int32> NodeRanks; // per node, one rank per list
+        TArray<int32> NodeLastLists; // per node, the last list whose rank was raised
+        TArray<int32> Heap;
+
+        void Reset() { ListScores.Reset(); ListCounts.Reset(); }
+        void AddList(const FFloatType* Scores, int32 Count) { ListScores.Add(Scores); ListCounts.Add(Count); }
+
+        // Visit(Score, Ranks) returns false to stop early, at most K sums are visited.
+        template<typename FVisit>
+        void Merge(FFloatType BaseScore, int32 K, FVisit&& Visit)
+        {
+            const int32 ListNum = ListScores.Num();
+            FFloatType Score = BaseScore;
+            for (int32 List = 0; List < ListNum; ++List)
+            {
+                if (ListCounts[List] == 0) return;
+                Score += ListScores[List][0];
+            }
+            NodeScores.Reset();
+            NodeRanks.Reset();
+            NodeLastLists.Reset();
+            Heap.Reset();
+            auto IsBetter = [this](int32 A, int32 B) { return NodeScores[A] > NodeScores[B] || (NodeScores[A] == NodeScores[B] && A < B); };
+            NodeScores.Add(Score);
+            NodeRanks.AddZeroed(ListNum);
+            NodeLastLists.Add(0);
+            Heap.HeapPush(0, IsBetter);
+            for (int32 Visited = 0; Visited < K && Heap.Num() > 0; ++Visited)
+            {
+                int32 Node;
+                Heap.HeapPop(Node, IsBetter, false);
+                if (!Visit(NodeScores[Node], NodeRanks.GetData() + Node * ListNum)) return;
+                for (int32 List = NodeLastLists[Node]; List < ListNum; ++List)
+                {
+                    const int32 Rank = NodeRanks[Node * ListNum + List];
+                    if (Rank + 1 >= ListCounts[List]) continue;
+                    const int32 Next = NodeScores.Add(NodeScores[Node] + (ListScores[List][Rank + 1] - ListScores[List][Rank]));
+                    NodeRanks.AddUninitialized(ListNum);
+                    FMemory::Memcpy(NodeRanks.GetData() + Next * ListNum, NodeRanks.GetData() + Node * ListNum, ListNum * sizeof(int32));
+                    ++NodeRanks[Next * ListNum + List];
+                    NodeLastLists.Add(List);
+                    Heap.HeapPush(Next, IsBetter);
+                }
+            }
+        }
+    };
+
+    // Flat K-best lists per owner (random variable or handle) and value, entries store Width ints of provenance each.
+    struct FKBestLists
     {
-        const auto& NeighboringHandles = FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex);
-        Messages[FlatRandomVariableIndex].SetNum(FactorGraph->GetStateCount(FlatRandomVariableIndex));
-        for (auto& MessageElement : Messages[FlatRandomVariableIndex])
+        int32 K = 0;
+        TArray<int32> ListOffsets; // per owner, the list of value 0
+        TArray<int32> Widths; // per owner
+        TArray<int32> DataOffsets; // per owner, into Data
+        TArray<FFloatType> Scores; // K per list
+        TArray<int32> Counts; // per list
+        TArray<int32> Data;
+
+        void Init(int32 InK, const TArray<int32>& InListOffsets, const TArray<int32>& ListCounts, TArray<int32>&& InWidths)
+        {
+            K = InK;
+            ListOffsets = InListOffsets;
+            Widths = MoveTemp(InWidths);
+            DataOffsets.Reset(Widths.Num());
+            int32 DataCount = 0, ListCount = 0;
+            for (int32 Owner = 0; Owner < Widths.Num(); ++Owner)
+            {
+                DataOffsets.Add(DataCount);
+                DataCount += ListCounts[Owner] * K * Widths[Owner];
+                ListCount += ListCounts[Owner];
+            }
+            Scores.SetNumUninitialized(ListCount * K);
+            Counts.Init(0, ListCount);
+            Data.SetNumUninitialized(DataCount);
+        }
+        int32 GetCount(int32 Owner, int32 Value) const { return Counts[ListOffsets[Owner] + Value]; }
+        FFloatType GetScore(int32 Owner, int32 Value, int32 Rank) const { return Scores[(ListOffsets[Owner] + Value) * K + Rank]; }
+        const FFloatType* GetScores(int32 Owner, int32 Value) const { return Scores.GetData() + (ListOffsets[Owner] + Value) * K; }
+        const int32* GetData(int32 Owner, int32 Value, int32 Rank) const { return Data.GetData() + DataOffsets[Owner] + (Value * K + Rank) * Widths[Owner]; }
+        void Set(int32 Owner, int32 Value, const FKBestCandidates& Candidates)
         {
-            MessageElement.Score = 0;
-            MessageElement.NeighboringFactorOutwardValues.Reserve(NeighboringHandles.Num() - 1);
-            for (const auto* NeighboringHandle : NeighboringHandles)
-                if (NeighboringHandle != ParentHandle)
-                    MessageElement.NeighboringFactorOutwardValues.FindOrAdd(NeighboringHandle).SetNumUninitialized(NeighboringHandle->GetNeighboringFlatRandomVariableIndices().Num() - 1);
+            const int32 List = ListOffsets[Owner] + Value;
+            Counts[List] = FMath::Min(K, Candidates.Num());
+            for (int32 Rank = 0; Rank < Counts[List]; ++Rank) Scores[List * K + Rank] = Candidates.Scores[Rank];
+            FMemory::Memcpy(Data.GetData() + DataOffsets[Owner] + Value * K * Widths[Owner], Candidates.Data.GetData(), Counts[List] * Widths[Owner] * sizeof(int32));
         }
-        for (const auto* NeighboringHandle : NeighboringHandles)
-            if (NeighboringHandle != ParentHandle)
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
-                    if (NeighboringFlatRandomVariableIndex != FlatRandomVariableIndex)
-                        InitMessage(NeighboringFlatRandomVariableIndex, NeighboringHandle);
+    };
+
+    FKBestLists VariableLists; // per slot of the child handles, the rank in the handle list
+    FKBestLists HandleLists; // per neighbor, the rank in the neighbor list, the table index at the target neighbor
+
+    void InitKBest(int32 K)
+    {
+        if (VariableLists.K == K) return;
+        TArray<int32> Widths;
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+            Widths.Add(Layout.GetNeighboringHandleCount(FlatRandomVariableIndex));
+        VariableLists.Init(K, ScoreOffsets, Layout.StateCounts, MoveTemp(Widths));
+        Widths.Reset();
+        TArray<int32> ListCounts;
+        for (int32 HandleIndex = 0; HandleIndex < FactorGraph->GetHandles().Num(); ++HandleIndex)
+        {
+            Widths.Add(GetHandle(HandleIndex)->GetNeighboringFlatRandomVariableIndices().Num());
+            // handles without random variables are never reached from a root and get no lists
+            const int32 TargetFlatRandomVariableIndex = TargetFlatRandomVariableIndices[HandleIndex];
+            ListCounts.Add(TargetFlatRandomVariableIndex != INDEX_NONE ? Layout.StateCounts[TargetFlatRandomVariableIndex] : 0);
+        }
+        HandleLists.Init(K, BackpointerOffsets, ListCounts, MoveTemp(Widths));
     }
 
+    void InitBackpointerOffsets(int32 FromIndex, int32 ToHandleIndex, int32& BackpointerCount)
+    {
+        for (int32 NeighboringHandleIndex : Layout.GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+            {
+                BackpointerOffsets[NeighboringHandleIndex] = BackpointerCount;
+                TargetFlatRandomVariableIndices[NeighboringHandleIndex] = FromIndex;
+                BackpointerCount += Layout.StateCounts[FromIndex];
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
+                    if (NeighboringFlatRandomVariableIndex != FromIndex)
+                        InitBackpointerOffsets(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex, BackpointerCount);
+            }
+    }
+
+    const FConcordFactorHandleBase<FFloatType>* GetHandle(int32 HandleIndex) const { return FactorGraph->GetHandles()[HandleIndex].Get(); }
+    FFloatType* GetScores(int32 FlatRandomVariableIndex) { return Scores.GetData() + ScoreOffsets[FlatRandomVariableIndex]; }
+    const FFloatType* GetScores(int32 FlatRandomVariableIndex) const { return Scores.GetData() + ScoreOffsets[FlatRandomVariableIndex]; }
+
     void Reset()
     {
-        for (auto& Message : Messages) for (auto& Element : Message) Element.Score = 0;
+        for (FFloatType& Score : Scores) Score = 0;
+    }
+
+    // The table does not depend on observations, observed neighbors only select a slice of it when messages are sent.
+    // Computing it writes the variation of the neighbors of the handle, which all lie in the subtree of the task sending its message.
+    const FFloatType* GetScoreTable(int32 HandleIndex)
+    {
+        FFloatType* ScoreTable = ScoreTables.GetData() + Layout.FactorMessageOffsets[HandleIndex];
+        if (!ScoreTablesValid[HandleIndex])
+        {
+            GetHandle(HandleIndex)->ComputeScoreTable(Context, Layout.StateCounts, MakeArrayView(ScoreTable, Layout.GetFactorMessageNum(HandleIndex)));
+            ScoreTablesValid[HandleIndex] = true;
+        }
+        return ScoreTable;
+    }
+
+    void SendMaxSumMessage(int32 FromHandleIndex, int32 TargetFlatRandomVariableIndex)
+    {
+        const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(FromHandleIndex)->GetNeighboringFlatRandomVariableIndices();
+        const int32 TargetNeighborIndex = NeighboringFlatRandomVariableIndices.IndexOfByKey(TargetFlatRandomVariableIndex);
+        const FFloatType* ScoreTable = GetScoreTable(FromHandleIndex);
+
+        const int32 StateCount = Layout.StateCounts[TargetFlatRandomVariableIndex];
+        FScoreTable MaxScores;
+        MaxScores.SetNumUninitialized(StateCount);
+        int32* TargetBackpointers = Backpointers.GetData() + BackpointerOffsets[FromHandleIndex];
+        for (int32 Value = 0; Value < StateCount; ++Value) TargetBackpointers[Value] = INDEX_NONE;
+        FNeighborValues Values;
+        Values.SetNumUninitialized(NeighboringFlatRandomVariableIndices.Num());
+        SendMaxSumMessageImpl(FromHandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, MaxScores, TargetBackpointers, Values, 0, 0);
+
+        FFloatType* TargetScores = GetScores(TargetFlatRandomVariableIndex);
+        for (int32 Value = 0; Value < StateCount; ++Value)
+            if (TargetBackpointers[Value] != INDEX_NONE)
+                TargetScores[Value] += MaxScores[Value];
+    }
+
+    void SendMaxSumMessageImpl(int32 HandleIndex, const TArray<int32>& NeighboringFlatRandomVariableIndices, int32 TargetNeighborIndex, const FFloatType* ScoreTable,
+                               FScoreTable& MaxScores, int32* TargetBackpointers, FNeighborValues& Values, int32 ScoreIndex, int32 NeighborIndex) const
+    {
+        if (NeighborIndex == NeighboringFlatRandomVariableIndices.Num())
+        {
+            FFloatType Score = ScoreTable[ScoreIndex];
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                if (Index != TargetNeighborIndex)
+                    Score += GetScores(NeighboringFlatRandomVariableIndices[Index])[Values[Index]];
+            const int32 TargetValue = Values[TargetNeighborIndex];
+            if (TargetBackpointers[TargetValue] == INDEX_NONE || MaxScores[TargetValue] < Score)
+            {
+                MaxScores[TargetValue] = Score;
+                TargetBackpointers[TargetValue] = ScoreIndex;
+            }
+            return;
+        }
+
+        const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighborIndex];
+        const int32 Stride = Layout.GetNeighborStride(HandleIndex, NeighborIndex);
+        int32& Value = Values[NeighborIndex];
+        if (Context.ObservationMask[FlatRandomVariableIndex])
+        {
+            Value = Context.Variation[FlatRandomVariableIndex];
+            SendMaxSumMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, MaxScores, TargetBackpointers, Values, ScoreIndex + Value * Stride, NeighborIndex + 1);
+        }
+        else for (Value = 0; Value < Layout.StateCounts[FlatRandomVariableIndex]; ++Value)
+        {
+            SendMaxSumMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, MaxScores, TargetBackpointers, Values, ScoreIndex, NeighborIndex + 1);
+            ScoreIndex += Stride;
+        }
     }
 
     class FMaxSumTask
     {
         const int32 FromIndex;
-        const FConcordFactorHandleBase<FFloatType>* const ToHandle;
+        const int32 ToHandleIndex;
         FConcordFactorGraphMaxSum<FFloatType>* const MaxSum;
     public:
-        FMaxSumTask(int32 InFromIndex, const FConcordFactorHandleBase<FFloatType>* InToHandle, FConcordFactorGraphMaxSum<FFloatType>* InMaxSum)
-            : FromIndex(InFromIndex), ToHandle(InToHandle), MaxSum(InMaxSum)
+        FMaxSumTask(int32 InFromIndex, int32 InToHandleIndex, FConcordFactorGraphMaxSum<FFloatType>* InMaxSum)
+            : FromIndex(InFromIndex), ToHandleIndex(InToHandleIndex), MaxSum(InMaxSum)
         {}
         FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FConcordExactSamplerMaxSumTask, STATGROUP_TaskGraphTasks); }
         static ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyThread; }
         static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
         void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
         {
-            for (const auto* NeighboringHandle : MaxSum->FactorGraph->GetNeighboringHandles(FromIndex))
-                if (NeighboringHandle != ToHandle)
-                    NeighboringHandle->AddMaxSumMessage(MaxSum->Context, MaxSum->Messages, FromIndex);
+            for (int32 NeighboringHandleIndex : MaxSum->Layout.GetNeighboringHandleIndices(FromIndex))
+                if (NeighboringHandleIndex != ToHandleIndex)
+                    MaxSum->SendMaxSumMessage(NeighboringHandleIndex, FromIndex);
         }
     };
 
-    FGraphEventRef RunInward(int32 FromIndex, const FConcordFactorHandleBase<FFloatType>* ToHandle)
+    FGraphEventRef RunInward(int32 FromIndex, int32 ToHandleIndex)
     {
         FGraphEventArray OutstandingEvents;
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ToHandle)
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
+        for (int32 NeighboringHandleIndex : Layout.GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
                     if (NeighboringFlatRandomVariableIndex != FromIndex)
-                        OutstandingEvents.Add(RunInward(NeighboringFlatRandomVariableIndex, NeighboringHandle));
-        return TGraphTask<FMaxSumTask>::CreateTask(&OutstandingEvents).ConstructAndDispatchWhenReady(FromIndex, ToHandle, this);
+                        OutstandingEvents.Add(RunInward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex));
+        return TGraphTask<FMaxSumTask>::CreateTask(&OutstandingEvents).ConstructAndDispatchWhenReady(FromIndex, ToHandleIndex, this);
     }
 
-    void RunOutward(int32 FromIndex, const FConcordFactorHandleBase<FFloatType>* ParentHandle, const TMap<const FConcordFactorHandleBase<FFloatType>*, TArray<int32>>& NeighboringFactorOutwardValues)
+    void RunKBestInward(int32 FromIndex, int32 ToHandleIndex)
     {
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ParentHandle)
+        for (int32 NeighboringHandleIndex : Layout.GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
             {
-                int32 OutwardIndex = 0;
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
                     if (NeighboringFlatRandomVariableIndex != FromIndex)
-                    {
-                        const int32 Value = NeighboringFactorOutwardValues[NeighboringHandle][OutwardIndex++];
-                        Context.Variation[NeighboringFlatRandomVariableIndex] = Value;
-                        const auto& Message = Messages[NeighboringFlatRandomVariableIndex];
-                        RunOutward(NeighboringFlatRandomVariableIndex, NeighboringHandle, Message[Value].NeighboringFactorOutwardValues);
-                    }
+                        RunKBestInward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex);
+                SendKBestMessage(NeighboringHandleIndex, FromIndex);
+            }
+
+        // fold the lists of the child handles, one pick per slot
+        const TArrayView<const int32> NeighboringHandleIndices = Layout.GetNeighboringHandleIndices(FromIndex);
+        FKBestCandidates Candidates;
+        FKBestMerger Merger;
+        FNeighborValues Picks;
+        Picks.SetNumUninitialized(NeighboringHandleIndices.Num());
+        for (int32 Value = 0; Value < Layout.StateCounts[FromIndex]; ++Value)
+        {
+            Candidates.Reset(NeighboringHandleIndices.Num());
+            if (!Context.ObservationMask[FromIndex] || Value == Context.Variation[FromIndex])
+            {
+                Merger.Reset();
+                for (int32 NeighboringHandleIndex : NeighboringHandleIndices)
+                    if (NeighboringHandleIndex != ToHandleIndex)
+                        Merger.AddList(HandleLists.GetScores(NeighboringHandleIndex, Value), HandleLists.GetCount(NeighboringHandleIndex, Value));
+                Merger.Merge(0, VariableLists.K, [&](FFloatType Score, const int32* Ranks)
+                {
+                    int32 List = 0;
+                    for (int32 Slot = 0; Slot < NeighboringHandleIndices.Num(); ++Slot)
+                        Picks[Slot] = NeighboringHandleIndices[Slot] == ToHandleIndex ? 0 : Ranks[List++];
+                    return Candidates.Insert(VariableLists.K, Score, Picks.GetData());
+                });
+            }
+            VariableLists.Set(FromIndex, Value, Candidates);
+        }
+    }
+
+    void SendKBestMessage(int32 FromHandleIndex, int32 TargetFlatRandomVariableIndex)
+    {
+        const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(FromHandleIndex)->GetNeighboringFlatRandomVariableIndices();
+        const int32 TargetNeighborIndex = NeighboringFlatRandomVariableIndices.IndexOfByKey(TargetFlatRandomVariableIndex);
+        const FFloatType* ScoreTable = GetScoreTable(FromHandleIndex);
+
+        // the scratch buffers are shared by all entries of the table
+        TArray<FKBestCandidates> Candidates;
+        Candidates.SetNum(Layout.StateCounts[TargetFlatRandomVariableIndex]);
+        for (FKBestCandidates& ValueCandidates : Candidates) ValueCandidates.Reset(NeighboringFlatRandomVariableIndices.Num());
+        FKBestMerger Merger;
+        FNeighborValues Values, Picks;
+        Values.SetNumUninitialized(NeighboringFlatRandomVariableIndices.Num());
+        Picks.SetNumUninitialized(NeighboringFlatRandomVariableIndices.Num());
+        SendKBestMessageImpl(FromHandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, Candidates, Merger, Picks, Values, 0, 0);
+        for (int32 Value = 0; Value < Candidates.Num(); ++Value) HandleLists.Set(FromHandleIndex, Value, Candidates[Value]);
+    }
+
+    void SendKBestMessageImpl(int32 HandleIndex, const TArray<int32>& NeighboringFlatRandomVariableIndices, int32 TargetNeighborIndex, const FFloatType* ScoreTable,
+                              TArray<FKBestCandidates>& Candidates, FKBestMerger& Merger, FNeighborValues& Picks, FNeighborValues& Values, int32 ScoreIndex, int32 NeighborIndex) const
+    {
+        if (NeighborIndex == NeighboringFlatRandomVariableIndices.Num())
+        {
+            // merge the lists of the child neighbors for this table entry, one pick per neighbor
+            Merger.Reset();
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                if (Index != TargetNeighborIndex)
+                    Merger.AddList(VariableLists.GetScores(NeighboringFlatRandomVariableIndices[Index], Values[Index]), VariableLists.GetCount(NeighboringFlatRandomVariableIndices[Index], Values[Index]));
+            FKBestCandidates& ValueCandidates = Candidates[Values[TargetNeighborIndex]];
+            Merger.Merge(ScoreTable[ScoreIndex], HandleLists.K, [&](FFloatType Score, const int32* Ranks)
+            {
+                int32 List = 0;
+                for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                    Picks[Index] = Index == TargetNeighborIndex ? ScoreIndex : Ranks[List++];
+                return ValueCandidates.Insert(HandleLists.K, Score, Picks.GetData());
+            });
+            return;
+        }
+
+        const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighborIndex];
+        const int32 Stride = Layout.GetNeighborStride(HandleIndex, NeighborIndex);
+        int32& Value = Values[NeighborIndex];
+        if (Context.ObservationMask[FlatRandomVariableIndex])
+        {
+            Value = Context.Variation[FlatRandomVariableIndex];
+            SendKBestMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, Candidates, Merger, Picks, Values, ScoreIndex + Value * Stride, NeighborIndex + 1);
+        }
+        else for (Value = 0; Value < Layout.StateCounts[FlatRandomVariableIndex]; ++Value)
+        {
+            SendKBestMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, ScoreTable, Candidates, Merger, Picks, Values, ScoreIndex, NeighborIndex + 1);
+            ScoreIndex += Stride;
+        }
+    }
+
+    void DecodeKBest(int32 FromIndex, int32 ParentHandleIndex, int32 Value, int32 Rank)
+    {
+        Context.Variation[FromIndex] = Value;
+        const TArrayView<const int32> NeighboringHandleIndices = Layout.GetNeighboringHandleIndices(FromIndex);
+        const int32* HandleRanks = VariableLists.GetData(FromIndex, Value, Rank);
+        for (int32 Slot = 0; Slot < NeighboringHandleIndices.Num(); ++Slot)
+        {
+            const int32 NeighboringHandleIndex = NeighboringHandleIndices[Slot];
+            if (NeighboringHandleIndex == ParentHandleIndex) continue;
+            const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices();
+            const int32 TargetNeighborIndex = NeighboringFlatRandomVariableIndices.IndexOfByKey(FromIndex);
+            const int32* NeighborRanks = HandleLists.GetData(NeighboringHandleIndex, Value, HandleRanks[Slot]);
+            const int32 ScoreIndex = NeighborRanks[TargetNeighborIndex];
+            for (int32 NeighborIndex = 0; NeighborIndex < NeighboringFlatRandomVariableIndices.Num(); ++NeighborIndex)
+            {
+                if (NeighborIndex == TargetNeighborIndex) continue;
+                const int32 NeighboringFlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighborIndex];
+                const int32 NeighborValue = ScoreIndex / Layout.GetNeighborStride(NeighboringHandleIndex, NeighborIndex) % Layout.StateCounts[NeighboringFlatRandomVariableIndex];
+                DecodeKBest(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex, NeighborValue, NeighborRanks[NeighborIndex]);
+            }
+        }
+    }
+
+    // Decodes the neighbor values from the backpointer of each child handle, given the value of FromIndex.
+    void RunOutward(int32 FromIndex, int32 ParentHandleIndex)
+    {
+        for (int32 NeighboringHandleIndex : Layout.GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ParentHandleIndex)
+            {
+                const int32 ScoreIndex = Backpointers[BackpointerOffsets[NeighboringHandleIndex] + Context.Variation[FromIndex]];
+                const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices();
+                for (int32 NeighborIndex = 0; NeighborIndex < NeighboringFlatRandomVariableIndices.Num(); ++NeighborIndex)
+                {
+                    const int32 NeighboringFlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighborIndex];
+                    if (NeighboringFlatRandomVariableIndex == FromIndex) continue;
+                    Context.Variation[NeighboringFlatRandomVariableIndex] = ScoreIndex / Layout.GetNeighborStride(NeighboringHandleIndex, NeighborIndex) % Layout.StateCounts[NeighboringFlatRandomVariableIndex];
+                    RunOutward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex);
+                }
             }
     }
 };
@@ -4,6 +4,32 @@
 
 #include "CoreMinimal.h"
 #include "ConcordFactorGraph.h"
+#include "Algo/BinarySearch.h"
+#include <limits>
+
+// Counter-based generator, each value is a SplitMix64 hash of key and counter so streams are cheap to split and replay.
+class FConcordRandomStream
+{
+public:
+    explicit FConcordRandomStream(uint64 InKey = 0) : Key(Mix(InKey)), Counter(0) {}
+
+    uint64 Next() { return Mix(Key + ++Counter * 0x9E3779B97F4A7C15ull); }
+    float FRand() { return float(Next() >> 40) * (1.0f / float(1 << 24)); } // [0, 1)
+    int32 RandRange(int32 Min, int32 Max) { return Min + int32(((Next() >> 32) * uint64(Max - Min + 1)) >> 32); } // [Min, Max]
+
+    // Independent stream for a parallel task, advances this stream by one value.
+    FConcordRandomStream Split() { return FConcordRandomStream(Next()); }
+private:
+    uint64 Key;
+    uint64 Counter;
+
+    static uint64 Mix(uint64 Z)
+    {
+        Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBull;
+        return Z ^ (Z >> 31);
+    }
+};
 
 namespace Concord
 {
@@ -18,11 +44,29 @@ namespace Concord
         else for (FFloatType& Prob : Distribution) Prob /= Sum;
     }
 
+    // Turns log values into a normalized distribution, shifting by the maximum before exponentiating.
     template<typename FFloatType>
-    int32 SampleDistribution(const TArray<FFloatType>& Distribution)
+    void NormalizeLogDistribution(TArray<FFloatType>& Distribution)
+    {
+        FFloatType Max = -std::numeric_limits<FFloatType>::infinity();
+        for (FFloatType LogProb : Distribution) Max = FMath::Max(Max, LogProb);
+        if (Max == -std::numeric_limits<FFloatType>::infinity())
+        {
+            for (FFloatType& Prob : Distribution) Prob = FFloatType(1) / Distribution.Num();
+            return;
+        }
+        if (Max == std::numeric_limits<FFloatType>::infinity())
+        {
+            for (FFloatType& Prob : Distribution) Prob = Prob == Max ? 1 : 0;
+        }
+        else for (FFloatType& Prob : Distribution) Prob = FMath::Exp(Prob - Max);
+        NormalizeDistribution(Distribution);
+    }
+
+    template<typename FFloatType>
+    int32 SampleDistribution(const TArray<FFloatType>& Distribution, FFloatType Value)
     {
         FFloatType Acc = 0.0f;
-        const FFloatType Value = FMath::FRand();
         for (int32 Index = 0; Index < Distribution.Num(); ++Index)
         {
             Acc += Distribution[Index];
@@ -31,6 +75,12 @@ namespace Concord
         return Distribution.Num() - 1;
     }
 
+    template<typename FFloatType>
+    int32 SampleDistribution(const TArray<FFloatType>& Distribution, FConcordRandomStream& RandomStream)
+    {
+        return SampleDistribution(Distribution, FFloatType(RandomStream.FRand()));
+    }
+
     template<typename FFloatType>
     void GetDistributionFromScores(const TArray<float>& Scores, TArray<FFloatType>& OutDistribution)
     {
@@ -39,8 +89,152 @@ namespace Concord
             OutDistribution[Value] = FMath::Exp(FFloatType(Scores[Value]));
         NormalizeDistribution(OutDistribution);
     }
+
+    // Turns log values into unnormalized prefix sums, exponentiated against their maximum so a single pass needs no normalization.
+    // The prefix sum itself is a serial loop. Draw from the result with SampleCumulativeDistribution.
+    template<typename FInFloatType, typename FFloatType>
+    void GetCumulativeDistributionFromLogValues(const TArrayView<const FInFloatType>& LogValues, TArray<FFloatType>& OutCumulative)
+    {
+        const int32 Num = LogValues.Num();
+        OutCumulative.SetNumUninitialized(Num, false);
+        FFloatType Max = -std::numeric_limits<FFloatType>::infinity();
+        for (int32 Index = 0; Index < Num; ++Index) Max = FMath::Max(Max, FFloatType(LogValues[Index]));
+        if (!FMath::IsFinite(Max))
+        {
+            // all values impossible or some infinitely likely, pick uniformly among the maxima
+            FFloatType Acc = 0;
+            for (int32 Index = 0; Index < Num; ++Index) OutCumulative[Index] = Acc += FFloatType(LogValues[Index] == Max ? 1 : 0);
+            return;
+        }
+        for (int32 Index = 0; Index < Num; ++Index) OutCumulative[Index] = FMath::Exp(FFloatType(LogValues[Index]) - Max);
+        for (int32 Index = 1; Index < Num; ++Index) OutCumulative[Index] += OutCumulative[Index - 1];
+    }
+
+    template<typename FFloatType>
+    void GetCumulativeDistributionFromLogValues(TArray<FFloatType>& InOutValues)
+    {
+        GetCumulativeDistributionFromLogValues(TArrayView<const FFloatType>(InOutValues), InOutValues);
+    }
+
+    template<typename FFloatType>
+    void GetCumulativeDistribution(TArray<FFloatType>& InOutDistribution)
+    {
+        for (int32 Index = 1; Index < InOutDistribution.Num(); ++Index) InOutDistribution[Index] += InOutDistribution[Index - 1];
+    }
+
+    // Binary search over unnormalized prefix sums.
+    template<typename FFloatType>
+    int32 SampleCumulativeDistribution(const TArray<FFloatType>& Cumulative, FConcordRandomStream& RandomStream)
+    {
+        const FFloatType Value = FFloatType(RandomStream.FRand()) * Cumulative.Last();
+        return FMath::Min(int32(Algo::UpperBound(Cumulative, Value)), Cumulative.Num() - 1);
+    }
 }
 
+// Vose's alias method, O(1) draws from a distribution that is sampled many times. Only the roots of batch sampling draw from it,
+// distributions drawn from once (Gibbs updates, ancestral sampling below the roots) cost less as prefix sums than building a table.
+template<typename FFloatType>
+class FConcordAliasTable
+{
+public:
+    void Init(const TArray<FFloatType>& Distribution)
+    {
+        const int32 Num = Distribution.Num();
+        Probabilities.SetNumUninitialized(Num);
+        Aliases.SetNumUninitialized(Num);
+        TArray<int32, TInlineAllocator<128>> Small, Large;
+        for (int32 Index = 0; Index < Num; ++Index)
+        {
+            Probabilities[Index] = Distribution[Index] * Num;
+            Aliases[Index] = Index;
+            (Probabilities[Index] < 1 ? Small : Large).Add(Index);
+        }
+        while (!Small.IsEmpty() && !Large.IsEmpty())
+        {
+            const int32 SmallIndex = Small.Pop(false);
+            const int32 LargeIndex = Large.Last();
+            Aliases[SmallIndex] = LargeIndex;
+            Probabilities[LargeIndex] -= 1 - Probabilities[SmallIndex];
+            if (Probabilities[LargeIndex] < 1) Small.Add(Large.Pop(false));
+        }
+        for (int32 Index : Small) Probabilities[Index] = 1; // left over through rounding
+        for (int32 Index : Large) Probabilities[Index] = 1;
+    }
+
+    bool IsEmpty() const { return Probabilities.IsEmpty(); }
+
+    int32 Sample(FConcordRandomStream& RandomStream) const
+    {
+        const int32 Index = RandomStream.RandRange(0, Probabilities.Num() - 1);
+        return RandomStream.FRand() < Probabilities[Index] ? Index : Aliases[Index];
+    }
+private:
+    TArray<FFloatType> Probabilities;
+    TArray<int32> Aliases;
+};
+
+// Conditional scores per random variable and neighboring handle. An entry stays valid as long as the other neighbors
+// of its handle keep their values, which is tracked by summing their change versions into a stamp.
+template<typename FFloatType>
+class FConcordConditionalScoreCache
+{
+public:
+    void Init(const FConcordFactorGraph<FFloatType>& FactorGraph)
+    {
+        EntryOffsets.Reset(FactorGraph.GetRandomVariableCount() + 1);
+        ScoreOffsets.Reset();
+        EntryOffsets.Add(0);
+        int32 ScoreCount = 0;
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph.GetRandomVariableCount(); ++FlatRandomVariableIndex)
+        {
+            for (int32 Slot = 0; Slot < FactorGraph.GetNeighboringHandles(FlatRandomVariableIndex).Num(); ++Slot)
+            {
+                ScoreOffsets.Add(ScoreCount);
+                ScoreCount += FactorGraph.GetStateCount(FlatRandomVariableIndex);
+            }
+            EntryOffsets.Add(ScoreOffsets.Num());
+        }
+        Scores.SetNumUninitialized(ScoreCount);
+        Versions.SetNumUninitialized(FactorGraph.GetRandomVariableCount());
+        Stamps.SetNumUninitialized(ScoreOffsets.Num());
+        Reset();
+    }
+
+    // Invalidates all entries, needed whenever the variation or the parameters were changed from outside.
+    void Reset()
+    {
+        for (uint64& Version : Versions) Version = 0;
+        for (uint64& Stamp : Stamps) Stamp = MAX_uint64;
+    }
+
+    void MarkChanged(int32 FlatRandomVariableIndex) { ++Versions[FlatRandomVariableIndex]; }
+
+    // Returns the cached scores of the slot-th neighboring handle of the random variable, or nullptr if they are outdated.
+    // OutStamp has to be passed to Update after refilling them.
+    FFloatType* Find(const FConcordFactorHandleBase<FFloatType>* Handle, int32 FlatRandomVariableIndex, int32 Slot, uint64& OutStamp)
+    {
+        OutStamp = 0;
+        for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
+            if (NeighboringFlatRandomVariableIndex != FlatRandomVariableIndex)
+                OutStamp += Versions[NeighboringFlatRandomVariableIndex];
+        const int32 Entry = EntryOffsets[FlatRandomVariableIndex] + Slot;
+        return Stamps[Entry] == OutStamp ? Scores.GetData() + ScoreOffsets[Entry] : nullptr;
+    }
+
+    FFloatType* Update(int32 FlatRandomVariableIndex, int32 Slot, uint64 Stamp)
+    {
+        const int32 Entry = EntryOffsets[FlatRandomVariableIndex] + Slot;
+        Stamps[Entry] = Stamp;
+        return Scores.GetData() + ScoreOffsets[Entry];
+    }
+private:
+    TArray<int32> EntryOffsets; // per random variable + 1, indexed by the slot of the neighboring handle
+    TArray<int32> ScoreOffsets; // per entry
+    TArray<FFloatType> Scores; // per entry, the scores of all values of the random variable
+    TArray<uint64> Versions; // per random variable, incremented on every change of its value
+    TArray<uint64> Stamps; // per entry, the summed versions of the other neighbors when the scores were computed
+};
+
 template<typename FFloatType>
 class FConcordFactorGraphSamplingUtils
 {
@@ -50,12 +244,12 @@ public:
         , Context(InContext)
     {}
 
-    void InitVariation()
+    void InitVariation(FConcordRandomStream& RandomStream)
     {
         for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
         {
             if (Context.ObservationMask[FlatRandomVariableIndex]) continue;
-            Context.Variation[FlatRandomVariableIndex] = FMath::RandRange(0, FactorGraph->GetStateCount(FlatRandomVariableIndex) - 1);
+            Context.Variation[FlatRandomVariableIndex] = RandomStream.RandRange(0, FactorGraph->GetStateCount(FlatRandomVariableIndex) - 1);
         }
     }
 
@@ -63,17 +257,12 @@ public:
     {
         OutDistribution.Reset();
         OutDistribution.SetNumZeroed(FactorGraph->GetStateCount(FlatRandomVariableIndex), false);
-        const int32 RememberedValue = Context.Variation[FlatRandomVariableIndex];
-
         if (Context.ObservationMask[FlatRandomVariableIndex])
         {
-            OutDistribution[RememberedValue] = 1;
+            OutDistribution[Context.Variation[FlatRandomVariableIndex]] = 1;
             return;
         }
-
-        for (const auto& Handle : FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex))
-            Handle->AddScores(FlatRandomVariableIndex, Context, MakeArrayView(OutDistribution));
-        Context.Variation[FlatRandomVariableIndex] = RememberedValue;
+        AddConditionalScores(FlatRandomVariableIndex, OutDistribution);
         Concord::GetDistributionFromScores(OutDistribution, OutDistribution);
     }
 
@@ -81,21 +270,39 @@ public:
     void ComputeConditionalDistribution(int32 FlatRandomVariableIndex, TArray<float>& OutScores, TArray<FDistributionFloatType>& OutDistribution)
     {
         OutScores.Init(0, FactorGraph->GetStateCount(FlatRandomVariableIndex));
-        const int32 RememberedValue = Context.Variation[FlatRandomVariableIndex];
-
         if (Context.ObservationMask[FlatRandomVariableIndex])
         {
             OutDistribution.Init(0, FactorGraph->GetStateCount(FlatRandomVariableIndex));
-            OutDistribution[RememberedValue] = 1;
+            OutDistribution[Context.Variation[FlatRandomVariableIndex]] = 1;
             return;
         }
-
-        for (const auto& Handle : FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex))
-            Handle->AddScores(FlatRandomVariableIndex, Context, MakeArrayView(OutScores));
-        Context.Variation[FlatRandomVariableIndex] = RememberedValue;
+        AddConditionalScores(FlatRandomVariableIndex, OutScores);
         Concord::GetDistributionFromScores(OutScores, OutDistribution);
     }
 
+    // Only fills the scores of an unobserved random variable, for callers that turn them into a distribution themselves.
+    void ComputeConditionalScores(int32 FlatRandomVariableIndex, TArray<float>& OutScores)
+    {
+        OutScores.Init(0, FactorGraph->GetStateCount(FlatRandomVariableIndex));
+        AddConditionalScores(FlatRandomVariableIndex, OutScores);
+    }
+
+    // Like ComputeConditionalDistribution, but the distribution is left as prefix sums for Concord::SampleCumulativeDistribution
+    // and only the scores of handles whose other neighbors changed are recomputed.
+    template<typename FDistributionFloatType>
+    void ComputeConditionalCumulativeDistribution(int32 FlatRandomVariableIndex, FConcordConditionalScoreCache<FFloatType>& Cache, TArray<float>& OutScores, TArray<FDistributionFloatType>& OutCumulative)
+    {
+        OutScores.Init(0, FactorGraph->GetStateCount(FlatRandomVariableIndex));
+        if (Context.ObservationMask[FlatRandomVariableIndex])
+        {
+            OutCumulative.Init(0, OutScores.Num());
+            for (int32 Value = Context.Variation[FlatRandomVariableIndex]; Value < OutCumulative.Num(); ++Value) OutCumulative[Value] = 1;
+            return;
+        }
+        AddConditionalScores(FlatRandomVariableIndex, OutScores, &Cache);
+        Concord::GetCumulativeDistributionFromLogValues(TArrayView<const float>(OutScores), OutCumulative);
+    }
+
     FFloatType GetScore()
     {
         FFloatType Score = 0;
@@ -113,4 +320,31 @@ public:
 private:
     const FConcordFactorGraph<FFloatType>* FactorGraph;
     FConcordExpressionContextMutable<FFloatType> Context;
+
+    // Adds the scores of every value of the random variable from its neighboring handles, reusing the scores in Cache if given.
+    void AddConditionalScores(int32 FlatRandomVariableIndex, TArray<float>& InOutScores, FConcordConditionalScoreCache<FFloatType>* Cache = nullptr)
+    {
+        const int32 StateCount = InOutScores.Num();
+        const int32 RememberedValue = Context.Variation[FlatRandomVariableIndex];
+        const auto& NeighboringHandles = FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex);
+        for (int32 Slot = 0; Slot < NeighboringHandles.Num(); ++Slot)
+        {
+            if (!Cache)
+            {
+                NeighboringHandles[Slot]->AddScores(FlatRandomVariableIndex, Context, MakeArrayView(InOutScores));
+                continue;
+            }
+            uint64 Stamp;
+            const FFloatType* HandleScores = Cache->Find(NeighboringHandles[Slot], FlatRandomVariableIndex, Slot, Stamp);
+            if (!HandleScores)
+            {
+                FFloatType* UpdatedScores = Cache->Update(FlatRandomVariableIndex, Slot, Stamp);
+                FMemory::Memzero(UpdatedScores, StateCount * sizeof(FFloatType));
+                NeighboringHandles[Slot]->AddScores(FlatRandomVariableIndex, Context, TArrayView<FFloatType>(UpdatedScores, StateCount));
+                HandleScores = UpdatedScores;
+            }
+            for (int32 Value = 0; Value < StateCount; ++Value) InOutScores[Value] += HandleScores[Value];
+        }
+        Context.Variation[FlatRandomVariableIndex] = RememberedValue;
+    }
 };
@@ -4,156 +4,776 @@
 
 #include "CoreMinimal.h"
 #include "ConcordFactorGraph.h"
+#include "ConcordFactorGraphLayout.h"
+#include "ConcordFactorGraphSamplingUtils.h"
 #include "Async/TaskGraphInterfaces.h"
+#include <limits>
 #include <type_traits>
 
-template<typename FFloatType, typename FSumProductMessageFloatType = FFloatType, bool bParallelize = true>
+// Message policies, messages are products of exp(score) in linear space or sums of scores in log space.
+template<typename FMessageFloatType>
+struct FConcordSumProductLinear
+{
+    using FMessage = FMessageFloatType;
+    static FMessage FromScore(float Score) { return exp(FMessage(Score)); }
+    static FMessage One() { return 1; }
+    static FMessage Zero() { return 0; }
+    static FMessage Multiply(FMessage A, FMessage B) { return A * B; }
+    static void Add(FMessage& Acc, FMessage Value) { Acc += Value; }
+    using FSum = FMessage;
+    static FSum ZeroSum() { return 0; }
+    static void AddToSum(FSum& Sum, FMessage Value) { Sum += Value; }
+    static FMessage GetSum(const FSum& Sum) { return Sum; }
+    static double ToLog(FMessage Value) { return log(double(Value)); }
+    static void ToDistribution(TArray<FMessage>& InOutValues) { Concord::NormalizeDistribution(InOutValues); }
+    static void ToCumulativeDistribution(TArray<FMessage>& InOutValues) { Concord::GetCumulativeDistribution(InOutValues); }
+
+    // Scales the strided values to sum to one and returns the log of the removed scale.
+    static double Normalize(FMessage* Values, int32 Num, int32 Stride)
+    {
+        double Sum = 0.0;
+        for (int32 Index = 0; Index < Num; ++Index) Sum += Values[Index * Stride];
+        if (Sum > 0.0 && FMath::IsFinite(Sum))
+            for (int32 Index = 0; Index < Num; ++Index) Values[Index * Stride] = FMessage(Values[Index * Stride] / Sum);
+        return log(Sum);
+    }
+};
+
+template<typename FMessageFloatType>
+struct FConcordSumProductLogSpace
+{
+    using FMessage = FMessageFloatType;
+    static FMessage FromScore(float Score) { return Score; }
+    static FMessage One() { return 0; }
+    static FMessage Zero() { return -std::numeric_limits<FMessage>::infinity(); }
+    static FMessage Multiply(FMessage A, FMessage B) { return A + B; }
+    static void Add(FMessage& Acc, FMessage Value)
+    {
+        if (Value > Acc) Swap(Acc, Value);
+        if (Value == Zero()) return;
+        Acc += FMessage(log1p(double(FMath::Exp(Value - Acc)))); // shifted by the larger operand
+    }
+    // Sums of many terms are kept relative to their running maximum, so a whole message takes a single log.
+    struct FSum
+    {
+        FMessage Max;
+        FMessage Scaled; // sum of exp(term - Max)
+    };
+    static FSum ZeroSum() { return { Zero(), 0 }; }
+    static void AddToSum(FSum& Sum, FMessage Value)
+    {
+        if (Value == Zero()) return;
+        if (Value <= Sum.Max)
+        {
+            Sum.Scaled += FMath::Exp(Value - Sum.Max);
+            return;
+        }
+        Sum.Scaled = Sum.Scaled * FMath::Exp(Sum.Max - Value) + FMessage(1);
+        Sum.Max = Value;
+    }
+    static FMessage GetSum(const FSum& Sum) { return Sum.Max == Zero() ? Zero() : Sum.Max + FMessage(FMath::Loge(Sum.Scaled)); }
+    static double ToLog(FMessage Value) { return Value; }
+    static void ToDistribution(TArray<FMessage>& InOutValues) { Concord::NormalizeLogDistribution(InOutValues); }
+    static void ToCumulativeDistribution(TArray<FMessage>& InOutValues) { Concord::GetCumulativeDistributionFromLogValues(InOutValues); }
+
+    static double Normalize(FMessage* Values, int32 Num, int32 Stride)
+    {
+        FSum Sum = ZeroSum();
+        for (int32 Index = 0; Index < Num; ++Index) AddToSum(Sum, Values[Index * Stride]);
+        const FMessage LogSum = GetSum(Sum);
+        if (FMath::IsFinite(LogSum))
+            for (int32 Index = 0; Index < Num; ++Index) Values[Index * Stride] -= LogSum;
+        return LogSum;
+    }
+};
+
+template<typename FMessagePolicy>
+struct FConcordSumProductMessages
+{
+    using FSumProductFloatType = typename FMessagePolicy::FMessage;
+    FConcordFactorGraphLayout Layout;
+    TArray<FSumProductFloatType> FactorMessages;
+    TArray<FSumProductFloatType> VariableMessageFactors;
+
+    FSumProductFloatType* GetFactorMessages(int32 HandleIndex) { return FactorMessages.GetData() + Layout.FactorMessageOffsets[HandleIndex]; }
+    const FSumProductFloatType* GetFactorMessages(int32 HandleIndex) const { return FactorMessages.GetData() + Layout.FactorMessageOffsets[HandleIndex]; }
+    FSumProductFloatType* GetVariableMessageFactors(int32 FlatRandomVariableIndex, int32 Value) { return VariableMessageFactors.GetData() + Layout.GetVariableMessageIndex(FlatRandomVariableIndex, Value); }
+    const FSumProductFloatType* GetVariableMessageFactors(int32 FlatRandomVariableIndex, int32 Value) const { return VariableMessageFactors.GetData() + Layout.GetVariableMessageIndex(FlatRandomVariableIndex, Value); }
+    FSumProductFloatType GetVariableMessageProduct(int32 FlatRandomVariableIndex, int32 Value, int32 ExcludedSlot = INDEX_NONE) const
+    {
+        const FSumProductFloatType* Factors = GetVariableMessageFactors(FlatRandomVariableIndex, Value);
+        const int32 NeighboringHandleCount = Layout.GetNeighboringHandleCount(FlatRandomVariableIndex);
+        FSumProductFloatType Product = FMessagePolicy::One();
+        for (int32 Slot = 0; Slot < NeighboringHandleCount; ++Slot)
+            if (Slot != ExcludedSlot)
+                Product = FMessagePolicy::Multiply(Product, Factors[Slot]);
+        return Product;
+    }
+};
+
+template<typename FFloatType, typename FMessagePolicy = FConcordSumProductLinear<FFloatType>, bool bParallelize = true>
 class FConcordFactorGraphSumProduct
 {
+    using FSumProductMessageFloatType = typename FMessagePolicy::FMessage;
 public:
     FConcordFactorGraphSumProduct(const FConcordFactorGraph<FFloatType>* InFactorGraph, const FConcordExpressionContextMutable<FFloatType>& InContext)
         : FactorGraph(InFactorGraph)
         , Context(InContext)
+        , MinTaskCost(1<<12)
+        , MaxSparseDensity(0.25f)
     {}
 
+    // Subtrees whose message cost (summed potential table sizes) is below this run inside the task of their parent.
+    void SetMinTaskCost(uint64 InMinTaskCost) { MinTaskCost = InMinTaskCost; }
+
+    // Potential tables with at most this fraction of non-zero entries only send messages over their non-zero entries.
+    void SetMaxSparseDensity(float InMaxSparseDensity) { MaxSparseDensity = InMaxSparseDensity; }
+
     void Init()
     {
-        Messages.FactorMessages.Reserve(FactorGraph->GetHandles().Num());
-        for (const auto& Handle : FactorGraph->GetHandles())
+        Messages.Layout.Init(*FactorGraph);
+        InitParameterDependencies();
+        Messages.FactorMessages.Init(FMessagePolicy::One(), Messages.Layout.FactorMessageOffsets.Last());
+        Messages.VariableMessageFactors.Init(FMessagePolicy::Zero(), Messages.Layout.VariableMessageOffsets.Last());
+        PotentialTables.SetNumUninitialized(Messages.Layout.FactorMessageOffsets.Last());
+        PotentialTablesValid.Init(false, FactorGraph->GetHandles().Num());
+        InitSparsePotentialTables();
+        InitDomains();
+        InwardLogScales.Init(0.0, FactorGraph->GetHandles().Num());
+        InitTree();
+        bFullInwardPassRequired = true;
+    }
+
+    // Sets up the messages for SendLoopyMessage on graphs that may contain cycles, the tree passes must not be used then.
+    void InitLoopy()
+    {
+        Messages.Layout.Init(*FactorGraph);
+        InitParameterDependencies();
+        Messages.FactorMessages.Init(FMessagePolicy::One(), Messages.Layout.FactorMessageOffsets.Last());
+        PotentialTables.SetNumUninitialized(Messages.Layout.FactorMessageOffsets.Last());
+        PotentialTablesValid.Init(false, FactorGraph->GetHandles().Num());
+        InitSparsePotentialTables();
+        InitDomains();
+        InwardLogScales.Init(0.0, FactorGraph->GetHandles().Num());
+        ParentFlatRandomVariableIndices.Init(INDEX_NONE, FactorGraph->GetHandles().Num());
+        ResetLoopy();
+    }
+
+    // Sets all messages into the random variables to uniform.
+    void ResetLoopy()
+    {
+        Messages.VariableMessageFactors.Init(FMessagePolicy::One(), Messages.Layout.VariableMessageOffsets.Last());
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+            for (int32 Slot = 0; Slot < Messages.Layout.GetNeighboringHandleCount(FlatRandomVariableIndex); ++Slot)
+                FMessagePolicy::Normalize(Messages.GetVariableMessageFactors(FlatRandomVariableIndex, 0) + Slot, Messages.Layout.StateCounts[FlatRandomVariableIndex], Messages.Layout.GetNeighboringHandleCount(FlatRandomVariableIndex));
+    }
+
+    // Recomputes the message of the handle into its neighbor with the same kernel as the tree passes, mixing in Damping of the
+    // previous message. Returns the largest absolute change of the normalized message, the residual of the edge.
+    double SendLoopyMessage(int32 HandleIndex, int32 NeighborIndex, double Damping)
+    {
+        const int32 TargetFlatRandomVariableIndex = GetHandle(HandleIndex)->GetNeighboringFlatRandomVariableIndices()[NeighborIndex];
+        const int32 StateCount = Messages.Layout.StateCounts[TargetFlatRandomVariableIndex];
+        const int32 Stride = Messages.Layout.GetNeighboringHandleCount(TargetFlatRandomVariableIndex);
+        FSumProductMessageFloatType* TargetMessage = Messages.GetVariableMessageFactors(TargetFlatRandomVariableIndex, 0) + Messages.Layout.GetNeighborSlot(HandleIndex, NeighborIndex);
+        TArray<FSumProductMessageFloatType, TInlineAllocator<32>> PreviousMessage;
+        PreviousMessage.SetNumUninitialized(StateCount);
+        for (int32 Value = 0; Value < StateCount; ++Value)
         {
-            TArray<FSumProductMessageFloatType>& Values = Messages.FactorMessages.FindOrAdd(Handle.Get()); int32 NumValues = 1;
-            for (int32 NeighboringFlatRandomVariableIndex : Handle->GetNeighboringFlatRandomVariableIndices())
-                NumValues *= FactorGraph->GetStateCount(NeighboringFlatRandomVariableIndex);
-            Values.Init(1, NumValues);
+            PreviousMessage[Value] = TargetMessage[Value * Stride];
+            TargetMessage[Value * Stride] = FMessagePolicy::Zero();
         }
-        Messages.VariableMessageFactors.SetNum(FactorGraph->GetRandomVariableCount());
-        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < FactorGraph->GetRandomVariableCount(); ++FlatRandomVariableIndex)
+        SendSumProductMessage(HandleIndex, TargetFlatRandomVariableIndex);
+
+        if (Damping > 0.0)
         {
-            Messages.VariableMessageFactors[FlatRandomVariableIndex].Reserve(FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex).Num());
-            for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FlatRandomVariableIndex))
-                Messages.VariableMessageFactors[FlatRandomVariableIndex].FindOrAdd(NeighboringHandle).Init(0, FactorGraph->GetStateCount(FlatRandomVariableIndex));
+            const FSumProductMessageFloatType NewWeight = FMessagePolicy::FromScore(float(FMath::Loge(1.0 - Damping)));
+            const FSumProductMessageFloatType PreviousWeight = FMessagePolicy::FromScore(float(FMath::Loge(Damping)));
+            for (int32 Value = 0; Value < StateCount; ++Value)
+            {
+                FSumProductMessageFloatType& Message = TargetMessage[Value * Stride];
+                Message = FMessagePolicy::Multiply(Message, NewWeight);
+                FMessagePolicy::Add(Message, FMessagePolicy::Multiply(PreviousMessage[Value], PreviousWeight));
+            }
+            FMessagePolicy::Normalize(TargetMessage, StateCount, Stride);
         }
+
+        double Residual = 0.0;
+        for (int32 Value = 0; Value < StateCount; ++Value)
+            Residual = FMath::Max(Residual, FMath::Abs(exp(FMessagePolicy::ToLog(TargetMessage[Value * Stride])) - exp(FMessagePolicy::ToLog(PreviousMessage[Value]))));
+        return Residual;
+    }
+
+    // Potential tables are cached across runs, call these whenever parameters of the context changed.
+    void InvalidatePotentialTables()
+    {
+        for (bool& bValid : PotentialTablesValid) bValid = false;
+    }
+
+    void InvalidatePotentialTables(const TArray<int32>& ChangedIntParameterIndices, const TArray<int32>& ChangedFloatParameterIndices)
+    {
+        ParameterDependencies.Invalidate(ChangedIntParameterIndices, ChangedFloatParameterIndices, PotentialTablesValid);
     }
 
     void RunInward()
     {
         Reset();
-        if constexpr (bParallelize)
+        if (bParallelize && IsTaskWorthy())
         {
             FGraphEventArray OutstandingEvents;
             for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
-                OutstandingEvents.Add(RunInwardParallelized(RootFlatRandomVariableIndex, nullptr));
+                OutstandingEvents.Add(RunInwardParallelized(RootFlatRandomVariableIndex, INDEX_NONE));
             FTaskGraphInterface::Get().WaitUntilTasksComplete(OutstandingEvents);
         }
         else
         {
             for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
-                RunInward(RootFlatRandomVariableIndex, nullptr);
+                RunInward(RootFlatRandomVariableIndex, INDEX_NONE);
+        }
+        for (bool& bDirty : DirtyHandles) bDirty = false;
+        bFullInwardPassRequired = false;
+    }
+
+    // Only recomputes the messages on the paths from the handles touching changed random variables or invalidated potential tables to the roots.
+    // ChangedFlatRandomVariableIndices are the random variables whose observation mask or observed value changed since the last run.
+    void RunInward(const TArray<int32>& ChangedFlatRandomVariableIndices)
+    {
+        if (bFullInwardPassRequired)
+        {
+            RunInward();
+            return;
+        }
+
+        int32 DirtyHandleCount = 0;
+        for (int32 HandleIndex = 0; HandleIndex < DirtyHandles.Num(); ++HandleIndex)
+            DirtyHandles[HandleIndex] = DirtyHandles[HandleIndex] || !PotentialTablesValid[HandleIndex]; // PruneDomains() may have updated the table already
+        for (int32 FlatRandomVariableIndex : ChangedFlatRandomVariableIndices)
+            for (int32 HandleIndex : GetLayout().GetNeighboringHandleIndices(FlatRandomVariableIndex))
+                DirtyHandles[HandleIndex] = true;
+        for (int32 HandleIndex : InwardHandleOrder) // children come before their parents
+        {
+            if (!DirtyHandles[HandleIndex]) continue;
+            ++DirtyHandleCount;
+            const int32 ParentHandleIndex = ParentHandleIndices[ParentFlatRandomVariableIndices[HandleIndex]];
+            if (ParentHandleIndex != INDEX_NONE) DirtyHandles[ParentHandleIndex] = true;
+        }
+        if (DirtyHandleCount > InwardHandleOrder.Num() / 2)
+        {
+            RunInward();
+            return;
+        }
+
+        for (int32 HandleIndex : InwardHandleOrder)
+        {
+            if (!DirtyHandles[HandleIndex]) continue;
+            DirtyHandles[HandleIndex] = false;
+            const int32 ParentIndex = ParentFlatRandomVariableIndices[HandleIndex];
+            const int32 Slot = GetLayout().GetNeighborSlot(HandleIndex, GetHandle(HandleIndex)->GetNeighboringFlatRandomVariableIndices().IndexOfByKey(ParentIndex));
+            for (int32 Value = 0; Value < GetLayout().StateCounts[ParentIndex]; ++Value)
+                Messages.GetVariableMessageFactors(ParentIndex, Value)[Slot] = FMessagePolicy::Zero();
+            SendSumProductMessage(HandleIndex, ParentIndex);
+        }
+    }
+
+    // Arc consistency over the zero potentials (AC-3 with handles as constraints), call after Init() and before RunInward().
+    // A value is removed from the domain of a random variable if no non-zero potential of some neighboring handle combines it with
+    // values in the domains of the other neighbors. The following passes and the ancestral sampling skip removed values.
+    // Returns false if a domain became empty, the observations are infeasible then and the messages must not be used.
+    // Nothing is done unless observations or parameters changed. Observations of values still in their domain only narrow the domains,
+    // so pruning starts at the handles next to them. Subgraphs where removed values may become possible again, through other observation
+    // changes or updated potential tables, are pruned from scratch. Only the handles next to changed domains are left for RunInward().
+    bool PruneDomains(const TArray<int32>& ChangedFlatRandomVariableIndices, bool bParametersChanged)
+    {
+        if (bDomainsPruned && ChangedFlatRandomVariableIndices.IsEmpty() && !bParametersChanged) return true;
+
+        // handles without zero potentials support every combination of values and never remove any
+        const int32 HandleCount = FactorGraph->GetHandles().Num();
+        auto CanPrune = [&](int32 HandleIndex) { return NonZeroPotentialCounts[HandleIndex] < GetLayout().GetFactorMessageNum(HandleIndex); };
+        TArray<int32> Queue;
+        TArray<bool> Queued;
+        Queued.Init(false, HandleCount);
+        auto Enqueue = [&](int32 FlatRandomVariableIndex, int32 ExcludedHandleIndex)
+        {
+            for (int32 HandleIndex : GetLayout().GetNeighboringHandleIndices(FlatRandomVariableIndex))
+                if (HandleIndex != ExcludedHandleIndex && !Queued[HandleIndex] && CanPrune(HandleIndex))
+                {
+                    Queue.Add(HandleIndex);
+                    Queued[HandleIndex] = true;
+                }
+        };
+        TArray<int32> PrunedFlatRandomVariableIndices;
+
+        TArray<bool> ResetSubgraphs;
+        ResetSubgraphs.Init(!bDomainsPruned, SubgraphFlatRandomVariableIndices.Num());
+        if (bParametersChanged || !bDomainsPruned)
+        {
+            TArray<int32> UpdatedHandleIndices;
+            for (int32 HandleIndex = 0; HandleIndex < HandleCount; ++HandleIndex)
+                if (!PotentialTablesValid[HandleIndex] && ParentFlatRandomVariableIndices[HandleIndex] != INDEX_NONE)
+                {
+                    ResetSubgraphs[SubgraphIndices[ParentFlatRandomVariableIndices[HandleIndex]]] = true;
+                    UpdatedHandleIndices.Add(HandleIndex);
+                    DirtyHandles[HandleIndex] = true;
+                }
+            // pruning reads the updated tables, the inward pass then finds them valid. Serial, scoring a table writes the
+            // values of the handle's neighbors into the shared context.
+            for (int32 HandleIndex : UpdatedHandleIndices) UpdatePotentialTable(HandleIndex);
+        }
+        for (int32 FlatRandomVariableIndex : ChangedFlatRandomVariableIndices)
+        {
+            const int32 SubgraphIndex = SubgraphIndices[FlatRandomVariableIndex];
+            if (ResetSubgraphs[SubgraphIndex]) continue;
+            if (!Context.ObservationMask[FlatRandomVariableIndex] || !IsInDomain(FlatRandomVariableIndex, Context.Variation[FlatRandomVariableIndex]))
+            {
+                ResetSubgraphs[SubgraphIndex] = true;
+                continue;
+            }
+            for (int32 Value = 0; Value < GetLayout().StateCounts[FlatRandomVariableIndex]; ++Value)
+                Domains[DomainOffsets[FlatRandomVariableIndex] + Value] = Value == Context.Variation[FlatRandomVariableIndex];
+            PrunedFlatRandomVariableIndices.Add(FlatRandomVariableIndex);
+            Enqueue(FlatRandomVariableIndex, INDEX_NONE);
+        }
+        for (int32 SubgraphIndex = 0; SubgraphIndex < ResetSubgraphs.Num(); ++SubgraphIndex)
+            if (ResetSubgraphs[SubgraphIndex])
+                for (int32 FlatRandomVariableIndex : SubgraphFlatRandomVariableIndices[SubgraphIndex])
+                {
+                    for (int32 Value = 0; Value < GetLayout().StateCounts[FlatRandomVariableIndex]; ++Value)
+                        Domains[DomainOffsets[FlatRandomVariableIndex] + Value] = !Context.ObservationMask[FlatRandomVariableIndex] || Value == Context.Variation[FlatRandomVariableIndex];
+                    PrunedFlatRandomVariableIndices.Add(FlatRandomVariableIndex);
+                    Enqueue(FlatRandomVariableIndex, INDEX_NONE);
+                }
+
+        bool bFeasible = true;
+        for (int32 QueueIndex = 0; QueueIndex < Queue.Num() && bFeasible; ++QueueIndex)
+        {
+            const int32 HandleIndex = Queue[QueueIndex];
+            Queued[HandleIndex] = false;
+            const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(HandleIndex)->GetNeighboringFlatRandomVariableIndices();
+            TArray<int32, TInlineAllocator<8>> SupportOffsets;
+            int32 SupportNum = 0;
+            for (int32 FlatRandomVariableIndex : NeighboringFlatRandomVariableIndices)
+            {
+                SupportOffsets.Add(SupportNum);
+                SupportNum += GetLayout().StateCounts[FlatRandomVariableIndex];
+            }
+            TArray<bool, TInlineAllocator<64>> Supported;
+            Supported.Init(false, SupportNum);
+            FNeighborValues Values;
+            Values.SetNumUninitialized(NeighboringFlatRandomVariableIndices.Num());
+            auto AddSupport = [&](int32 FactorMessageIndex)
+            {
+                for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                {
+                    Values[Index] = FactorMessageIndex / GetLayout().GetNeighborStride(HandleIndex, Index) % GetLayout().StateCounts[NeighboringFlatRandomVariableIndices[Index]];
+                    if (!IsInDomain(NeighboringFlatRandomVariableIndices[Index], Values[Index])) return;
+                }
+                for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index) Supported[SupportOffsets[Index] + Values[Index]] = true;
+            };
+            if (PotentialTablesSparse[HandleIndex])
+                for (int32 FactorMessageIndex : NonZeroPotentialIndices[HandleIndex]) AddSupport(FactorMessageIndex);
+            else
+            {
+                const FSumProductMessageFloatType* PotentialTable = PotentialTables.GetData() + GetLayout().FactorMessageOffsets[HandleIndex];
+                for (int32 FactorMessageIndex = 0; FactorMessageIndex < GetLayout().GetFactorMessageNum(HandleIndex); ++FactorMessageIndex)
+                    if (PotentialTable[FactorMessageIndex] != FMessagePolicy::Zero()) AddSupport(FactorMessageIndex);
+            }
+
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num() && bFeasible; ++Index)
+            {
+                const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[Index];
+                bool bRemoved = false;
+                bFeasible = false;
+                for (int32 Value = 0; Value < GetLayout().StateCounts[FlatRandomVariableIndex]; ++Value)
+                {
+                    bool& bInDomain = Domains[DomainOffsets[FlatRandomVariableIndex] + Value];
+                    if (bInDomain && !Supported[SupportOffsets[Index] + Value]) { bInDomain = false; bRemoved = true; }
+                    bFeasible |= bInDomain;
+                }
+                if (!bRemoved) continue;
+                PrunedFlatRandomVariableIndices.Add(FlatRandomVariableIndex);
+                Enqueue(FlatRandomVariableIndex, HandleIndex);
+            }
+        }
+
+        // an infeasible run leaves the domains partially pruned, the next run starts from scratch
+        bDomainsPruned = bFeasible;
+        if (!bFeasible)
+        {
+            bFullInwardPassRequired = true;
+            return false;
+        }
+        for (int32 FlatRandomVariableIndex : PrunedFlatRandomVariableIndices)
+        {
+            bool bChanged = false;
+            for (int32 DomainIndex = DomainOffsets[FlatRandomVariableIndex]; DomainIndex < DomainOffsets[FlatRandomVariableIndex + 1]; ++DomainIndex)
+            {
+                bChanged |= MessageDomains[DomainIndex] != Domains[DomainIndex];
+                MessageDomains[DomainIndex] = Domains[DomainIndex];
+            }
+            if (bChanged)
+                for (int32 HandleIndex : GetLayout().GetNeighboringHandleIndices(FlatRandomVariableIndex)) DirtyHandles[HandleIndex] = true;
         }
+        return true;
     }
 
+    bool IsInDomain(int32 FlatRandomVariableIndex, int32 Value) const { return Domains[DomainOffsets[FlatRandomVariableIndex] + Value]; }
+
     void RunOutward()
     {
-        for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
-            RunOutward(RootFlatRandomVariableIndex, nullptr);
+        bFullInwardPassRequired = true; // outward messages accumulate into the variable message factors
+
+        if (bParallelize && IsTaskWorthy())
+        {
+            FGraphEventArray OutstandingEvents;
+            for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
+                OutstandingEvents.Add(TGraphTask<FSumProductOutwardTask>::CreateTask().ConstructAndDispatchWhenReady(RootFlatRandomVariableIndex, INDEX_NONE, this));
+            FTaskGraphInterface::Get().WaitUntilTasksComplete(OutstandingEvents);
+        }
+        else
+        {
+            for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
+                RunOutward(RootFlatRandomVariableIndex, INDEX_NONE);
+        }
     }
 
+    // Whether the subtree below the random variable is costly enough to be processed by its own task.
+    bool IsTaskWorthy(int32 FlatRandomVariableIndex) const { return SubtreeCosts[FlatRandomVariableIndex] >= MinTaskCost; }
+    bool IsTaskWorthy() const { return TotalCost >= MinTaskCost; }
+
     const auto& GetMessages() const { return Messages; }
+    const FConcordFactorGraphLayout& GetLayout() const { return Messages.Layout; }
 
-    // Call after RunInward()
-    FSumProductMessageFloatType GetZ() const
+    // Call after RunInward(), variable messages are normalized so the removed inward scales are added back in.
+    double GetLogZ() const
     {
-        FSumProductMessageFloatType Z = 1;
+        double LogZ = 0.0;
+        for (double LogScale : InwardLogScales) LogZ += LogScale;
         for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
         {
-            FSumProductMessageFloatType DisjointSubgraphZ = 0;
+            FSumProductMessageFloatType DisjointSubgraphZ = FMessagePolicy::Zero();
             for (int32 Value = 0; Value < FactorGraph->GetStateCount(RootFlatRandomVariableIndex); ++Value)
-            {
-                FSumProductMessageFloatType UnnormalizedProb = 1;
-                for (const FConcordFactorHandleBase<FFloatType>* NeighboringHandle : FactorGraph->GetNeighboringHandles(RootFlatRandomVariableIndex))
-                    UnnormalizedProb *= Messages.VariableMessageFactors[RootFlatRandomVariableIndex][NeighboringHandle][Value];
-                DisjointSubgraphZ += UnnormalizedProb;
-            }
-            Z *= DisjointSubgraphZ;
+                FMessagePolicy::Add(DisjointSubgraphZ, Messages.GetVariableMessageProduct(RootFlatRandomVariableIndex, Value));
+            LogZ += FMessagePolicy::ToLog(DisjointSubgraphZ);
         }
-        return Z;
+        return LogZ;
     }
 
-    const auto& GetVariableMessageFactors() const { return Messages.VariableMessageFactors; }
+    double GetZ() const { return exp(GetLogZ()); }
 private:
     const FConcordFactorGraph<FFloatType>* FactorGraph;
     FConcordExpressionContextMutable<FFloatType> Context;
-    typename FConcordFactorHandleBase<FFloatType>:: template FSumProductMessages<FSumProductMessageFloatType> Messages;
+    FConcordSumProductMessages<FMessagePolicy> Messages;
+    TArray<FSumProductMessageFloatType> PotentialTables;
+    TArray<bool> PotentialTablesValid; // not a bit array, tables are updated concurrently by the inward tasks
+    TArray<bool> PotentialTablesSparse;
+    TArray<TArray<int32>> NonZeroPotentialIndices; // per sparse handle, the factor message indices of the non-zero potentials
+    TArray<int32> NonZeroPotentialCounts;
+    TArray<int32> DomainOffsets; // per random variable + 1, into Domains
+    TArray<bool> Domains; // per random variable and value, whether PruneDomains() kept the value
+    TArray<bool> MessageDomains; // the domains the messages were computed with, handles next to differing ones are dirty
+    TArray<int32> SubgraphIndices; // per random variable, its disjoint subgraph
+    TArray<TArray<int32>> SubgraphFlatRandomVariableIndices; // per disjoint subgraph
+    bool bDomainsPruned;
+    TArray<double> InwardLogScales; // per handle, the log of the scale removed from its inward message
+    FConcordHandleParameterDependencies ParameterDependencies;
+    TArray<int32> ParentFlatRandomVariableIndices; // per handle, the target of its inward message
+    TArray<int32> ParentHandleIndices; // per random variable, INDEX_NONE for roots
+    TArray<int32> InwardHandleOrder;
+    TArray<bool> DirtyHandles;
+    TArray<uint64> SubtreeCosts; // per random variable, the cost of all inward messages below it
+    uint64 TotalCost;
+    uint64 MinTaskCost;
+    float MaxSparseDensity;
+    bool bFullInwardPassRequired;
     friend class FSumProductTask;
+    friend class FSumProductOutwardTask;
 
-    void Reset()
+    void InitParameterDependencies()
     {
-        for (auto& HandleValuesPair : Messages.FactorMessages) for (auto& Value : HandleValuesPair.Value) Value = 1;
-        for (auto& VariableMessageFactors : Messages.VariableMessageFactors) for (auto& HandleValuesPair : VariableMessageFactors) for (auto& Value : HandleValuesPair.Value) Value = 0;
+        ParameterDependencies.Init(*FactorGraph, Context.IntParameters.Num(), Context.FloatParameters.Num());
     }
 
-    void SendSumProductMessage(const FConcordFactorHandleBase<FFloatType>* FromHandle, int32 TargetFlatRandomVariableIndex)
+    void InitTree()
     {
-        if constexpr (std::is_same_v<FSumProductMessageFloatType, double>)
-            FromHandle->SendSumProductMessageDouble(Context, Messages, TargetFlatRandomVariableIndex);
+        ParentFlatRandomVariableIndices.Init(INDEX_NONE, FactorGraph->GetHandles().Num());
+        ParentHandleIndices.Init(INDEX_NONE, FactorGraph->GetRandomVariableCount());
+        InwardHandleOrder.Reset(FactorGraph->GetHandles().Num());
+        DirtyHandles.Init(false, FactorGraph->GetHandles().Num());
+        SubtreeCosts.Init(0, FactorGraph->GetRandomVariableCount());
+        TotalCost = 0;
+        for (int32 RootFlatRandomVariableIndex : FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices())
+            TotalCost += InitTree(RootFlatRandomVariableIndex, INDEX_NONE);
+
+        // parents come before their children in the reversed inward order
+        const TArray<int32>& RootFlatRandomVariableIndices = FactorGraph->GetDisjointSubgraphRootFlatRandomVariableIndices();
+        SubgraphIndices.Init(INDEX_NONE, FactorGraph->GetRandomVariableCount());
+        for (int32 SubgraphIndex = 0; SubgraphIndex < RootFlatRandomVariableIndices.Num(); ++SubgraphIndex)
+            SubgraphIndices[RootFlatRandomVariableIndices[SubgraphIndex]] = SubgraphIndex;
+        for (int32 OrderIndex = InwardHandleOrder.Num() - 1; OrderIndex >= 0; --OrderIndex)
+        {
+            const int32 HandleIndex = InwardHandleOrder[OrderIndex];
+            for (int32 FlatRandomVariableIndex : GetHandle(HandleIndex)->GetNeighboringFlatRandomVariableIndices())
+                SubgraphIndices[FlatRandomVariableIndex] = SubgraphIndices[ParentFlatRandomVariableIndices[HandleIndex]];
+        }
+        SubgraphFlatRandomVariableIndices.Reset();
+        SubgraphFlatRandomVariableIndices.SetNum(RootFlatRandomVariableIndices.Num());
+        for (int32 FlatRandomVariableIndex = 0; FlatRandomVariableIndex < SubgraphIndices.Num(); ++FlatRandomVariableIndex)
+            SubgraphFlatRandomVariableIndices[SubgraphIndices[FlatRandomVariableIndex]].Add(FlatRandomVariableIndex);
+    }
+
+    uint64 InitTree(int32 FromIndex, int32 ToHandleIndex)
+    {
+        ParentHandleIndices[FromIndex] = ToHandleIndex;
+        uint64& SubtreeCost = SubtreeCosts[FromIndex];
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+            {
+                ParentFlatRandomVariableIndices[NeighboringHandleIndex] = FromIndex;
+                SubtreeCost += GetLayout().GetFactorMessageNum(NeighboringHandleIndex);
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
+                    if (NeighboringFlatRandomVariableIndex != FromIndex)
+                        SubtreeCost += InitTree(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex);
+                InwardHandleOrder.Add(NeighboringHandleIndex);
+            }
+        return SubtreeCost;
+    }
+
+    void UpdatePotentialTable(int32 HandleIndex)
+    {
+        const int32 Num = Messages.Layout.GetFactorMessageNum(HandleIndex);
+        FSumProductMessageFloatType* PotentialTable = PotentialTables.GetData() + Messages.Layout.FactorMessageOffsets[HandleIndex];
+        if constexpr (std::is_same_v<FSumProductMessageFloatType, FFloatType>)
+        {
+            GetHandle(HandleIndex)->ComputeScoreTable(Context, Messages.Layout.StateCounts, MakeArrayView(PotentialTable, Num));
+            for (int32 Index = 0; Index < Num; ++Index) PotentialTable[Index] = FMessagePolicy::FromScore(PotentialTable[Index]);
+        }
         else
-            FromHandle->SendSumProductMessage(Context, Messages, TargetFlatRandomVariableIndex);
+        {
+            thread_local TArray<FFloatType> Scores; // inward tasks update tables concurrently
+            Scores.SetNumUninitialized(Num, false);
+            GetHandle(HandleIndex)->ComputeScoreTable(Context, Messages.Layout.StateCounts, Scores);
+            for (int32 Index = 0; Index < Num; ++Index) PotentialTable[Index] = FMessagePolicy::FromScore(Scores[Index]);
+        }
+        int32 NonZeroCount = 0;
+        for (int32 Index = 0; Index < Num; ++Index)
+            if (PotentialTable[Index] != FMessagePolicy::Zero()) ++NonZeroCount;
+
+        // Hard constraints zero out most of their table, the factor messages of zero potentials stay zero whatever the incoming messages.
+        bool& bSparse = PotentialTablesSparse[HandleIndex];
+        TArray<int32>& NonZeroIndices = NonZeroPotentialIndices[HandleIndex];
+        NonZeroPotentialCounts[HandleIndex] = NonZeroCount;
+        bSparse = NonZeroCount <= MaxSparseDensity * Num;
+        NonZeroIndices.Reset();
+        if (bSparse)
+        {
+            NonZeroIndices.Reserve(NonZeroCount);
+            FSumProductMessageFloatType* FactorMessages = Messages.GetFactorMessages(HandleIndex);
+            for (int32 Index = 0; Index < Num; ++Index)
+                if (PotentialTable[Index] != FMessagePolicy::Zero()) NonZeroIndices.Add(Index);
+                else FactorMessages[Index] = FMessagePolicy::Zero();
+        }
+        PotentialTablesValid[HandleIndex] = true;
+    }
+
+    void InitSparsePotentialTables()
+    {
+        PotentialTablesSparse.Init(false, FactorGraph->GetHandles().Num());
+        NonZeroPotentialIndices.Reset();
+        NonZeroPotentialIndices.SetNum(FactorGraph->GetHandles().Num());
+        NonZeroPotentialCounts.Init(0, FactorGraph->GetHandles().Num());
+    }
+
+    void InitDomains()
+    {
+        DomainOffsets.Reset(FactorGraph->GetRandomVariableCount() + 1);
+        DomainOffsets.Add(0);
+        for (int32 StateCount : GetLayout().StateCounts) DomainOffsets.Add(DomainOffsets.Last() + StateCount);
+        Domains.Init(true, DomainOffsets.Last());
+        MessageDomains = Domains;
+        bDomainsPruned = false;
+    }
+
+    const FConcordFactorHandleBase<FFloatType>* GetHandle(int32 HandleIndex) const { return FactorGraph->GetHandles()[HandleIndex].Get(); }
+
+    void Reset()
+    {
+        for (int32 HandleIndex = 0; HandleIndex < PotentialTablesSparse.Num(); ++HandleIndex)
+        {
+            FSumProductMessageFloatType* FactorMessages = Messages.GetFactorMessages(HandleIndex);
+            const FSumProductMessageFloatType Value = PotentialTablesSparse[HandleIndex] ? FMessagePolicy::Zero() : FMessagePolicy::One();
+            for (int32 Index = 0; Index < GetLayout().GetFactorMessageNum(HandleIndex); ++Index) FactorMessages[Index] = Value;
+        }
+        for (auto& Value : Messages.VariableMessageFactors) Value = FMessagePolicy::Zero();
+    }
+
+    using FNeighborValues = TArray<int32, TInlineAllocator<8>>;
+    using FMessageSums = TArray<typename FMessagePolicy::FSum, TInlineAllocator<32>>; // per value of the target random variable
+
+    // Only reads the variation of observed random variables, so concurrent messages into disjoint subtrees do not interfere.
+    void SendSumProductMessage(int32 FromHandleIndex, int32 TargetFlatRandomVariableIndex)
+    {
+        if (!PotentialTablesValid[FromHandleIndex]) UpdatePotentialTable(FromHandleIndex);
+        const TArray<int32>& NeighboringFlatRandomVariableIndices = GetHandle(FromHandleIndex)->GetNeighboringFlatRandomVariableIndices();
+        const int32 TargetNeighborIndex = NeighboringFlatRandomVariableIndices.IndexOfByKey(TargetFlatRandomVariableIndex);
+        const int32 StateCount = Messages.Layout.StateCounts[TargetFlatRandomVariableIndex];
+        const int32 Stride = Messages.Layout.GetNeighboringHandleCount(TargetFlatRandomVariableIndex);
+        FNeighborValues Values;
+        Values.SetNumUninitialized(NeighboringFlatRandomVariableIndices.Num());
+        FMessageSums Sums;
+        Sums.Init(FMessagePolicy::ZeroSum(), StateCount);
+        if (PotentialTablesSparse[FromHandleIndex]) SendSparseSumProductMessage(FromHandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, Values, Sums);
+        else SendSumProductMessageImpl(FromHandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, Values, Sums, 0, 0);
+
+        FSumProductMessageFloatType* TargetMessage = Messages.GetVariableMessageFactors(TargetFlatRandomVariableIndex, 0) + Messages.Layout.GetNeighborSlot(FromHandleIndex, TargetNeighborIndex);
+        for (int32 Value = 0; Value < StateCount; ++Value) TargetMessage[Value * Stride] = FMessagePolicy::GetSum(Sums[Value]);
+        const double LogScale = FMessagePolicy::Normalize(TargetMessage, StateCount, Stride);
+        if (TargetFlatRandomVariableIndex == ParentFlatRandomVariableIndices[FromHandleIndex]) InwardLogScales[FromHandleIndex] = LogScale;
+    }
+
+    // Same as SendSumProductMessageImpl but only over the non-zero potentials, the neighbor values are decoded from the factor message index.
+    void SendSparseSumProductMessage(int32 HandleIndex, const TArray<int32>& NeighboringFlatRandomVariableIndices, int32 TargetNeighborIndex, FNeighborValues& Values, FMessageSums& Sums)
+    {
+        const FConcordFactorGraphLayout& Layout = Messages.Layout;
+        const FSumProductMessageFloatType* PotentialTable = PotentialTables.GetData() + Layout.FactorMessageOffsets[HandleIndex];
+        FSumProductMessageFloatType* FactorMessages = Messages.GetFactorMessages(HandleIndex);
+        for (int32 FactorMessageIndex : NonZeroPotentialIndices[HandleIndex])
+        {
+            bool bObservedValues = true;
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num() && bObservedValues; ++Index)
+            {
+                const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[Index];
+                Values[Index] = FactorMessageIndex / Layout.GetNeighborStride(HandleIndex, Index) % Layout.StateCounts[FlatRandomVariableIndex];
+                bObservedValues = Context.ObservationMask[FlatRandomVariableIndex] ? Values[Index] == Context.Variation[FlatRandomVariableIndex] : IsInDomain(FlatRandomVariableIndex, Values[Index]);
+            }
+            if (!bObservedValues) continue;
+
+            FSumProductMessageFloatType FactorMessageValue = PotentialTable[FactorMessageIndex];
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                if (Index != TargetNeighborIndex)
+                    FactorMessageValue = FMessagePolicy::Multiply(FactorMessageValue, Messages.GetVariableMessageProduct(NeighboringFlatRandomVariableIndices[Index], Values[Index], Layout.GetNeighborSlot(HandleIndex, Index)));
+            FactorMessages[FactorMessageIndex] = FactorMessageValue;
+            FMessagePolicy::AddToSum(Sums[Values[TargetNeighborIndex]], FactorMessageValue);
+        }
+    }
+
+    void SendSumProductMessageImpl(int32 HandleIndex, const TArray<int32>& NeighboringFlatRandomVariableIndices, int32 TargetNeighborIndex, FNeighborValues& Values, FMessageSums& Sums, int32 FactorMessageIndex, int32 NeighborIndex)
+    {
+        const FConcordFactorGraphLayout& Layout = Messages.Layout;
+        if (NeighborIndex == NeighboringFlatRandomVariableIndices.Num())
+        {
+            FSumProductMessageFloatType FactorMessageValue = PotentialTables[Layout.FactorMessageOffsets[HandleIndex] + FactorMessageIndex];
+            for (int32 Index = 0; Index < NeighboringFlatRandomVariableIndices.Num(); ++Index)
+                if (Index != TargetNeighborIndex)
+                    FactorMessageValue = FMessagePolicy::Multiply(FactorMessageValue, Messages.GetVariableMessageProduct(NeighboringFlatRandomVariableIndices[Index], Values[Index], Layout.GetNeighborSlot(HandleIndex, Index)));
+            Messages.GetFactorMessages(HandleIndex)[FactorMessageIndex] = FactorMessageValue;
+            FMessagePolicy::AddToSum(Sums[Values[TargetNeighborIndex]], FactorMessageValue);
+            return;
+        }
+
+        const int32 FlatRandomVariableIndex = NeighboringFlatRandomVariableIndices[NeighborIndex];
+        const int32 FactorMessageStride = Layout.GetNeighborStride(HandleIndex, NeighborIndex);
+        int32& Value = Values[NeighborIndex];
+        if (Context.ObservationMask[FlatRandomVariableIndex])
+        {
+            Value = Context.Variation[FlatRandomVariableIndex];
+            SendSumProductMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, Values, Sums, FactorMessageIndex + Value * FactorMessageStride, NeighborIndex + 1);
+        }
+        else for (Value = 0; Value < Layout.StateCounts[FlatRandomVariableIndex]; ++Value)
+        {
+            if (IsInDomain(FlatRandomVariableIndex, Value))
+                SendSumProductMessageImpl(HandleIndex, NeighboringFlatRandomVariableIndices, TargetNeighborIndex, Values, Sums, FactorMessageIndex, NeighborIndex + 1);
+            FactorMessageIndex += FactorMessageStride;
+        }
     }
 
     class FSumProductTask
     {
         const int32 FromIndex;
-        const FConcordFactorHandleBase<FFloatType>* const ToHandle;
-        FConcordFactorGraphSumProduct<FFloatType, FSumProductMessageFloatType>* const SumProduct;
+        const int32 ToHandleIndex;
+        FConcordFactorGraphSumProduct* const SumProduct;
     public:
-        FSumProductTask(int32 InFromIndex, const FConcordFactorHandleBase<FFloatType>* InToHandle, FConcordFactorGraphSumProduct<FFloatType, FSumProductMessageFloatType>* InSumProduct)
-            : FromIndex(InFromIndex), ToHandle(InToHandle), SumProduct(InSumProduct)
+        FSumProductTask(int32 InFromIndex, int32 InToHandleIndex, FConcordFactorGraphSumProduct* InSumProduct)
+            : FromIndex(InFromIndex), ToHandleIndex(InToHandleIndex), SumProduct(InSumProduct)
         {}
         FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FConcordExactSamplerSumProductTask, STATGROUP_TaskGraphTasks); }
         static ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyThread; }
         static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
         void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
         {
-            for (const FConcordFactorHandleBase<FFloatType>* NeighboringHandle : SumProduct->FactorGraph->GetNeighboringHandles(FromIndex))
-                if (NeighboringHandle != ToHandle)
-                    SumProduct->SendSumProductMessage(NeighboringHandle, FromIndex);
+            SumProduct->RunInwardCoarsened(FromIndex, ToHandleIndex);
         }
     };
 
-    FGraphEventRef RunInwardParallelized(int32 FromIndex, const FConcordFactorHandleBase<FFloatType>* ToHandle)
+    // Spawns one task per subtree that is at least MinTaskCost, cheaper subtrees are folded into the task of their parent.
+    // The task graph workers steal queued tasks, so coarse subtrees of unequal size still balance.
+    FGraphEventRef RunInwardParallelized(int32 FromIndex, int32 ToHandleIndex)
     {
         FGraphEventArray OutstandingEvents;
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ToHandle)
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
-                    if (NeighboringFlatRandomVariableIndex != FromIndex)
-                        if (FactorGraph->GetNeighboringHandles(NeighboringFlatRandomVariableIndex).Num() > 1) // only spawn a task if there is work to do
-                            OutstandingEvents.Add(RunInwardParallelized(NeighboringFlatRandomVariableIndex, NeighboringHandle));
-        return TGraphTask<FSumProductTask>::CreateTask(&OutstandingEvents).ConstructAndDispatchWhenReady(FromIndex, ToHandle, this);
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
+                    if (NeighboringFlatRandomVariableIndex != FromIndex && IsTaskWorthy(NeighboringFlatRandomVariableIndex))
+                        OutstandingEvents.Add(RunInwardParallelized(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex));
+        return TGraphTask<FSumProductTask>::CreateTask(&OutstandingEvents).ConstructAndDispatchWhenReady(FromIndex, ToHandleIndex, this);
+    }
+
+    void RunInwardCoarsened(int32 FromIndex, int32 ToHandleIndex)
+    {
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
+                    if (NeighboringFlatRandomVariableIndex != FromIndex && !IsTaskWorthy(NeighboringFlatRandomVariableIndex))
+                        RunInward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex);
+
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                SendSumProductMessage(NeighboringHandleIndex, FromIndex);
     }
 
-    void RunInward(int32 FromIndex, const FConcordFactorHandleBase<FFloatType>* ToHandle)
+    void RunInward(int32 FromIndex, int32 ToHandleIndex)
     {
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ToHandle)
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
                     if (NeighboringFlatRandomVariableIndex != FromIndex)
-                        RunInward(NeighboringFlatRandomVariableIndex, NeighboringHandle);
+                        RunInward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex);
 
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ToHandle)
-                SendSumProductMessage(NeighboringHandle, FromIndex);
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ToHandleIndex)
+                SendSumProductMessage(NeighboringHandleIndex, FromIndex);
     }
 
-    void RunOutward(int32 FromIndex, const FConcordFactorHandleBase<float>* ParentHandle)
+    class FSumProductOutwardTask
+    {
+        const int32 FromIndex;
+        const int32 ParentHandleIndex;
+        FConcordFactorGraphSumProduct* const SumProduct;
+    public:
+        FSumProductOutwardTask(int32 InFromIndex, int32 InParentHandleIndex, FConcordFactorGraphSumProduct* InSumProduct)
+            : FromIndex(InFromIndex), ParentHandleIndex(InParentHandleIndex), SumProduct(InSumProduct)
+        {}
+        FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FConcordExactSamplerSumProductOutwardTask, STATGROUP_TaskGraphTasks); }
+        static ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyThread; }
+        static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
+        void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+        {
+            SumProduct->RunOutward(FromIndex, ParentHandleIndex, MyCompletionGraphEvent.GetReference());
+        }
+    };
+
+    // Once the message into a child random variable is sent its subtree is independent of its siblings,
+    // so costly subtrees are dispatched as tasks that the completion event of the current task waits for.
+    void RunOutward(int32 FromIndex, int32 ParentHandleIndex, FGraphEvent* CompletionEvent = nullptr)
     {
-        for (const auto* NeighboringHandle : FactorGraph->GetNeighboringHandles(FromIndex))
-            if (NeighboringHandle != ParentHandle)
-                for (int32 NeighboringFlatRandomVariableIndex : NeighboringHandle->GetNeighboringFlatRandomVariableIndices())
+        for (int32 NeighboringHandleIndex : GetLayout().GetNeighboringHandleIndices(FromIndex))
+            if (NeighboringHandleIndex != ParentHandleIndex)
+                for (int32 NeighboringFlatRandomVariableIndex : GetHandle(NeighboringHandleIndex)->GetNeighboringFlatRandomVariableIndices())
                     if (NeighboringFlatRandomVariableIndex != FromIndex)
                     {
-                        SendSumProductMessage(NeighboringHandle, NeighboringFlatRandomVariableIndex);
-                        RunOutward(NeighboringFlatRandomVariableIndex, NeighboringHandle);
+                        SendSumProductMessage(NeighboringHandleIndex, NeighboringFlatRandomVariableIndex);
+                        if (CompletionEvent && IsTaskWorthy(NeighboringFlatRandomVariableIndex))
+                            CompletionEvent->DontCompleteUntil(TGraphTask<FSumProductOutwardTask>::CreateTask().ConstructAndDispatchWhenReady(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex, this));
+                        else RunOutward(NeighboringFlatRandomVariableIndex, NeighboringHandleIndex, CompletionEvent);
                     }
     }
 };
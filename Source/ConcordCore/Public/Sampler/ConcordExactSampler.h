@@ -13,19 +13,38 @@ class CONCORDCORE_API FConcordExactSampler : public FConcordSampler
 public:
     FConcordExactSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
                          TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
-                         bool bInMaximizeScore);
+                         bool bInMaximizeScore, uint64 InMinTaskCost);
+    bool CanSampleBestVariations() const override { return true; }
 private:
     float SampleVariation() override;
+    void SampleVariations(int32 Count, TArray<FConcordVariation>& OutVariations) override;
+    void SampleBestVariations(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores) override;
 #if WITH_EDITOR
     float SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals) override;
     bool bInitSumProductDone;
 #endif
+    bool bInitMaxSumDone;
     FConcordFactorGraphMaxSum<float> MaxSum;
-    FConcordFactorGraphSumProduct<float, double> SumProduct;
+    using FMessagePolicy = FConcordSumProductLogSpace<float>;
+    using FMessage = FMessagePolicy::FMessage;
+    FConcordFactorGraphSumProduct<float, FMessagePolicy> SumProduct;
 
+    // Per task state of the ancestral sampling, tasks for subtrees are only spawned if CompletionEvent is set.
+    struct FAncestralSamplingScratch
+    {
+        TArray<FMessage> Distribution;
+        FConcordRandomStream RandomStream;
+        FGraphEvent* CompletionEvent;
+    };
+    class FAncestralSamplingTask;
+
+    bool RunSumProductInward(); // false if the observations are infeasible
+    void InvalidateMaxSumScoreTables();
     float DoAncestralSampling();
-    void DoAncestralSampling(const FConcordFactorHandleBase<float>* FromHandle, int32 ToIndex, TArray<double>& DistributionScratch);
-    void AncestralSamplingImpl(const FConcordFactorHandleBase<float>* FromHandle, int32 ToIndex, int32 NeighboringIndicesIndex, int32 FactorMessageIndex, int32 FactorMessageStride, double& Acc);
+    void DoAncestralSampling(FConcordVariation& OutVariation, FConcordRandomStream InRandomStream, bool bParallelize, const TArray<FConcordAliasTable<FMessage>>* RootAliasTables = nullptr) const;
+    void DoAncestralSampling(FConcordVariation& OutVariation, int32 FromHandleIndex, int32 ToIndex, FAncestralSamplingScratch& Scratch) const;
+    void DoAncestralSamplingBelow(FConcordVariation& OutVariation, int32 FromIndex, int32 ParentHandleIndex, FAncestralSamplingScratch& Scratch) const;
+    void AncestralSamplingImpl(FConcordVariation& OutVariation, int32 FromHandleIndex, int32 NeighboringIndicesIndex, int32 FactorMessageIndex, FMessage& Acc) const;
 #if WITH_EDITOR
     void GetMarginals(FConcordProbabilities& OutMarginals);
 #endif
@@ -41,9 +60,17 @@ public:
     UPROPERTY(EditAnywhere, Category = "Exact Sampler")
     bool bMergeCycles;
 
+    // Runs graphs with cycles through a junction tree along a min-fill elimination order instead of merging the cycles.
+    UPROPERTY(EditAnywhere, Category = "Exact Sampler")
+    bool bUseJunctionTree;
+
     UPROPERTY(EditAnywhere, Category = "Exact Sampler")
     uint64 ComplexityThreshold;
 
+    // Minimum summed potential table size of a subtree to give it its own task in the parallel inward pass.
+    UPROPERTY(EditAnywhere, Category = "Exact Sampler")
+    uint64 MinTaskCost;
+
     TSharedPtr<FConcordSampler> CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const override;
     EConcordCycleMode GetCycleMode() const override;
 private:
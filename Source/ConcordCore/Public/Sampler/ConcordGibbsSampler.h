@@ -17,8 +17,26 @@ private:
     void SamplingIteration() override;
     void SamplingIteration(float& InOutScore) override;
 
-    TArray<float> Scores;
-    TArray<double> Distribution;
+    // Random variables of the same color share no handle, so they are resampled in parallel, in chunks of fixed size
+    // with their own scratch buffers and random streams to keep seeded runs reproducible on any core count.
+    static constexpr int32 ChunkSize = 64;
+    struct FChunkScratch
+    {
+        TArray<float> Scores;
+        TArray<double> Distribution;
+        FConcordRandomStream RandomStream;
+        float ScoreDelta;
+    };
+    TArray<int32> ColorOffsets; // per color + 1
+    TArray<int32> ColoredFlatRandomVariableIndices;
+    TArray<FChunkScratch> ChunkScratches;
+    FConcordConditionalScoreCache<float> ScoreCache;
+
+    void InitColors();
+    template<bool bTrackScore>
+    float SampleColors();
+    template<bool bTrackScore>
+    void SampleChunk(int32 ColorIndex, int32 ChunkIndex);
 };
 
 UCLASS()
@@ -0,0 +1,26 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordSampler.h"
+#include "FactorGraph/ConcordFactorGraphJunctionTree.h"
+
+// Exact sampler for factor graphs with cycles, created by the exact sampler factory when it uses a junction tree.
+class CONCORDCORE_API FConcordJunctionTreeSampler : public FConcordSampler
+{
+public:
+    FConcordJunctionTreeSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                bool bInMaximizeScore);
+private:
+    float SampleVariation() override;
+#if WITH_EDITOR
+    // Marginals are estimated from MarginalsSampleCount exact samples drawn backwards from one elimination, the cliques only hold one-sided messages.
+    float SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals) override;
+    static constexpr int32 MarginalsSampleCount = 256;
+#endif
+    FConcordFactorGraphJunctionTree<float> JunctionTree;
+
+    void InvalidateJunctionTree();
+};
@@ -0,0 +1,89 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordSampler.h"
+#include "FactorGraph/ConcordFactorGraphSumProduct.h"
+#include "ConcordLoopyBeliefPropagationSampler.generated.h"
+
+UENUM()
+enum class EConcordMessageSchedule : uint8
+{
+    // every handle sends all its messages once per sweep, in handle order
+    RoundRobin,
+    // residual belief propagation, the message with the largest pending residual is sent next. A sent message passes its residual on
+    // as the pending residual of the messages that depend on it, an estimate that saves computing messages twice
+    Residual
+};
+
+// Approximate sampler for factor graphs with cycles. Runs damped loopy sum-product until the message residuals
+// fall below the convergence threshold, then samples the random variables one after another from their beliefs, clamping each
+// sampled value and propagating it through the messages that still change. When maximizing, every random variable takes the value of its largest belief.
+class CONCORDCORE_API FConcordLoopyBeliefPropagationSampler : public FConcordSampler
+{
+public:
+    FConcordLoopyBeliefPropagationSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                          TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                          bool bInMaximizeScore, EConcordMessageSchedule InSchedule, int32 InMaxIterationCount,
+                                          float InConvergenceThreshold, float InDamping);
+private:
+    float SampleVariation() override;
+#if WITH_EDITOR
+    float SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals) override;
+#endif
+    using FMessagePolicy = FConcordSumProductLogSpace<float>;
+    using FMessage = FMessagePolicy::FMessage;
+
+    const EConcordMessageSchedule Schedule;
+    const int32 MaxIterationCount;
+    const float ConvergenceThreshold;
+    const float Damping;
+    FConcordObservationMask ClampMask; // the observation mask plus the random variables sampled so far
+    FConcordFactorGraphSumProduct<float, FMessagePolicy, false> SumProduct;
+    TArray<TPair<int32, int32>> Edges; // handle index and neighbor index of every message
+    TArray<int32> EdgeOffsets; // per handle, the index of the edge to its first neighbor
+    TArray<double> Residuals; // per edge, the pending residual of the residual schedule
+    TArray<bool> EdgesQueued; // per edge, while propagating a clamped value
+    TArray<FMessage> Distribution;
+
+    void RunLoopyFromEnvironment();
+    float SampleVariationFromMessages();
+    void RunLoopy();
+    void RunResidualLoopy();
+    // Calls Func with the edges of the handles around the random variable, except ExcludedHandleIndex, to their other neighbors.
+    template<typename FFunc>
+    void ForEachEdgeFrom(int32 FlatRandomVariableIndex, int32 ExcludedHandleIndex, FFunc&& Func) const;
+    void PropagateClamp(int32 FlatRandomVariableIndex);
+    void GetBelief(int32 FlatRandomVariableIndex);
+};
+
+UCLASS()
+class CONCORDCORE_API UConcordLoopyBeliefPropagationSamplerFactory : public UConcordSamplerFactory
+{
+    GENERATED_BODY()
+public:
+    UConcordLoopyBeliefPropagationSamplerFactory()
+        : Schedule(EConcordMessageSchedule::Residual)
+        , MaxIterationCount(50)
+        , ConvergenceThreshold(1e-3f)
+        , Damping(0.5f)
+    {}
+
+    UPROPERTY(EditAnywhere, Category = "Loopy Belief Propagation Sampler")
+    EConcordMessageSchedule Schedule;
+
+    UPROPERTY(EditAnywhere, Category = "Loopy Belief Propagation Sampler", meta=(ClampMin=1))
+    int32 MaxIterationCount;
+
+    // Largest change of a normalized message within a sweep at which the messages count as converged.
+    UPROPERTY(EditAnywhere, Category = "Loopy Belief Propagation Sampler", meta=(ClampMin=0))
+    float ConvergenceThreshold;
+
+    // Weight of the previous message when a message is updated.
+    UPROPERTY(EditAnywhere, Category = "Loopy Belief Propagation Sampler", meta=(ClampMin=0, ClampMax=0.99))
+    float Damping;
+
+    TSharedPtr<FConcordSampler> CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const override;
+    EConcordCycleMode GetCycleMode() const override;
+};
@@ -0,0 +1,62 @@
+// Copyright 2022 Jan Klimaschewski. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ConcordMarkovChainSampler.h"
+#include "ConcordParallelTemperingSampler.generated.h"
+
+// Runs several Gibbs chains concurrently on a geometric temperature ladder and exchanges the states of neighboring
+// temperatures after every sweep. The variation is taken from the cold chain, or from the best chain when maximizing.
+class CONCORDCORE_API FConcordParallelTemperingSampler : public FConcordMarkovChainSampler
+{
+public:
+    FConcordParallelTemperingSampler(TSharedRef<const FConcordFactorGraph<float>> InFactorGraph,
+                                     TSharedRef<FConcordFactorGraphEnvironment<float>> InEnvironment,
+                                     bool bInMaximizeScore, int32 InBurnIn, int32 InMarginalsIterationCount,
+                                     int32 ChainCount, float MaxTemperature);
+private:
+    TOptional<float> SamplingInitialization() override;
+    void SamplingIteration() override;
+    void SamplingIteration(float& InOutScore) override;
+
+    struct FChain
+    {
+        FChain(FConcordParallelTemperingSampler& Sampler, float InInverseTemperature);
+
+        FConcordVariation Variation;
+        FConcordFactorGraphSamplingUtils<float> SamplingUtils;
+        FConcordRandomStream RandomStream;
+        float InverseTemperature;
+        float Score;
+        TArray<float> Scores;
+        TArray<double> Distribution;
+
+        void Sweep(const FConcordSampler& Sampler);
+    };
+    TArray<TUniquePtr<FChain>> Chains; // by ascending temperature
+    bool bSwapEven;
+
+    int32 RunChains();
+};
+
+UCLASS()
+class CONCORDCORE_API UConcordParallelTemperingSamplerFactory : public UConcordMarkovChainSamplerFactory
+{
+    GENERATED_BODY()
+public:
+    UConcordParallelTemperingSamplerFactory()
+        : ChainCount(4)
+        , MaxTemperature(4.0f)
+    {}
+
+    UPROPERTY(EditAnywhere, Category = "Parallel Tempering Sampler", meta=(ClampMin=1))
+    int32 ChainCount;
+
+    // Temperature of the hottest chain, the others are spaced geometrically down to 1. A value of 1 runs independent chains.
+    UPROPERTY(EditAnywhere, Category = "Parallel Tempering Sampler", meta=(ClampMin=1))
+    float MaxTemperature;
+
+    TSharedPtr<FConcordSampler> CreateSampler(TSharedRef<const FConcordFactorGraph<float>> FactorGraph, TOptional<FString>& OutErrorMessage) const override;
+    EConcordCycleMode GetCycleMode() const override;
+};
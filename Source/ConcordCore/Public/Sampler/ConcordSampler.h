@@ -24,9 +24,17 @@ private:
 #if WITH_EDITOR
     virtual float SampleVariationAndInferMarginals(FConcordProbabilities& OutMarginals) = 0;
 #endif
+protected:
+    // samples Count variations from the current environment, calls SampleVariation repeatedly by default
+    virtual void SampleVariations(int32 Count, TArray<FConcordVariation>& OutVariations);
+    // finds up to K best variations with their scores, only called if CanSampleBestVariations()
+    virtual void SampleBestVariations(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores);
 public:
+    virtual bool CanSampleBestVariations() const { return false; }
     void GetVariationFromEnvironment();
     float SampleVariationSync();
+    void SampleVariationsBatch(int32 Count, TArray<FConcordVariation>& OutVariations);
+    void SampleBestVariationsSync(int32 K, TArray<FConcordVariation>& OutVariations, TArray<float>& OutScores);
     void SampleVariationAsync();
     bool IsSamplingVariation() const;
     TOptional<float> GetScoreIfDoneSampling();
@@ -35,7 +43,11 @@ public:
 #endif
     FConcordProbabilities GetConditionalProbabilities();
 
+    // Makes the following samplings reproducible, instance samplers get seeds derived from Seed.
+    void SetSeed(uint64 Seed);
+
     void SetColumnsFromOutputs(FConcordPatternData& OutPatternData) const;
+    void SetColumnsFromOutputs(const FConcordVariation& InVariation, FConcordPatternData& OutPatternData) const;
     void FillCrateWithOutputs(FConcordCrateData& OutCrateData) const;
 
     const FConcordVariation& GetVariation() const { return Variation; }
@@ -53,11 +65,12 @@ private:
     TFuture<float> FutureScore;
 protected:
     FConcordFactorGraphSamplingUtils<float> SamplingUtils;
+    FConcordRandomStream RandomStream;
 private:
     void RunInstanceSamplers();
     template<typename FValue>
     void FillInstanceInputs(const TPair<FName, TSharedRef<FConcordSampler>>& InstanceSampler, const TPair<FName, FConcordFactorGraphBlock>& Parameter);
-    void SetColumnFromOutput(const FConcordFactorGraph<float>::FOutput* Output, TArray<int32>& TargetArray, TArray<int32>* PreviousArray) const;
+    void SetColumnFromOutput(const FConcordExpressionContext<float>& Context, const FConcordFactorGraph<float>::FOutput* Output, TArray<int32>& TargetArray, TArray<int32>* PreviousArray) const;
 };
 
 UCLASS(Abstract, EditInlineNew, CollapseCategories)
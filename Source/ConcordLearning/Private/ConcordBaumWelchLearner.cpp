@@ -48,6 +48,7 @@ void FConcordBaumWelchLearner::Mutate(double Deviation)
         for (int32 Index = Block.Offset; Index < Block.Offset + Block.Size; ++Index)
             GetEnvironment()->GetMutableStagingFloatParameters()[Index] += Distribution(Rng);
     }
+    SumProduct.InvalidatePotentialTables();
 }
 
 double FConcordBaumWelchLearner::UpdateAndGetLoss()
@@ -66,7 +67,7 @@ double FConcordBaumWelchLearner::UpdateAndGetLoss()
         EmissionDenominatorSummands.Reset(); EmissionDenominatorSummands.AddZeroed(HiddenStateCount);
         for (const FConcordCrateData& Crate : Dataset.Get())
         {
-            GetEnvironment()->SetCrate(Crate);
+            SetCrate(Crate);
             SumProduct.RunInward();
             SumProduct.RunOutward();
             for (int32 LocalRandomVariableIndex = 0; LocalRandomVariableIndex < HiddenBlock.Size - 1; ++LocalRandomVariableIndex)
@@ -109,7 +110,7 @@ double FConcordBaumWelchLearner::UpdateAndGetLoss()
                 }
                 EmissionDenominatorSummands[AlphaValue] += AlphaMarg[AlphaValue];
             }
-            GetEnvironment()->UnsetCrate(Crate);
+            UnsetCrate(Crate);
         }
 
         const auto& InitialBlock = GetFactorGraph()->GetParameterBlocks<float>()[Settings.Names.Initial];
@@ -149,22 +150,44 @@ double FConcordBaumWelchLearner::UpdateAndGetLoss()
                     Current = FMath::Lerp(Current, Target, Settings.LearningRate);
                 }
         }
+        SumProduct.InvalidatePotentialTables();
     }
 
     // Compute loss
     SumProduct.RunInward();
-    const double LogZ = log(SumProduct.GetZ());
+    const double LogZ = SumProduct.GetLogZ();
     double LogOs = 0.0;
     for (const FConcordCrateData& Crate : Dataset.Get())
     {
-        GetEnvironment()->SetCrate(Crate);
+        SetCrate(Crate);
         SumProduct.RunInward();
-        LogOs += log(SumProduct.GetZ());
-        GetEnvironment()->UnsetCrate(Crate);
+        LogOs += SumProduct.GetLogZ();
+        UnsetCrate(Crate);
     }
     return -(LogOs / Dataset->Num() - LogZ);
 }
 
+void FConcordBaumWelchLearner::SetCrate(const FConcordCrateData& Crate)
+{
+    GetEnvironment()->SetCrate(Crate);
+    if (SetsParameters(Crate)) SumProduct.InvalidatePotentialTables();
+}
+
+void FConcordBaumWelchLearner::UnsetCrate(const FConcordCrateData& Crate)
+{
+    GetEnvironment()->UnsetCrate(Crate);
+    if (SetsParameters(Crate)) SumProduct.InvalidatePotentialTables();
+}
+
+bool FConcordBaumWelchLearner::SetsParameters(const FConcordCrateData& Crate) const
+{
+    if (!Crate.FloatBlocks.IsEmpty()) return true;
+    for (const auto& NameBlockPair : Crate.IntBlocks)
+        if (GetFactorGraph()->GetParameterBlocks<int32>().Contains(NameBlockPair.Key))
+            return true;
+    return false;
+}
+
 FConcordExpressionContextMutable<float> FConcordBaumWelchLearner::GetExpressionContext() const
 {
     return { GetEnvironment()->GetMutableStagingVariation(), GetEnvironment()->GetStagingMask(), GetEnvironment()->GetStagingIntParameters(), GetEnvironment()->GetStagingFloatParameters() };
@@ -189,10 +212,12 @@ void FConcordBaumWelchLearner::SetAlpha(int32 FlatRandomVariableIndex, const FCo
     {
         Alpha[Value] = 1;
         AlphaMarg[Value] = 1;
-        for (const auto* NeighboringHandle : GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex))
+        const auto& NeighboringHandles = GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex);
+        const float* Factors = SumProduct.GetMessages().GetVariableMessageFactors(FlatRandomVariableIndex, Value);
+        for (int32 Slot = 0; Slot < NeighboringHandles.Num(); ++Slot)
         {
-            const double Factor = SumProduct.GetVariableMessageFactors()[FlatRandomVariableIndex][NeighboringHandle][Value];
-            if (NeighboringHandle != NextHandle) Alpha[Value] *= Factor;
+            const double Factor = Factors[Slot];
+            if (NeighboringHandles[Slot] != NextHandle) Alpha[Value] *= Factor;
             AlphaMarg[Value] *= Factor;
             Sum += AlphaMarg[Value];
         }
@@ -207,9 +232,11 @@ void FConcordBaumWelchLearner::SetBeta(int32 FlatRandomVariableIndex, int32 Alph
     {
         Beta[Value] = Alpha[AlphaValue];
         Beta[Value] *= exp(double(TransitionScores[AlphaValue * Beta.Num() + Value]));
-        for (const auto* NeighboringHandle : GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex))
-            if (NeighboringHandle != PreviousHandle)
-                Beta[Value] *= SumProduct.GetVariableMessageFactors()[FlatRandomVariableIndex][NeighboringHandle][Value];
+        const auto& NeighboringHandles = GetFactorGraph()->GetNeighboringHandles(FlatRandomVariableIndex);
+        const float* Factors = SumProduct.GetMessages().GetVariableMessageFactors(FlatRandomVariableIndex, Value);
+        for (int32 Slot = 0; Slot < NeighboringHandles.Num(); ++Slot)
+            if (NeighboringHandles[Slot] != PreviousHandle)
+                Beta[Value] *= Factors[Slot];
         Sum += Beta[Value];
     }
     for (double& Prob : Beta) Prob /= Sum;
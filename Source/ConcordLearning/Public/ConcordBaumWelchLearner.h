@@ -38,6 +38,9 @@ public:
 private:
     double UpdateAndGetLoss() override;
     FConcordExpressionContextMutable<float> GetExpressionContext() const;
+    void SetCrate(const FConcordCrateData& Crate);
+    void UnsetCrate(const FConcordCrateData& Crate);
+    bool SetsParameters(const FConcordCrateData& Crate) const;
 
     const FConcordFactorGraph<float>* GetFactorGraph() const { return &Settings.FactorGraph.Get(); }
     FConcordFactorGraphEnvironment<float>* GetEnvironment() const { return Settings.Environment.Get(); }
@@ -49,7 +52,7 @@ private:
     float ProbToScore(double Prob) const;
 
     FConcordBaumWelchLearnerSettings Settings;
-    FConcordFactorGraphSumProduct<float, double, false> SumProduct;
+    FConcordFactorGraphSumProduct<float, FConcordSumProductLinear<float>, false> SumProduct;
 
     TArray<double> Alpha;
     TArray<double> AlphaMarg;